@@ -35,33 +35,186 @@ typedef enum SpiceDataType
 }
 SpiceDataType;
 
+typedef enum SpiceChannelKind
+{
+  SPICE_CHANNEL_KIND_MAIN,
+  SPICE_CHANNEL_KIND_INPUTS
+}
+SpiceChannelKind;
+
+typedef struct SpiceLockStats
+{
+  uint64_t acquisitions;
+  uint64_t contended;
+  uint64_t waitNs;
+}
+SpiceLockStats;
+
+typedef enum SpiceKeyMod
+{
+  SPICE_KEYMOD_SHIFT = 1 << 0,
+  SPICE_KEYMOD_ALTGR = 1 << 1
+}
+SpiceKeyMod;
+
+/* maps a unicode codepoint to the scancode (as taken by spice_key_down) and
+ * the modifiers that must be held to type it */
+typedef struct SpiceKeyMap
+{
+  uint32_t codepoint;
+  uint32_t scancode;
+  uint32_t modifiers;
+}
+SpiceKeyMap;
+
+typedef struct SpiceKeyLayout
+{
+  const SpiceKeyMap * keys;
+  size_t              count;
+}
+SpiceKeyLayout;
+
+/* an independent connection to a server, see spice_ctx_new */
+typedef struct Spice SpiceCtx;
+
 typedef void (*SpiceClipboardNotice )(const SpiceDataType type);
 typedef void (*SpiceClipboardData   )(const SpiceDataType type, uint8_t * buffer, uint32_t size);
 typedef void (*SpiceClipboardRelease)();
 typedef void (*SpiceClipboardRequest)(const SpiceDataType type);
+typedef void (*SpiceTypingDone      )(bool completed);
+typedef void (*SpiceReady           )();
+typedef void (*SpiceChannelDead     )(SpiceChannelKind kind);
 
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* starts connecting and returns straight away, the connection and the link
+ * handshake are completed by spice_process which fails if they can't be.
+ * The ready callback is invoked once every channel is up. host may be an
+ * IPv4 or IPv6 address, a host name which is resolved in the background with
+ * its addresses raced against each other, or a unix socket path if port is 0 */
 bool spice_connect(const char * host, const unsigned short port, const char * password);
 void spice_disconnect();
 bool spice_process(int timeout);
 bool spice_ready();
 
+/* reconnect when the connection is lost rather than failing spice_process,
+ * up to attempts times in a row (-1 for no limit, 0 disables) waiting from
+ * minDelay doubling up to maxDelay ms between them. The last session ID is
+ * offered to the server so it can be resumed, input sent meanwhile is held
+ * and sent once the inputs channel is back, along with the held buttons and
+ * keyboard LEDs. The ready callback is invoked again once reconnected */
+bool spice_set_reconnect(int attempts, unsigned int minDelay,
+    unsigned int maxDelay);
+
+/* dead peer detection, a channel the server pings is declared dead once
+ * nothing has been received on it for deadline ms (or twice the server's ping
+ * interval if that is longer). The dead callback is invoked before the
+ * channel is treated as lost, see above. TCP_USER_TIMEOUT and keepalive are
+ * also set from the deadline to catch a peer that stops acknowledging.
+ * 0 (the default) disables this */
+bool spice_set_liveness(unsigned int deadline, SpiceChannelDead cbDeadFn);
+
+/* connect every channel over TLS, call before spice_connect which must then
+ * be given the server's TLS port. The certificate is verified against caFile
+ * (NULL for the system's CAs) and the host given to spice_connect unless
+ * verify is false. The other channels resume the main channel's TLS session
+ * and kTLS is used where available. Fails if built without ENABLE_TLS */
+bool spice_set_tls(bool enable, const char * caFile, bool verify);
+
+/* reactor, the returned fd becomes readable when spice_process needs to be
+ * called and may be added to the application's own epoll or poll set.
+ * spice_wakeup may be called from any thread to interrupt spice_process */
+int  spice_get_fd();
+bool spice_wakeup();
+
+/* the number of bytes waiting to be sent on the channel, callers pushing large
+ * amounts of data (ie, clipboard) can use this to apply backpressure */
+size_t spice_get_queued(SpiceChannelKind kind);
+
+/* counters for the channel's lock since the context was created, contended
+ * acquisitions are those that had to spin or sleep and waitNs is the total
+ * time spent so */
+bool spice_get_lock_stats(SpiceChannelKind kind, SpiceLockStats * stats);
+
+/* service the connection on a library owned thread, optionally pinned to cpu
+ * (-1 for any) and run SCHED_FIFO when priority > 0. While running the
+ * callbacks are queued and invoked from the application's spice_process.
+ *
+ * threads, with or without the I/O thread:
+ *   - the input, typing and clipboard calls, spice_ready, spice_wakeup,
+ *     spice_get_queued and spice_get_lock_stats may be made from any thread
+ *   - spice_disconnect and spice_set_liveness may be made from any thread
+ *     while the I/O thread runs, which they hand their work to. Without it
+ *     they belong to the thread that calls spice_process
+ *   - everything else, ie spice_connect, spice_process, spice_get_fd, the
+ *     other spice_set_* calls and starting or stopping the I/O thread, must
+ *     be made from the thread that calls spice_process
+ *   - callbacks are invoked on the thread that calls spice_process, except
+ *     that without the I/O thread spice_type_cancel invokes the typing done
+ *     callback on the calling thread */
+bool spice_start_io_thread(int cpu, int priority);
+void spice_stop_io_thread();
+
+/* batch input, messages sent between begin and flush are held and written
+ * to the socket together with a single send when flushed */
+bool spice_input_begin();
+bool spice_input_flush();
+
 bool spice_key_down      (uint32_t code);
 bool spice_key_up        (uint32_t code);
+
+/* as above but taking a linux input event code (KEY_*) or a USB HID keyboard
+ * usage, fails if the key has no PC scancode */
+bool spice_key_down_evdev(uint32_t code);
+bool spice_key_up_evdev  (uint32_t code);
+bool spice_key_down_hid  (uint32_t usage);
+bool spice_key_up_hid    (uint32_t usage);
+
+/* send count key transitions, down[i] gives the direction of codes[i]. These
+ * are encoded into a single KEY_SCANCODE message when the server supports it.
+ * Up to 64 transitions are queued atomically with respect to other input */
+bool spice_key_scancodes(const uint32_t * codes, size_t count, const bool * down);
+
+extern const SpiceKeyLayout spice_layout_us;
+
+/* type a UTF-8 string using the given layout at cps characters per second
+ * (0 for as fast as possible). The keys are sent in batches from
+ * spice_process, fails if the string contains a character the layout can't
+ * type or another string is still being typed */
+bool spice_type_text    (const char * text, const SpiceKeyLayout * layout, unsigned int cps);
+bool spice_type_cancel  ();
+bool spice_type_progress(size_t * typed, size_t * total);
+
 bool spice_mouse_mode    (bool     server);
 bool spice_mouse_position(uint32_t x, uint32_t y);
 bool spice_mouse_motion  ( int32_t x,  int32_t y);
+
+/* absolute position for a specific display, positions that can't be sent
+ * yet are replaced by newer ones so only the latest reaches the server */
+bool spice_mouse_display_position(uint8_t display, uint32_t x, uint32_t y);
+
+/* relative motion flow control, once window motion messages are waiting on
+ * an ack from the server further motion is merged into a single delta that
+ * is sent when the next ack arrives. 0 (the default) disables this */
+void spice_set_motion_window(unsigned int window);
 bool spice_mouse_press   (uint32_t button);
 bool spice_mouse_release (uint32_t button);
 
+/* scroll by a high resolution wheel delta, 120 units per notch with positive
+ * values scrolling up. Partial notches accumulate until a whole one can be
+ * sent. The protocol has no horizontal wheel buttons so dx is ignored */
+bool spice_mouse_wheel(int32_t dx, int32_t dy);
+
 bool spice_clipboard_request(SpiceDataType type);
 bool spice_clipboard_grab   (SpiceDataType type);
 bool spice_clipboard_release();
 
+/* at most about 1MB of clipboard data is queued, larger payloads are written
+ * as the socket drains and spice_clipboard_data returns once the last of it
+ * has been queued */
 bool spice_clipboard_data_start(SpiceDataType type, size_t size);
 bool spice_clipboard_data(SpiceDataType type, uint8_t * data, size_t size);
 
@@ -72,6 +225,81 @@ bool spice_set_clipboard_cb(
     SpiceClipboardRelease cbReleaseFn,
     SpiceClipboardRequest cbRequestFn);
 
+bool spice_set_typing_cb(SpiceTypingDone cbDoneFn);
+bool spice_set_ready_cb (SpiceReady      cbReadyFn);
+
+/* sessions, the functions above operate on a default session. Any number of
+ * further sessions can be created with spice_ctx_new, each spice_ctx_*
+ * function behaves exactly as its counterpart but on the given session */
+SpiceCtx * spice_ctx_new ();
+void       spice_ctx_free(SpiceCtx * ctx);
+
+/* the session a callback is being invoked for */
+SpiceCtx * spice_ctx_current();
+void       spice_ctx_set_user(SpiceCtx * ctx, void * user);
+void *     spice_ctx_get_user(SpiceCtx * ctx);
+
+/* service many sessions from a single thread, waiting up to timeout ms for
+ * any of them to need attention. connected[i] is set false once session i
+ * has shut down, after which it must not be passed in again */
+bool spice_ctx_process_all(SpiceCtx * const * ctx, bool * connected,
+    size_t count, int timeout);
+
+bool   spice_ctx_connect(SpiceCtx * ctx, const char * host,
+    const unsigned short port, const char * password);
+void   spice_ctx_disconnect(SpiceCtx * ctx);
+bool   spice_ctx_process(SpiceCtx * ctx, int timeout);
+bool   spice_ctx_ready(SpiceCtx * ctx);
+bool   spice_ctx_set_reconnect(SpiceCtx * ctx, int attempts,
+    unsigned int minDelay, unsigned int maxDelay);
+bool   spice_ctx_set_liveness(SpiceCtx * ctx, unsigned int deadline,
+    SpiceChannelDead cbDeadFn);
+bool   spice_ctx_set_tls(SpiceCtx * ctx, bool enable, const char * caFile,
+    bool verify);
+int    spice_ctx_get_fd(SpiceCtx * ctx);
+bool   spice_ctx_wakeup(SpiceCtx * ctx);
+size_t spice_ctx_get_queued(SpiceCtx * ctx, SpiceChannelKind kind);
+bool   spice_ctx_get_lock_stats(SpiceCtx * ctx, SpiceChannelKind kind,
+    SpiceLockStats * stats);
+bool   spice_ctx_start_io_thread(SpiceCtx * ctx, int cpu, int priority);
+void   spice_ctx_stop_io_thread(SpiceCtx * ctx);
+bool   spice_ctx_input_begin(SpiceCtx * ctx);
+bool   spice_ctx_input_flush(SpiceCtx * ctx);
+bool   spice_ctx_key_down(SpiceCtx * ctx, uint32_t code);
+bool   spice_ctx_key_up(SpiceCtx * ctx, uint32_t code);
+bool   spice_ctx_key_down_evdev(SpiceCtx * ctx, uint32_t code);
+bool   spice_ctx_key_up_evdev(SpiceCtx * ctx, uint32_t code);
+bool   spice_ctx_key_down_hid(SpiceCtx * ctx, uint32_t usage);
+bool   spice_ctx_key_up_hid(SpiceCtx * ctx, uint32_t usage);
+bool   spice_ctx_key_scancodes(SpiceCtx * ctx, const uint32_t * codes,
+    size_t count, const bool * down);
+bool   spice_ctx_type_text(SpiceCtx * ctx, const char * text,
+    const SpiceKeyLayout * layout, unsigned int cps);
+bool   spice_ctx_type_cancel(SpiceCtx * ctx);
+bool   spice_ctx_type_progress(SpiceCtx * ctx, size_t * typed, size_t * total);
+bool   spice_ctx_mouse_mode(SpiceCtx * ctx, bool server);
+bool   spice_ctx_mouse_position(SpiceCtx * ctx, uint32_t x, uint32_t y);
+bool   spice_ctx_mouse_display_position(SpiceCtx * ctx, uint8_t display,
+    uint32_t x, uint32_t y);
+bool   spice_ctx_mouse_motion(SpiceCtx * ctx, int32_t x, int32_t y);
+bool   spice_ctx_mouse_wheel(SpiceCtx * ctx, int32_t dx, int32_t dy);
+void   spice_ctx_set_motion_window(SpiceCtx * ctx, unsigned int window);
+bool   spice_ctx_mouse_press(SpiceCtx * ctx, uint32_t button);
+bool   spice_ctx_mouse_release(SpiceCtx * ctx, uint32_t button);
+bool   spice_ctx_clipboard_request(SpiceCtx * ctx, SpiceDataType type);
+bool   spice_ctx_clipboard_grab(SpiceCtx * ctx, SpiceDataType type);
+bool   spice_ctx_clipboard_release(SpiceCtx * ctx);
+bool   spice_ctx_clipboard_data_start(SpiceCtx * ctx, SpiceDataType type, size_t size);
+bool   spice_ctx_clipboard_data(SpiceCtx * ctx, SpiceDataType type,
+    uint8_t * data, size_t size);
+bool   spice_ctx_set_clipboard_cb(SpiceCtx * ctx,
+    SpiceClipboardNotice  cbNoticeFn,
+    SpiceClipboardData    cbDataFn,
+    SpiceClipboardRelease cbReleaseFn,
+    SpiceClipboardRequest cbRequestFn);
+bool   spice_ctx_set_typing_cb(SpiceCtx * ctx, SpiceTypingDone cbDoneFn);
+bool   spice_ctx_set_ready_cb(SpiceCtx * ctx, SpiceReady cbReadyFn);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,294 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "keymap.h"
+
+/* the key tables are written as lists of (source code, scancode) pairs where
+ * scancode is in the PC XT set with 0x100 added for e0 prefixed keys, as
+ * taken by spice_key_down. The wire encoding for the press and release is
+ * worked out by the compiler so the lookup is a single array index */
+
+#define SPICE_KEY_DOWN_CODE(c) \
+  ((c) < 0x100 ? (uint32_t)(c) : (uint32_t)(0xe0 | (((c) - 0x100) << 8)))
+
+#define SPICE_KEY_UP_CODE(c) \
+  ((c) < 0x100 ? (uint32_t)((c) | 0x80) : (uint32_t)(0x80e0 | (((c) - 0x100) << 8)))
+
+#define SPICE_KEYMAP_ENTRY(key, code) \
+  [key] = { SPICE_KEY_DOWN_CODE(code), SPICE_KEY_UP_CODE(code) },
+
+// linux input event codes, 1 to 83 match the XT set directly
+#define EVDEV_KEYS(X) \
+  /* ESC              */ X(0x01, 0x001) \
+  X(0x02, 0x002) \
+  X(0x03, 0x003) \
+  X(0x04, 0x004) \
+  X(0x05, 0x005) \
+  X(0x06, 0x006) \
+  X(0x07, 0x007) \
+  X(0x08, 0x008) \
+  X(0x09, 0x009) \
+  X(0x0a, 0x00a) \
+  X(0x0b, 0x00b) \
+  X(0x0c, 0x00c) \
+  X(0x0d, 0x00d) \
+  /* BACKSPACE        */ X(0x0e, 0x00e) \
+  /* TAB              */ X(0x0f, 0x00f) \
+  X(0x10, 0x010) \
+  X(0x11, 0x011) \
+  X(0x12, 0x012) \
+  X(0x13, 0x013) \
+  X(0x14, 0x014) \
+  X(0x15, 0x015) \
+  X(0x16, 0x016) \
+  X(0x17, 0x017) \
+  X(0x18, 0x018) \
+  X(0x19, 0x019) \
+  X(0x1a, 0x01a) \
+  X(0x1b, 0x01b) \
+  /* ENTER            */ X(0x1c, 0x01c) \
+  /* LEFTCTRL         */ X(0x1d, 0x01d) \
+  X(0x1e, 0x01e) \
+  X(0x1f, 0x01f) \
+  X(0x20, 0x020) \
+  X(0x21, 0x021) \
+  X(0x22, 0x022) \
+  X(0x23, 0x023) \
+  X(0x24, 0x024) \
+  X(0x25, 0x025) \
+  X(0x26, 0x026) \
+  X(0x27, 0x027) \
+  X(0x28, 0x028) \
+  X(0x29, 0x029) \
+  /* LEFTSHIFT        */ X(0x2a, 0x02a) \
+  X(0x2b, 0x02b) \
+  X(0x2c, 0x02c) \
+  X(0x2d, 0x02d) \
+  X(0x2e, 0x02e) \
+  X(0x2f, 0x02f) \
+  X(0x30, 0x030) \
+  X(0x31, 0x031) \
+  X(0x32, 0x032) \
+  X(0x33, 0x033) \
+  X(0x34, 0x034) \
+  X(0x35, 0x035) \
+  /* RIGHTSHIFT       */ X(0x36, 0x036) \
+  X(0x37, 0x037) \
+  /* LEFTALT          */ X(0x38, 0x038) \
+  /* SPACE            */ X(0x39, 0x039) \
+  /* CAPSLOCK         */ X(0x3a, 0x03a) \
+  X(0x3b, 0x03b) \
+  X(0x3c, 0x03c) \
+  X(0x3d, 0x03d) \
+  X(0x3e, 0x03e) \
+  X(0x3f, 0x03f) \
+  X(0x40, 0x040) \
+  X(0x41, 0x041) \
+  X(0x42, 0x042) \
+  X(0x43, 0x043) \
+  X(0x44, 0x044) \
+  /* NUMLOCK          */ X(0x45, 0x045) \
+  /* SCROLLLOCK       */ X(0x46, 0x046) \
+  X(0x47, 0x047) \
+  X(0x48, 0x048) \
+  X(0x49, 0x049) \
+  X(0x4a, 0x04a) \
+  X(0x4b, 0x04b) \
+  X(0x4c, 0x04c) \
+  X(0x4d, 0x04d) \
+  X(0x4e, 0x04e) \
+  X(0x4f, 0x04f) \
+  X(0x50, 0x050) \
+  X(0x51, 0x051) \
+  X(0x52, 0x052) \
+  X(0x53, 0x053) \
+  /* ZENKAKUHANKAKU   */ X(0x55, 0x076) \
+  /* 102ND            */ X(0x56, 0x056) \
+  /* F11              */ X(0x57, 0x057) \
+  /* F12              */ X(0x58, 0x058) \
+  /* RO               */ X(0x59, 0x073) \
+  /* HENKAN           */ X(0x5c, 0x079) \
+  /* KATAKANAHIRAGANA */ X(0x5d, 0x070) \
+  /* MUHENKAN         */ X(0x5e, 0x07b) \
+  /* KPENTER          */ X(0x60, 0x11c) \
+  /* RIGHTCTRL        */ X(0x61, 0x11d) \
+  /* KPSLASH          */ X(0x62, 0x135) \
+  /* SYSRQ            */ X(0x63, 0x137) \
+  /* RIGHTALT         */ X(0x64, 0x138) \
+  /* HOME             */ X(0x66, 0x147) \
+  /* UP               */ X(0x67, 0x148) \
+  /* PAGEUP           */ X(0x68, 0x149) \
+  /* LEFT             */ X(0x69, 0x14b) \
+  /* RIGHT            */ X(0x6a, 0x14d) \
+  /* END              */ X(0x6b, 0x14f) \
+  /* DOWN             */ X(0x6c, 0x150) \
+  /* PAGEDOWN         */ X(0x6d, 0x151) \
+  /* INSERT           */ X(0x6e, 0x152) \
+  /* DELETE           */ X(0x6f, 0x153) \
+  /* MUTE             */ X(0x71, 0x120) \
+  /* VOLUMEDOWN       */ X(0x72, 0x12e) \
+  /* VOLUMEUP         */ X(0x73, 0x130) \
+  /* POWER            */ X(0x74, 0x15e) \
+  /* KPEQUAL          */ X(0x75, 0x059) \
+  /* KPCOMMA          */ X(0x79, 0x07e) \
+  /* YEN              */ X(0x7c, 0x07d) \
+  /* LEFTMETA         */ X(0x7d, 0x15b) \
+  /* RIGHTMETA        */ X(0x7e, 0x15c) \
+  /* COMPOSE          */ X(0x7f, 0x15d) \
+  /* CALC             */ X(0x8c, 0x121) \
+  /* SLEEP            */ X(0x8e, 0x15f) \
+  /* WAKEUP           */ X(0x8f, 0x163) \
+  /* MAIL             */ X(0x9b, 0x16c) \
+  /* BACK             */ X(0x9e, 0x16a) \
+  /* FORWARD          */ X(0x9f, 0x169) \
+  /* NEXTSONG         */ X(0xa3, 0x119) \
+  /* PLAYPAUSE        */ X(0xa4, 0x122) \
+  /* PREVIOUSSONG     */ X(0xa5, 0x110) \
+  /* STOPCD           */ X(0xa6, 0x124) \
+  /* HOMEPAGE         */ X(0xac, 0x132) \
+  /* SEARCH           */ X(0xd9, 0x165)
+
+// USB HID keyboard/keypad usage page (0x07)
+#define HID_KEYS(X) \
+  /* A                */ X(0x04, 0x01e) \
+  /* B                */ X(0x05, 0x030) \
+  /* C                */ X(0x06, 0x02e) \
+  /* D                */ X(0x07, 0x020) \
+  /* E                */ X(0x08, 0x012) \
+  /* F                */ X(0x09, 0x021) \
+  /* G                */ X(0x0a, 0x022) \
+  /* H                */ X(0x0b, 0x023) \
+  /* I                */ X(0x0c, 0x017) \
+  /* J                */ X(0x0d, 0x024) \
+  /* K                */ X(0x0e, 0x025) \
+  /* L                */ X(0x0f, 0x026) \
+  /* M                */ X(0x10, 0x032) \
+  /* N                */ X(0x11, 0x031) \
+  /* O                */ X(0x12, 0x018) \
+  /* P                */ X(0x13, 0x019) \
+  /* Q                */ X(0x14, 0x010) \
+  /* R                */ X(0x15, 0x013) \
+  /* S                */ X(0x16, 0x01f) \
+  /* T                */ X(0x17, 0x014) \
+  /* U                */ X(0x18, 0x016) \
+  /* V                */ X(0x19, 0x02f) \
+  /* W                */ X(0x1a, 0x011) \
+  /* X                */ X(0x1b, 0x02d) \
+  /* Y                */ X(0x1c, 0x015) \
+  /* Z                */ X(0x1d, 0x02c) \
+  /* 1                */ X(0x1e, 0x002) \
+  /* 2                */ X(0x1f, 0x003) \
+  /* 3                */ X(0x20, 0x004) \
+  /* 4                */ X(0x21, 0x005) \
+  /* 5                */ X(0x22, 0x006) \
+  /* 6                */ X(0x23, 0x007) \
+  /* 7                */ X(0x24, 0x008) \
+  /* 8                */ X(0x25, 0x009) \
+  /* 9                */ X(0x26, 0x00a) \
+  /* 0                */ X(0x27, 0x00b) \
+  /* ENTER            */ X(0x28, 0x01c) \
+  /* ESC              */ X(0x29, 0x001) \
+  /* BACKSPACE        */ X(0x2a, 0x00e) \
+  /* TAB              */ X(0x2b, 0x00f) \
+  /* SPACE            */ X(0x2c, 0x039) \
+  /* MINUS            */ X(0x2d, 0x00c) \
+  /* EQUAL            */ X(0x2e, 0x00d) \
+  /* LEFTBRACE        */ X(0x2f, 0x01a) \
+  /* RIGHTBRACE       */ X(0x30, 0x01b) \
+  /* BACKSLASH        */ X(0x31, 0x02b) \
+  /* HASHTILDE        */ X(0x32, 0x02b) \
+  /* SEMICOLON        */ X(0x33, 0x027) \
+  /* APOSTROPHE       */ X(0x34, 0x028) \
+  /* GRAVE            */ X(0x35, 0x029) \
+  /* COMMA            */ X(0x36, 0x033) \
+  /* DOT              */ X(0x37, 0x034) \
+  /* SLASH            */ X(0x38, 0x035) \
+  /* CAPSLOCK         */ X(0x39, 0x03a) \
+  /* F1               */ X(0x3a, 0x03b) \
+  /* F2               */ X(0x3b, 0x03c) \
+  /* F3               */ X(0x3c, 0x03d) \
+  /* F4               */ X(0x3d, 0x03e) \
+  /* F5               */ X(0x3e, 0x03f) \
+  /* F6               */ X(0x3f, 0x040) \
+  /* F7               */ X(0x40, 0x041) \
+  /* F8               */ X(0x41, 0x042) \
+  /* F9               */ X(0x42, 0x043) \
+  /* F10              */ X(0x43, 0x044) \
+  /* F11              */ X(0x44, 0x057) \
+  /* F12              */ X(0x45, 0x058) \
+  /* SYSRQ            */ X(0x46, 0x137) \
+  /* SCROLLLOCK       */ X(0x47, 0x046) \
+  /* INSERT           */ X(0x49, 0x152) \
+  /* HOME             */ X(0x4a, 0x147) \
+  /* PAGEUP           */ X(0x4b, 0x149) \
+  /* DELETE           */ X(0x4c, 0x153) \
+  /* END              */ X(0x4d, 0x14f) \
+  /* PAGEDOWN         */ X(0x4e, 0x151) \
+  /* RIGHT            */ X(0x4f, 0x14d) \
+  /* LEFT             */ X(0x50, 0x14b) \
+  /* DOWN             */ X(0x51, 0x150) \
+  /* UP               */ X(0x52, 0x148) \
+  /* NUMLOCK          */ X(0x53, 0x045) \
+  /* KPSLASH          */ X(0x54, 0x135) \
+  /* KPASTERISK       */ X(0x55, 0x037) \
+  /* KPMINUS          */ X(0x56, 0x04a) \
+  /* KPPLUS           */ X(0x57, 0x04e) \
+  /* KPENTER          */ X(0x58, 0x11c) \
+  /* KP1              */ X(0x59, 0x04f) \
+  /* KP2              */ X(0x5a, 0x050) \
+  /* KP3              */ X(0x5b, 0x051) \
+  /* KP4              */ X(0x5c, 0x04b) \
+  /* KP5              */ X(0x5d, 0x04c) \
+  /* KP6              */ X(0x5e, 0x04d) \
+  /* KP7              */ X(0x5f, 0x047) \
+  /* KP8              */ X(0x60, 0x048) \
+  /* KP9              */ X(0x61, 0x049) \
+  /* KP0              */ X(0x62, 0x052) \
+  /* KPDOT            */ X(0x63, 0x053) \
+  /* 102ND            */ X(0x64, 0x056) \
+  /* COMPOSE          */ X(0x65, 0x15d) \
+  /* POWER            */ X(0x66, 0x15e) \
+  /* KPEQUAL          */ X(0x67, 0x059) \
+  /* MUTE             */ X(0x7f, 0x120) \
+  /* VOLUMEUP         */ X(0x80, 0x130) \
+  /* VOLUMEDOWN       */ X(0x81, 0x12e) \
+  /* KPCOMMA          */ X(0x85, 0x07e) \
+  /* RO               */ X(0x87, 0x073) \
+  /* KATAKANAHIRAGANA */ X(0x88, 0x070) \
+  /* YEN              */ X(0x89, 0x07d) \
+  /* HENKAN           */ X(0x8a, 0x079) \
+  /* MUHENKAN         */ X(0x8b, 0x07b) \
+  /* LEFTCTRL         */ X(0xe0, 0x01d) \
+  /* LEFTSHIFT        */ X(0xe1, 0x02a) \
+  /* LEFTALT          */ X(0xe2, 0x038) \
+  /* LEFTMETA         */ X(0xe3, 0x15b) \
+  /* RIGHTCTRL        */ X(0xe4, 0x11d) \
+  /* RIGHTSHIFT       */ X(0xe5, 0x036) \
+  /* RIGHTALT         */ X(0xe6, 0x138) \
+  /* RIGHTMETA        */ X(0xe7, 0x15c)
+
+const struct SpiceKeyCode spice_keymap_evdev[SPICE_KEYMAP_EVDEV_SIZE] =
+{
+  EVDEV_KEYS(SPICE_KEYMAP_ENTRY)
+};
+
+const struct SpiceKeyCode spice_keymap_hid[SPICE_KEYMAP_HID_SIZE] =
+{
+  HID_KEYS(SPICE_KEYMAP_ENTRY)
+};
@@ -0,0 +1,37 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+#ifndef PURE_SPICE_KEYMAP_H__
+#define PURE_SPICE_KEYMAP_H__
+
+#include <stdint.h>
+
+#define SPICE_KEYMAP_EVDEV_SIZE 256
+#define SPICE_KEYMAP_HID_SIZE   256
+
+// the pre-encoded KEY_DOWN and KEY_UP codes for a key, zero if unmapped
+struct SpiceKeyCode
+{
+  uint32_t down;
+  uint32_t up;
+};
+
+extern const struct SpiceKeyCode spice_keymap_evdev[SPICE_KEYMAP_EVDEV_SIZE];
+extern const struct SpiceKeyCode spice_keymap_hid  [SPICE_KEYMAP_HID_SIZE  ];
+
+#endif /* PURE_SPICE_KEYMAP_H__ */
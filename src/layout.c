@@ -0,0 +1,130 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "spice/spice.h"
+
+#include <stddef.h>
+
+// US QWERTY, scancodes are in the PC XT set as taken by spice_key_down
+static const SpiceKeyMap us[] =
+{
+  { '\t' , 0x0f, 0 },
+  { '\n' , 0x1c, 0 },
+  { ' '  , 0x39, 0 },
+  { '!'  , 0x02, SPICE_KEYMOD_SHIFT },
+  { '"'  , 0x28, SPICE_KEYMOD_SHIFT },
+  { '#'  , 0x04, SPICE_KEYMOD_SHIFT },
+  { '$'  , 0x05, SPICE_KEYMOD_SHIFT },
+  { '%'  , 0x06, SPICE_KEYMOD_SHIFT },
+  { '&'  , 0x08, SPICE_KEYMOD_SHIFT },
+  { '\'' , 0x28, 0 },
+  { '('  , 0x0a, SPICE_KEYMOD_SHIFT },
+  { ')'  , 0x0b, SPICE_KEYMOD_SHIFT },
+  { '*'  , 0x09, SPICE_KEYMOD_SHIFT },
+  { '+'  , 0x0d, SPICE_KEYMOD_SHIFT },
+  { ','  , 0x33, 0 },
+  { '-'  , 0x0c, 0 },
+  { '.'  , 0x34, 0 },
+  { '/'  , 0x35, 0 },
+  { '0'  , 0x0b, 0 },
+  { '1'  , 0x02, 0 },
+  { '2'  , 0x03, 0 },
+  { '3'  , 0x04, 0 },
+  { '4'  , 0x05, 0 },
+  { '5'  , 0x06, 0 },
+  { '6'  , 0x07, 0 },
+  { '7'  , 0x08, 0 },
+  { '8'  , 0x09, 0 },
+  { '9'  , 0x0a, 0 },
+  { ':'  , 0x27, SPICE_KEYMOD_SHIFT },
+  { ';'  , 0x27, 0 },
+  { '<'  , 0x33, SPICE_KEYMOD_SHIFT },
+  { '='  , 0x0d, 0 },
+  { '>'  , 0x34, SPICE_KEYMOD_SHIFT },
+  { '?'  , 0x35, SPICE_KEYMOD_SHIFT },
+  { '@'  , 0x03, SPICE_KEYMOD_SHIFT },
+  { 'A'  , 0x1e, SPICE_KEYMOD_SHIFT },
+  { 'B'  , 0x30, SPICE_KEYMOD_SHIFT },
+  { 'C'  , 0x2e, SPICE_KEYMOD_SHIFT },
+  { 'D'  , 0x20, SPICE_KEYMOD_SHIFT },
+  { 'E'  , 0x12, SPICE_KEYMOD_SHIFT },
+  { 'F'  , 0x21, SPICE_KEYMOD_SHIFT },
+  { 'G'  , 0x22, SPICE_KEYMOD_SHIFT },
+  { 'H'  , 0x23, SPICE_KEYMOD_SHIFT },
+  { 'I'  , 0x17, SPICE_KEYMOD_SHIFT },
+  { 'J'  , 0x24, SPICE_KEYMOD_SHIFT },
+  { 'K'  , 0x25, SPICE_KEYMOD_SHIFT },
+  { 'L'  , 0x26, SPICE_KEYMOD_SHIFT },
+  { 'M'  , 0x32, SPICE_KEYMOD_SHIFT },
+  { 'N'  , 0x31, SPICE_KEYMOD_SHIFT },
+  { 'O'  , 0x18, SPICE_KEYMOD_SHIFT },
+  { 'P'  , 0x19, SPICE_KEYMOD_SHIFT },
+  { 'Q'  , 0x10, SPICE_KEYMOD_SHIFT },
+  { 'R'  , 0x13, SPICE_KEYMOD_SHIFT },
+  { 'S'  , 0x1f, SPICE_KEYMOD_SHIFT },
+  { 'T'  , 0x14, SPICE_KEYMOD_SHIFT },
+  { 'U'  , 0x16, SPICE_KEYMOD_SHIFT },
+  { 'V'  , 0x2f, SPICE_KEYMOD_SHIFT },
+  { 'W'  , 0x11, SPICE_KEYMOD_SHIFT },
+  { 'X'  , 0x2d, SPICE_KEYMOD_SHIFT },
+  { 'Y'  , 0x15, SPICE_KEYMOD_SHIFT },
+  { 'Z'  , 0x2c, SPICE_KEYMOD_SHIFT },
+  { '['  , 0x1a, 0 },
+  { '\\' , 0x2b, 0 },
+  { ']'  , 0x1b, 0 },
+  { '^'  , 0x07, SPICE_KEYMOD_SHIFT },
+  { '_'  , 0x0c, SPICE_KEYMOD_SHIFT },
+  { '`'  , 0x29, 0 },
+  { 'a'  , 0x1e, 0 },
+  { 'b'  , 0x30, 0 },
+  { 'c'  , 0x2e, 0 },
+  { 'd'  , 0x20, 0 },
+  { 'e'  , 0x12, 0 },
+  { 'f'  , 0x21, 0 },
+  { 'g'  , 0x22, 0 },
+  { 'h'  , 0x23, 0 },
+  { 'i'  , 0x17, 0 },
+  { 'j'  , 0x24, 0 },
+  { 'k'  , 0x25, 0 },
+  { 'l'  , 0x26, 0 },
+  { 'm'  , 0x32, 0 },
+  { 'n'  , 0x31, 0 },
+  { 'o'  , 0x18, 0 },
+  { 'p'  , 0x19, 0 },
+  { 'q'  , 0x10, 0 },
+  { 'r'  , 0x13, 0 },
+  { 's'  , 0x1f, 0 },
+  { 't'  , 0x14, 0 },
+  { 'u'  , 0x16, 0 },
+  { 'v'  , 0x2f, 0 },
+  { 'w'  , 0x11, 0 },
+  { 'x'  , 0x2d, 0 },
+  { 'y'  , 0x15, 0 },
+  { 'z'  , 0x2c, 0 },
+  { '{'  , 0x1a, SPICE_KEYMOD_SHIFT },
+  { '|'  , 0x2b, SPICE_KEYMOD_SHIFT },
+  { '}'  , 0x1b, SPICE_KEYMOD_SHIFT },
+  { '~'  , 0x29, SPICE_KEYMOD_SHIFT },
+};
+
+const SpiceKeyLayout spice_layout_us =
+{
+  .keys  = us,
+  .count = sizeof(us) / sizeof(*us)
+};
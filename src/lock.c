@@ -0,0 +1,138 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "lock.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// the number of times to poll the lock before sleeping, most critical
+// sections are a single send so this is usually enough to avoid the syscall
+#define SPICE_LOCK_SPIN 100
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+static inline uint64_t get_ns()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+static inline void futex_wait(atomic_uint * addr, unsigned int value)
+{
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static inline void futex_wake(atomic_uint * addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// ============================================================================
+
+void spice_lock_init(struct spice_lock * lock)
+{
+  atomic_init(&lock->state       , 0);
+  atomic_init(&lock->acquisitions, 0);
+  atomic_init(&lock->contended   , 0);
+  atomic_init(&lock->waitNs      , 0);
+}
+
+// ============================================================================
+
+void spice_lock_acquire(struct spice_lock * lock)
+{
+  unsigned int c = 0;
+  if (atomic_compare_exchange_strong_explicit(&lock->state, &c, 1,
+        memory_order_acquire, memory_order_relaxed))
+  {
+    atomic_fetch_add_explicit(&lock->acquisitions, 1, memory_order_relaxed);
+    return;
+  }
+
+  const uint64_t start = get_ns();
+
+  for(int i = 0; i < SPICE_LOCK_SPIN; ++i)
+  {
+    cpu_relax();
+
+    c = 0;
+    if (atomic_load_explicit(&lock->state, memory_order_relaxed) == 0 &&
+        atomic_compare_exchange_weak_explicit(&lock->state, &c, 1,
+          memory_order_acquire, memory_order_relaxed))
+      goto done;
+  }
+
+  // mark the lock as contended so the holder knows to wake us on release
+  c = atomic_exchange_explicit(&lock->state, 2, memory_order_acquire);
+  while(c != 0)
+  {
+    futex_wait(&lock->state, 2);
+    c = atomic_exchange_explicit(&lock->state, 2, memory_order_acquire);
+  }
+
+done:
+  atomic_fetch_add_explicit(&lock->acquisitions, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&lock->contended   , 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&lock->waitNs, get_ns() - start,
+      memory_order_relaxed);
+}
+
+// ============================================================================
+
+bool spice_lock_try(struct spice_lock * lock)
+{
+  unsigned int c = 0;
+  if (!atomic_compare_exchange_strong_explicit(&lock->state, &c, 1,
+        memory_order_acquire, memory_order_relaxed))
+    return false;
+
+  atomic_fetch_add_explicit(&lock->acquisitions, 1, memory_order_relaxed);
+  return true;
+}
+
+// ============================================================================
+
+void spice_lock_release(struct spice_lock * lock)
+{
+  if (atomic_fetch_sub_explicit(&lock->state, 1, memory_order_release) != 1)
+  {
+    atomic_store_explicit(&lock->state, 0, memory_order_release);
+    futex_wake(&lock->state);
+  }
+}
+
+// ============================================================================
+
+void spice_lock_stats(struct spice_lock * lock, SpiceLockStats * stats)
+{
+  stats->acquisitions = atomic_load_explicit(&lock->acquisitions, memory_order_relaxed);
+  stats->contended    = atomic_load_explicit(&lock->contended   , memory_order_relaxed);
+  stats->waitNs       = atomic_load_explicit(&lock->waitNs      , memory_order_relaxed);
+}
@@ -0,0 +1,45 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+#ifndef PURE_SPICE_LOCK_H__
+#define PURE_SPICE_LOCK_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "spice/spice.h"
+
+/* adaptive lock, spins briefly before sleeping on a futex. state is 0 when
+ * unlocked, 1 when locked and 2 when locked with possible waiters */
+struct spice_lock
+{
+  atomic_uint state;
+
+  atomic_uint_fast64_t acquisitions;
+  atomic_uint_fast64_t contended;
+  atomic_uint_fast64_t waitNs;
+};
+
+void spice_lock_init   (struct spice_lock * lock);
+void spice_lock_acquire(struct spice_lock * lock);
+bool spice_lock_try    (struct spice_lock * lock);
+void spice_lock_release(struct spice_lock * lock);
+void spice_lock_stats  (struct spice_lock * lock, SpiceLockStats * stats);
+
+#endif /* PURE_SPICE_LOCK_H__ */
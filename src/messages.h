@@ -81,6 +81,42 @@ typedef struct SpiceMsgcAckSync
 }
 SpiceMsgcAckSync;
 
+typedef struct SpiceMsgMigrate
+{
+  uint32_t flags;
+}
+SpiceMsgMigrate;
+
+typedef struct SpiceMigrationDstInfo
+{
+  uint16_t port;
+  uint16_t sport;
+  uint32_t host_size;
+  uint32_t host_offset;         // from the start of the message
+  uint32_t cert_subject_size;
+  uint32_t cert_subject_offset; // from the start of the message
+}
+SpiceMigrationDstInfo;
+
+typedef struct SpiceMsgMainMigrationBegin
+{
+  SpiceMigrationDstInfo dst_info;
+}
+SpiceMsgMainMigrationBegin;
+
+typedef struct SpiceMsgMainMigrateBeginSeamless
+{
+  SpiceMigrationDstInfo dst_info;
+  uint32_t              src_mig_version;
+}
+SpiceMsgMainMigrateBeginSeamless;
+
+typedef struct SpiceMsgcMainMigrateDstDoSeamless
+{
+  uint32_t src_version;
+}
+SpiceMsgcMainMigrateDstDoSeamless;
+
 typedef struct SpiceMsgNotify
 {
   uint64_t time_stamp;
@@ -148,5 +184,11 @@ SpiceMsgcDisconnecting;
 #define MAIN_SET_CAPABILITY(caps, index) \
     { (caps)[(index) / 32] |= (1 << ((index) % 32)); }
 
+#define INPUTS_SET_CAPABILITY(caps, index) \
+    { (caps)[(index) / 32] |= (1 << ((index) % 32)); }
+
+#define HAS_CAPABILITY(caps, num, index) \
+    ((index) / 32 < (num) && ((caps)[(index) / 32] & (1 << ((index) % 32))))
+
 
 #pragma pack(pop)
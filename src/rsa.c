@@ -20,7 +20,7 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "rsa.h"
 
 #include <spice/protocol.h>
-#include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 
 #if defined(USE_OPENSSL) && defined(USE_NETTLE)
@@ -36,7 +36,8 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #endif
 
 #if defined(USE_NETTLE)
-#include <stdlib.h>
+#include <errno.h>
+#include <sys/random.h>
 #include <nettle/asn1.h>
 #include <nettle/sha1.h>
 #include <nettle/rsa.h>
@@ -44,7 +45,23 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <gmp.h>
 
 #define SHA1_HASH_LEN 20
+
+// the largest modulus we will pad for, in bytes
+#define RSA_MAX_KEY_SIZE 512
+#endif
+
+struct spice_rsa_key
+{
+  uint8_t der[SPICE_TICKET_PUBKEY_BYTES];
+
+#if defined(USE_OPENSSL)
+  EVP_PKEY * pkey;
+#endif
+
+#if defined(USE_NETTLE)
+  struct rsa_public_key pub;
 #endif
+};
 
 #if defined(USE_NETTLE)
 /* the below OAEP implementation is derived from the FreeTDS project */
@@ -54,29 +71,29 @@ static void memxor(uint8_t * a, const uint8_t * b, const unsigned int len)
     a[i] = a[i] ^ b[i];
 }
 
-static void sha1(uint8_t * hash, const uint8_t *data, unsigned int len)
+// SHA1 of the empty label
+static const uint8_t oaep_lhash[SHA1_HASH_LEN] =
 {
-  struct sha1_ctx ctx;
-
-  sha1_init(&ctx);
-  sha1_update(&ctx, len, data);
-  sha1_digest(&ctx, SHA1_HASH_LEN, hash);
-}
+  0xda, 0x39, 0xa3, 0xee, 0x5e, 0x6b, 0x4b, 0x0d, 0x32, 0x55,
+  0xbf, 0xef, 0x95, 0x60, 0x18, 0x90, 0xaf, 0xd8, 0x07, 0x09
+};
 
 static void oaep_mask(uint8_t * dest, size_t dest_len, const uint8_t * mask, size_t mask_len)
 {
-  uint8_t   hash[SHA1_HASH_LEN];
-  uint8_t * seed = alloca(mask_len + 4);
-  memcpy(seed, mask, mask_len);
+  // the mask is the same for every block, hash it once and only add the
+  // counter to a copy of the state for each block
+  struct sha1_ctx base;
+  sha1_init(&base);
+  sha1_update(&base, mask_len, mask);
 
+  uint8_t hash[SHA1_HASH_LEN];
   for(unsigned int n = 0;; ++n)
   {
-    (seed+mask_len)[0] = n >> 24;
-    (seed+mask_len)[1] = n >> 16;
-    (seed+mask_len)[2] = n >> 8;
-    (seed+mask_len)[3] = n >> 0;
+    const uint8_t counter[4] = { n >> 24, n >> 16, n >> 8, n >> 0 };
+    struct sha1_ctx ctx = base;
+    sha1_update(&ctx, sizeof(counter), counter);
+    sha1_digest(&ctx, SHA1_HASH_LEN, hash);
 
-    sha1(hash, seed, mask_len + 4);
     if (dest_len <= SHA1_HASH_LEN)
     {
       memxor(dest, hash, dest_len);
@@ -89,125 +106,185 @@ static void oaep_mask(uint8_t * dest, size_t dest_len, const uint8_t * mask, siz
   }
 }
 
-static bool oaep_pad(mpz_t m, unsigned int key_size, const uint8_t * message, unsigned int len)
+static bool random_bytes(uint8_t * buffer, size_t len)
 {
-  if (len + SHA1_HASH_LEN * 2 + 2 > key_size)
-    return false;
-
-  struct
+  while(len > 0)
   {
-    uint8_t all[1];
-    uint8_t ros[SHA1_HASH_LEN];
-    uint8_t db [];
+    const ssize_t got = getrandom(buffer, len, 0);
+    if (got < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+
+    buffer += got;
+    len    -= got;
   }
-  * em;
 
-  const int emSize = sizeof(*em) + key_size - SHA1_HASH_LEN - 1;
-  em = alloca(emSize);
-  memset(em, 0, emSize);
+  return true;
+}
 
-  sha1(em->db, (uint8_t *)"", 0);
-  em->all[key_size - len - 1] = 0x1;
-  memcpy(em->all + (key_size - len), message, len);
+static bool oaep_pad(mpz_t m, size_t key_size, const uint8_t * message, size_t len)
+{
+  if (key_size > RSA_MAX_KEY_SIZE || len + SHA1_HASH_LEN * 2 + 2 > key_size)
+    return false;
+
+  // em = 0x00 || seed || db, where db = lhash || 0x00... || 0x01 || message
+  uint8_t   em[RSA_MAX_KEY_SIZE];
+  uint8_t * seed   = em + 1;
+  uint8_t * db     = seed + SHA1_HASH_LEN;
+  const size_t db_len = key_size - SHA1_HASH_LEN - 1;
 
-  /* we are not too worried about randomness since we are just making a local
-   * connection, should anyone use this code outside of LookingGlass please be
-   * sure to use something better such as `gnutls_rnd` */
-  for(int i = 0; i < SHA1_HASH_LEN; ++i)
-    em->ros[i] = rand() % 255;
+  memset(em, 0, key_size);
+  memcpy(db, oaep_lhash, SHA1_HASH_LEN);
+  db[db_len - len - 1] = 0x1;
+  memcpy(db + db_len - len, message, len);
+
+  if (!random_bytes(seed, SHA1_HASH_LEN))
+    return false;
 
-  const int db_len = key_size - SHA1_HASH_LEN - 1;
-  oaep_mask(em->db , db_len       , em->ros, SHA1_HASH_LEN);
-  oaep_mask(em->ros, SHA1_HASH_LEN, em->db , db_len       );
+  oaep_mask(db  , db_len       , seed, SHA1_HASH_LEN);
+  oaep_mask(seed, SHA1_HASH_LEN, db  , db_len       );
 
-  nettle_mpz_set_str_256_u(m, key_size, em->all);
+  nettle_mpz_set_str_256_u(m, key_size, em);
   return true;
 }
 #endif
 
-bool spice_rsa_encrypt_password(uint8_t * pub_key, char * password, struct spice_password * result)
+static struct spice_rsa_key * rsa_load_key(const uint8_t * pub_key)
 {
-  result->size = 0;
-  result->data = NULL;
-
-#if defined(USE_OPENSSL)
-  BIO *bioKey = BIO_new(BIO_s_mem());
-  if (!bioKey)
-    return false;
+  struct spice_rsa_key * key = calloc(1, sizeof(*key));
+  if (!key)
+    return NULL;
 
-  BIO_write(bioKey, pub_key, SPICE_TICKET_PUBKEY_BYTES);
-  EVP_PKEY *rsaKey = d2i_PUBKEY_bio(bioKey, NULL);
-  RSA *rsa = EVP_PKEY_get1_RSA(rsaKey);
+  memcpy(key->der, pub_key, sizeof(key->der));
 
-  result->size = RSA_size(rsa);
-  result->data = (char *)malloc(result->size);
-
-  if (RSA_public_encrypt(
-        strlen(password) + 1,
-        (uint8_t*)password,
-        (uint8_t*)result->data,
-        rsa,
-        RSA_PKCS1_OAEP_PADDING
-  ) <= 0)
+#if defined(USE_OPENSSL)
+  const unsigned char * der = key->der;
+  key->pkey = d2i_PUBKEY(NULL, &der, sizeof(key->der));
+  if (!key->pkey)
   {
-    free(result->data);
-    result->size = 0;
-    result->data = NULL;
-
-    EVP_PKEY_free(rsaKey);
-    BIO_free(bioKey);
-    return false;
+    free(key);
+    return NULL;
   }
 
-  EVP_PKEY_free(rsaKey);
-  BIO_free(bioKey);
-  return true;
+  return key;
 #endif
 
 #if defined(USE_NETTLE)
   struct asn1_der_iterator der;
   struct asn1_der_iterator j;
-  struct rsa_public_key    pub;
 
-  if (asn1_der_iterator_first(&der, SPICE_TICKET_PUBKEY_BYTES, pub_key) == ASN1_ITERATOR_CONSTRUCTED
+  if (asn1_der_iterator_first(&der, SPICE_TICKET_PUBKEY_BYTES, key->der) == ASN1_ITERATOR_CONSTRUCTED
       && der.type == ASN1_SEQUENCE
       && asn1_der_decode_constructed_last(&der) == ASN1_ITERATOR_CONSTRUCTED
       && der.type == ASN1_SEQUENCE
       && asn1_der_decode_constructed(&der, &j) == ASN1_ITERATOR_PRIMITIVE
       && j.type == ASN1_IDENTIFIER
+      && j.length == 9
       && asn1_der_iterator_next(&der) == ASN1_ITERATOR_PRIMITIVE
       && der.type == ASN1_BITSTRING
-      && asn1_der_decode_bitstring_last(&der))
+      && asn1_der_decode_bitstring_last(&der)
+      && asn1_der_iterator_next(&j) == ASN1_ITERATOR_PRIMITIVE
+      && j.type == ASN1_NULL
+      && j.length == 0
+      && asn1_der_iterator_next(&j) == ASN1_ITERATOR_END)
+  {
+    rsa_public_key_init(&key->pub);
+    if (rsa_public_key_from_der_iterator(&key->pub, 0, &der))
+      return key;
+
+    rsa_public_key_clear(&key->pub);
+  }
+
+  free(key);
+  return NULL;
+#endif
+}
+
+void spice_rsa_free_key(struct spice_rsa_key * key)
+{
+  if (!key)
+    return;
+
+#if defined(USE_OPENSSL)
+  EVP_PKEY_free(key->pkey);
+#endif
+
+#if defined(USE_NETTLE)
+  rsa_public_key_clear(&key->pub);
+#endif
+
+  free(key);
+}
+
+bool spice_rsa_encrypt_password(struct spice_rsa_key ** key,
+    const uint8_t * pub_key, const char * password,
+    struct spice_password * result)
+{
+  result->size = 0;
+  result->data = NULL;
+
+  // servers keep the same key for their lifetime, only parse a new one
+  if (!*key || memcmp((*key)->der, pub_key, sizeof((*key)->der)) != 0)
   {
-    if (j.length != 9)
+    spice_rsa_free_key(*key);
+    if (!(*key = rsa_load_key(pub_key)))
       return false;
+  }
 
-    if (asn1_der_iterator_next(&j) == ASN1_ITERATOR_PRIMITIVE
-        && j.type == ASN1_NULL
-        && j.length == 0
-        && asn1_der_iterator_next(&j) == ASN1_ITERATOR_END)
-    {
-      rsa_public_key_init(&pub);
-      if (!rsa_public_key_from_der_iterator(&pub, 0, &der))
-      {
-        rsa_public_key_clear(&pub);
-        return false;
-      }
-    }
+#if defined(USE_OPENSSL)
+  EVP_PKEY_CTX * ctx = EVP_PKEY_CTX_new((*key)->pkey, NULL);
+  if (!ctx)
+    return false;
+
+  size_t size = EVP_PKEY_size((*key)->pkey);
+  result->data = (char *)malloc(size);
+
+  if (!result->data
+      || EVP_PKEY_encrypt_init(ctx) <= 0
+      || EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING) <= 0
+      || EVP_PKEY_encrypt(ctx,
+          (uint8_t *)result->data, &size,
+          (const uint8_t *)password, strlen(password) + 1) <= 0)
+  {
+    free(result->data);
+    result->data = NULL;
+    EVP_PKEY_CTX_free(ctx);
+    return false;
   }
 
+  result->size = size;
+  EVP_PKEY_CTX_free(ctx);
+  return true;
+#endif
+
+#if defined(USE_NETTLE)
+  /* nettle only provides OAEP with SHA-2 but SPICE requires SHA-1, so the
+   * padding is done here and the public key operation by GMP. With the usual
+   * exponent of 65537 this is only a handful of multiplications */
+  const struct rsa_public_key * pub = &(*key)->pub;
+
   mpz_t p;
   mpz_init(p);
-  oaep_pad(p, pub.size, (uint8_t *)password, strlen(password)+1);
-  mpz_powm(p, p, pub.e, pub.n);
+  if (!oaep_pad(p, pub->size, (const uint8_t *)password, strlen(password) + 1))
+  {
+    mpz_clear(p);
+    return false;
+  }
 
-  result->size = pub.size;
-  result->data = malloc(pub.size);
-  nettle_mpz_get_str_256(pub.size, (uint8_t *)result->data, p);
+  mpz_powm(p, p, pub->e, pub->n);
+
+  result->size = pub->size;
+  result->data = malloc(pub->size);
+  if (result->data)
+    nettle_mpz_get_str_256(pub->size, (uint8_t *)result->data, p);
+  else
+    result->size = 0;
 
-  rsa_public_key_clear(&pub);
   mpz_clear(p);
-  return true;
+  return result->data != NULL;
 #endif
 }
 
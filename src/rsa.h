@@ -26,5 +26,15 @@ struct spice_password
   unsigned int   size;
 };
 
-bool spice_rsa_encrypt_password(uint8_t * pub_key, char * password, struct spice_password * result);
+// a parsed server public key
+struct spice_rsa_key;
+
+/* encrypt the password with the server's DER encoded public key. The parsed
+ * key is kept in *key and reused for as long as the server sends the same
+ * one, it must be released with spice_rsa_free_key */
+bool spice_rsa_encrypt_password(struct spice_rsa_key ** key,
+    const uint8_t * pub_key, const char * password,
+    struct spice_password * result);
+
+void spice_rsa_free_key(struct spice_rsa_key * key);
 void spice_rsa_free_password(struct spice_password * pass);
@@ -17,41 +17,66 @@ this program; if not, write to the Free Software Foundation, Inc., 59 Temple
 Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#define _GNU_SOURCE
 #include "spice/spice.h"
 
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdatomic.h>
 #include <assert.h>
 #include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/un.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 
 #include <spice/protocol.h>
 #include <spice/vd_agent.h>
 
+#if defined(USE_TLS)
+#include <signal.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#if defined(USE_IO_URING)
+#include <liburing.h>
+#endif
+
 #include "messages.h"
 #include "rsa.h"
+#include "lock.h"
+#include "keymap.h"
 
 #define SPICE_LOCK_INIT(x) \
-  atomic_flag_clear(&(x))
+  spice_lock_init(&(x))
 
 #define SPICE_LOCK(x) \
-  while(atomic_flag_test_and_set_explicit(&(x), memory_order_acquire)) { ; }
+  spice_lock_acquire(&(x));
 
 #define SPICE_UNLOCK(x) \
-  atomic_flag_clear_explicit(&(x), memory_order_release);
+  spice_lock_release(&(x));
+
+#define SPICE_TRYLOCK(x) \
+  spice_lock_try(&(x))
 
 // we don't really need flow control because we are all local
 // instead do what the spice-gtk library does and provide the largest
@@ -72,13 +97,106 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #define SPICE_PACKET(htype, payloadType, extraData) \
   ((payloadType *)SPICE_RAW_PACKET(htype, sizeof(payloadType), extraData))
 
+// the size of the initial receive buffer, it will grow if a larger message
+// needs to be buffered
+#define SPICE_RX_BUFFER_SIZE (64 * 1024)
+
+// messages larger then this are never buffered, nothing we handle gets close
+// to this size so they are discarded as they arrive
+#define SPICE_RX_MAX_MESSAGE (1024 * 1024)
+
+// the number of input events that can be queued, must be a power of two
+#define SPICE_INPUT_RING_SIZE 1024
+
+// high resolution wheel units per notch, this matches WHEEL_DELTA on Windows
+// and the v120 values reported by libinput
+#define SPICE_WHEEL_NOTCH 120
+
+// the number of channel capability words kept from the server's link reply
+#define SPICE_CHANNEL_CAPS 4
+
+// the number of displays an absolute position can be sent for
+#define SPICE_MAX_DISPLAYS 16
+
+// the size of the buffer the queued input events are serialized into
+#define SPICE_INPUT_BATCH_SIZE 4096
+
+// the number of agent data chunks gathered into a single write
+#define SPICE_AGENT_IOV_CHUNKS 256
+
+// the initial size of the outbound queue, it grows as needed
+#define SPICE_TX_BUFFER_SIZE (16 * 1024)
+
+// how much agent data may be queued on the main channel, beyond this the
+// writer waits for the socket to drain rather than buffering the rest, and
+// how long it waits for the queue to drain before giving up
+#define SPICE_AGENT_QUEUE_MAX     (1024 * 1024)
+#define SPICE_AGENT_DRAIN_TIMEOUT 5000
+
+// the amount of serialized input held while the inputs channel is down, once
+// full further events stay in the queue until it is back
+#define SPICE_INPUT_BACKLOG_SIZE (64 * 1024)
+
+// how long typing waits for the input queue to drain when it is full
+#define SPICE_TYPING_RETRY 10
+
+// how long a reconnect attempt has to bring every channel back up
+#define SPICE_RECONNECT_TIMEOUT 5000
+
+// the head start a connection attempt to one of the server's addresses gets
+// before the next is raced against it (RFC 8305), and how many are tried
+#define SPICE_CONNECT_ATTEMPT_DELAY 250
+#define SPICE_CONNECT_MAX_ADDRS     16
+
+// true if there is buffered data that can be parsed without another recv
+#define SPICE_RX_PENDING(channel) \
+  ((channel)->rxLen > (channel)->rxPos && !(channel)->rxPartial)
+
+// true if spice_process_channel has work to do for the channel
+#define SPICE_CHANNEL_PENDING(channel) \
+  ((channel)->rxReady || (channel)->txReady || SPICE_RX_PENDING(channel) || \
+   SPICE_TLS_PENDING(channel) || \
+   ((channel)->link == SPICE_LINK_AUTH && atomic_load(&(channel)->authDone)))
+
+// records OpenSSL has already read from the socket won't make it readable
+#if defined(USE_TLS)
+#define SPICE_TLS_PENDING(channel) \
+  ((channel)->ssl && SSL_is_init_finished((channel)->ssl) && \
+   SSL_has_pending((channel)->ssl))
+#else
+#define SPICE_TLS_PENDING(channel) false
+#endif
+
+#if defined(USE_TLS)
+/* OpenSSL writes to the socket without MSG_NOSIGNAL, SIGPIPE is held off for
+ * the calling thread while it does and one raised by the call is discarded */
+#define SPICE_TLS_NOSIGPIPE(call) \
+({ \
+  sigset_t pipeSet, prevSet, pendSet; \
+  sigemptyset(&pipeSet); \
+  sigaddset(&pipeSet, SIGPIPE); \
+  sigpending(&pendSet); \
+  const bool pipePending = sigismember(&pendSet, SIGPIPE); \
+  pthread_sigmask(SIG_BLOCK, &pipeSet, &prevSet); \
+  const __typeof__(call) pipeRet = (call); \
+  if (!pipePending && errno == EPIPE) \
+  { \
+    const struct timespec zero = { 0 }; \
+    while(sigtimedwait(&pipeSet, NULL, &zero) < 0 && errno == EINTR) {} \
+    errno = EPIPE; \
+  } \
+  pthread_sigmask(SIG_SETMASK, &prevSet, NULL); \
+  pipeRet; \
+})
+#endif
+
 #define SPICE_SEND_PACKET(channel, packet) \
 ({ \
   SpiceMiniDataHeader * header = (SpiceMiniDataHeader *)(((uint8_t *)packet) - \
       sizeof(SpiceMiniDataHeader)); \
   ssize_t *sz = (ssize_t *)(((uint8_t *)header) - sizeof(ssize_t)); \
   SPICE_LOCK((channel)->lock); \
-  const ssize_t wrote = send((channel)->socket, header, *sz, 0); \
+  const ssize_t wrote = spice_write_nl((channel), header, *sz); \
   SPICE_UNLOCK((channel)->lock); \
   wrote == *sz; \
 })
@@ -88,7 +206,7 @@ Place, Suite 330, Boston, MA 02111-1307 USA
   SpiceMiniDataHeader * header = (SpiceMiniDataHeader *)(((uint8_t *)packet) - \
       sizeof(SpiceMiniDataHeader)); \
   ssize_t *sz = (ssize_t *)(((uint8_t *)header) - sizeof(ssize_t)); \
-  const ssize_t wrote = send((channel)->socket, header, *sz, 0); \
+  const ssize_t wrote = spice_write_nl((channel), header, *sz); \
   wrote == *sz; \
 })
 
@@ -106,26 +224,109 @@ typedef enum
   SPICE_STATUS_OK,
   SPICE_STATUS_HANDLED,
   SPICE_STATUS_NODATA,
+  SPICE_STATUS_INCOMPLETE,
   SPICE_STATUS_ERROR
 }
 SPICE_STATUS;
 
+typedef enum SpiceLinkState
+{
+  SPICE_LINK_CONNECTING, // waiting for the socket to connect
+  SPICE_LINK_TLS,        // the TLS handshake is in progress
+  SPICE_LINK_REPLY,      // link message sent, waiting for the reply
+  SPICE_LINK_AUTH,       // the password is being encrypted
+  SPICE_LINK_RESULT,     // ticket sent, waiting for the link result
+  SPICE_LINK_DONE
+}
+SpiceLinkState;
+
+struct Spice;
+
 // internal structures
 struct SpiceChannel
 {
-  bool        connected;
-  bool        ready;
-  bool        initDone;
+  // read by the application's threads while the I/O thread runs
+  atomic_bool connected;
+  atomic_bool ready;
+  atomic_bool initDone;
   uint8_t     channelType;
   int         socket;
   uint32_t    ackFrequency;
   uint32_t    ackCount;
-  atomic_flag lock;
+  struct spice_lock lock;
+
+  // channel capabilities advertised by the server
+  uint32_t    caps[SPICE_CHANNEL_CAPS];
+  uint32_t    numCaps;
+
+  // receive buffer, filled by recv and parsed in place
+  uint8_t   * rxBuffer;
+  size_t      rxSize;
+  size_t      rxPos;
+  size_t      rxLen;
+  bool        rxPartial;
+
+  // parser state so a message can be resumed when more data arrives
+  bool                hasHeader;
+  SpiceMiniDataHeader header;
+  uint32_t            discard;
+
+  // outbound queue, holds anything the socket would not immediately accept
+  uint8_t   * txBuffer;
+  size_t      txSize;
+  size_t      txPos;
+  size_t      txLen;
+  bool        txWatch;
+  bool        txShutdown;
+  bool        txClosed;
+  bool        txCork;
+
+  // readiness reported by the reactor for spice_process_channel
+  bool        rxReady;
+  bool        txReady;
+
+  // link handshake, the RSA encryption of the password is done on a worker
+  // thread so that it never holds up the thread running spice_process
+  SpiceLinkState        link;
+  uint8_t               authKey[SPICE_TICKET_PUBKEY_BYTES];
+  struct Spice        * authSpice;
+  pthread_t             authThread;
+  bool                  authRunning;
+  atomic_bool           authDone;
+  bool                  authOk;
+  struct spice_password authPass;
+
+  // migration, the source is done with the channel once it has sent its
+  // migration data, after which it is switched over to the destination
+  bool        migData;
+  bool        migSwitch;
+  bool        migReset;
+
+  // liveness, when anything was last received and the server's ping cadence
+  uint64_t    rxLast;
+  uint64_t    pingLast;
+  uint32_t    pingInterval;
+
+#if defined(USE_TLS)
+  // with kTLS the kernel encrypts, so sends go to the socket as they would
+  // without TLS and the agent data is still sent without a copy
+  SSL       * ssl;
+  bool        ktlsTx;
+#endif
+
+#if defined(USE_IO_URING)
+  bool        rxInflight;
+  bool        txInflight;
+#endif
 };
 
 struct SpiceKeyboard
 {
   uint32_t modifiers;
+
+  // the inputs channel takes KEY_SCANCODE, copied from its caps whenever they
+  // change so the input threads don't read them while they are written
+  atomic_bool scancode;
 };
 
 struct SpiceMouse
@@ -134,6 +335,58 @@ struct SpiceMouse
 
   atomic_int sentCount;
   int rpos, wpos;
+
+  // motion flow control, pending is only touched by the input drainer
+  atomic_uint window;
+  int32_t     pendingX, pendingY;
+
+  // partial wheel notches carried over between events
+  int32_t     wheelY;
+
+  // latest absolute position per display, also only touched by the drainer
+  struct
+  {
+    uint32_t x, y;
+    bool     pending;
+  }
+  position[SPICE_MAX_DISPLAYS];
+  atomic_bool positionHeld;
+};
+
+typedef enum SpiceInputType
+{
+  SPICE_INPUT_KEY_DOWN,
+  SPICE_INPUT_KEY_UP,
+  SPICE_INPUT_KEY_SCANCODE,
+  SPICE_INPUT_MOUSE_POSITION,
+  SPICE_INPUT_MOUSE_MOTION,
+  SPICE_INPUT_MOUSE_PRESS,
+  SPICE_INPUT_MOUSE_RELEASE,
+  SPICE_INPUT_MOUSE_WHEEL
+}
+SpiceInputType;
+
+struct SpiceInput
+{
+  SpiceInputType type;
+  uint32_t       code;
+  int32_t        x, y;
+};
+
+struct SpiceInputSlot
+{
+  atomic_size_t     seq;
+  struct SpiceInput input;
+};
+
+struct SpiceInputBatch
+{
+  uint8_t buffer[SPICE_INPUT_BATCH_SIZE];
+  size_t  len;
+
+  // the KEY_SCANCODE message at the end of the buffer, if any, so following
+  // scancodes can be appended to it
+  SpiceMiniDataHeader * scancode;
 };
 
 union SpiceAddr
@@ -144,31 +397,156 @@ union SpiceAddr
   struct sockaddr_un  un;
 };
 
+typedef enum SpiceMigrateState
+{
+  SPICE_MIGRATE_NONE,
+  SPICE_MIGRATE_LINKING,   // linking the channels to the destination
+  SPICE_MIGRATE_CONNECTED  // linked, waiting for the source to hand over
+}
+SpiceMigrateState;
+
+struct SpiceResolve
+{
+  char            host[256];
+  unsigned short  port;
+  pthread_t       thread;
+  bool            running;
+  atomic_bool     done;
+  atomic_bool     cancel;
+
+  // the winning connection, -1 if every address failed
+  int             socket;
+  short           family;
+  union SpiceAddr addr;
+};
+
+struct SpiceMigrate
+{
+  SpiceMigrateState state;
+  bool              seamless;
+  uint32_t          srcVersion;
+  char              host[INET6_ADDRSTRLEN];
+  short             family;
+  union SpiceAddr   addr;
+
+  // the channels to the destination, each takes the place of its source
+  // channel once the source has handed it over
+  struct SpiceChannel scMain;
+  struct SpiceChannel scInputs;
+};
+
+// requests made of the I/O thread, see spice_io_request
+#define SPICE_IO_DISCONNECT (1 << 0)
+#define SPICE_IO_LIVENESS   (1 << 1)
+
+typedef enum SpiceEventType
+{
+  SPICE_EVENT_CB_NOTICE,
+  SPICE_EVENT_CB_DATA,
+  SPICE_EVENT_CB_RELEASE,
+  SPICE_EVENT_CB_REQUEST,
+  SPICE_EVENT_TYPING_DONE,
+  SPICE_EVENT_READY,
+  SPICE_EVENT_DEAD,
+  SPICE_EVENT_DISCONNECT
+}
+SpiceEventType;
+
+struct SpiceEvent
+{
+  SpiceEventType      type;
+  SpiceDataType       dataType;
+  uint8_t *           buffer;
+  uint32_t            size;
+  struct SpiceEvent * next;
+};
+
+struct SpiceTyping
+{
+  struct spice_lock lock;
+  atomic_bool       active;
+
+  // the key transitions to send, character i is complete once the strokes
+  // up to charEnd[i] have been sent
+  uint32_t        * codes;
+  bool            * down;
+  size_t          * charEnd;
+  size_t            strokes;
+  size_t            sent;
+
+  size_t            total;
+  atomic_size_t     typed;
+  unsigned int      cps;
+  uint64_t          start;
+
+  // the modifiers typing has pressed and not yet released, SPICE_KEYMOD_*
+  uint32_t          held;
+
+  // when to try again after the input queue refused a run of keys, 0 if it
+  // didn't
+  uint64_t          retry;
+};
+
 struct Spice
 {
+  int epollfd;
+  int eventfd;
+
+#if defined(USE_IO_URING)
+  struct io_uring ring;
+  bool            ringInit;
+  bool            wakeInflight;
+  uint64_t        wakeValue;
+#endif
+
   char            password[32];
+
+  // the server's public key, parsed once and shared by the channel links
+  struct spice_lock      rsaLock;
+  struct spice_rsa_key * rsaKey;
   short           family;
   union SpiceAddr addr;
 
+  // a host name is resolved and its addresses raced on a worker thread, the
+  // winner is kept in family/addr for the other channels and reconnects
+  struct SpiceResolve resolve;
+
+#if defined(USE_TLS)
+  // see spice_set_tls, the latest session the server issued is offered by
+  // the next channel to link so it can skip the full handshake
+  SSL_CTX     * tlsCtx;
+  SSL_SESSION * tlsSession;
+  char          tlsHost[256];
+#endif
+
   bool     hasAgent;
   uint32_t serverTokens;
   uint32_t sessionID;
   uint32_t channelID;
   ssize_t  agentMsg;
+  uint32_t agentSkip;
+
+  // held from the start of an agent message until all of it has been written
+  // so messages don't interleave, the main channel's lock is only held for
+  // each write so a writer waiting on the socket doesn't stall the reactor
+  struct spice_lock agentLock;
 
   struct   SpiceChannel scMain;
   struct   SpiceChannel scInputs;
+  struct   SpiceMigrate mig;
 
   struct SpiceKeyboard kb;
   struct SpiceMouse    mouse;
 
-  bool cbSupported;
-  bool cbSelection;
+  // the agent's clipboard state is updated by the thread running the session
+  // and read by the clipboard calls which may be on another
+  atomic_bool cbSupported;
+  atomic_bool cbSelection;
 
   // clipboard variables
-  bool                  cbAgentGrabbed;
-  bool                  cbClientGrabbed;
-  SpiceDataType         cbType;
+  atomic_bool           cbAgentGrabbed;
+  atomic_bool           cbClientGrabbed;
+  _Atomic SpiceDataType cbType;
   uint8_t *             cbBuffer;
   uint32_t              cbRemain;
   uint32_t              cbSize;
@@ -177,34 +555,190 @@ struct Spice
   SpiceClipboardRelease cbReleaseFn;
   SpiceClipboardRequest cbRequestFn;
 
-  uint8_t * motionBuffer;
-  size_t    motionBufferSize;
+  struct SpiceTyping typing;
+  SpiceTypingDone    typingDoneFn;
+  SpiceReady         readyFn;
+
+  // lock free input queue, any thread may push and whichever thread wins
+  // inputDrain serializes and sends everything that is queued
+  struct SpiceInputSlot inputRing[SPICE_INPUT_RING_SIZE];
+  atomic_size_t         inputHead;
+  size_t                inputTail;
+  struct spice_lock     inputDrain;
+  atomic_bool           inputFlush;
+
+  // while the inputs channel is down input is serialized into the backlog
+  // and sent once it has been linked again, guarded by inputDrain
+  bool                  inputLinked;
+  uint8_t             * inputBacklog;
+  size_t                backlogLen;
+  size_t                backlogSize;
+
+  // automatic reconnect, see spice_set_reconnect
+  int                   rcAttempts;
+  unsigned int          rcMinDelay;
+  unsigned int          rcMaxDelay;
+  int                   rcAttempt;
+  uint64_t              rcDue;
+  uint64_t              rcDeadline;
+  atomic_bool           rcStop;
+
+  // dead peer detection, see spice_set_liveness
+  atomic_uint           lvDeadline;
+  SpiceChannelDead      deadFn;
+
+  // library owned I/O thread, callbacks are queued for the application
+  pthread_t            ioThread;
+  bool                 ioRunning;
+  atomic_bool          ioStop;
+
+  // work the application's calls hand to the I/O thread, SPICE_IO_*
+  atomic_uint          ioRequest;
+  int                  evFd;
+  struct spice_lock    evLock;
+  struct SpiceEvent *  evHead;
+  struct SpiceEvent ** evTail;
+
+  // application data for the session, see spice_ctx_set_user
+  void * user;
 };
 
+#define SPICE_CTX_INITIALIZER \
+{ \
+  .epollfd              = -1, \
+  .eventfd              = -1, \
+  .evFd                 = -1, \
+  .sessionID            = 0, \
+  .scMain  .connected   = false, \
+  .scMain  .channelType = SPICE_CHANNEL_MAIN, \
+  .scMain  .socket      = -1, \
+  .scInputs.connected   = false, \
+  .scInputs.channelType = SPICE_CHANNEL_INPUTS, \
+  .scInputs.socket      = -1, \
+  .mig.scMain  .channelType = SPICE_CHANNEL_MAIN, \
+  .mig.scMain  .socket      = -1, \
+  .mig.scInputs.channelType = SPICE_CHANNEL_INPUTS, \
+  .mig.scInputs.socket      = -1, \
+}
+
 // globals
-struct Spice spice =
-{
-  .sessionID            = 0,
-  .scMain  .connected   = false,
-  .scMain  .channelType = SPICE_CHANNEL_MAIN,
-  .scInputs.connected   = false,
-  .scInputs.channelType = SPICE_CHANNEL_INPUTS,
-};
+static struct Spice spiceDefault = SPICE_CTX_INITIALIZER;
+
+/* the session being operated on by the calling thread, the spice_ctx_*
+ * functions switch this for the duration of the call so that anything they
+ * invoke (including callbacks) sees the right session. Threads start out on
+ * the default session which the original API operates on */
+static _Thread_local struct Spice * spice = &spiceDefault;
+
+#define SPICE_CTX_CALL(ctx, call) \
+({ \
+  struct Spice * ctxPrev = spice; \
+  spice = (ctx); \
+  const __typeof__(call) ctxRet = (call); \
+  spice = ctxPrev; \
+  ctxRet; \
+})
+
+#define SPICE_CTX_CALL_VOID(ctx, call) \
+({ \
+  struct Spice * ctxPrev = spice; \
+  spice = (ctx); \
+  (call); \
+  spice = ctxPrev; \
+})
 
 // internal forward decls
+bool         spice_init_reactor();
+bool         spice_reactor_wait  (int timeout);
+bool         spice_reactor_add   (struct SpiceChannel * channel);
+void         spice_reactor_remove(struct SpiceChannel * channel);
 SPICE_STATUS spice_connect_channel   (struct SpiceChannel * channel);
+SPICE_STATUS spice_connect_channel_to(struct SpiceChannel * channel,
+    short family, const union SpiceAddr * addr);
+SPICE_STATUS spice_connect_channel_fd(struct SpiceChannel * channel,
+    short family, const union SpiceAddr * addr, int fd);
+bool         spice_resolve_start   (const char * host, unsigned short port);
+void         spice_resolve_complete();
+void         spice_resolve_abort   ();
+void         spice_disconnect_session();
+void         spice_io_request (unsigned int request);
+void         spice_io_requests();
 void         spice_disconnect_channel(struct SpiceChannel * channel);
-
+void         spice_close_channel     (struct SpiceChannel * channel);
+
+SPICE_STATUS spice_link_send   (struct SpiceChannel * channel);
+SPICE_STATUS spice_link_reply  (struct SpiceChannel * channel);
+SPICE_STATUS spice_link_auth   (struct SpiceChannel * channel);
+SPICE_STATUS spice_link_result (struct SpiceChannel * channel);
+SPICE_STATUS spice_link_process(struct SpiceChannel * channel);
+bool         spice_link_failed (struct SpiceChannel * channel);
+void         spice_link_ready  ();
+
+bool spice_channel_lost     (struct SpiceChannel * channel);
+bool spice_session_lost     ();
+bool spice_reconnect_schedule();
+void spice_reconnect_attempt ();
+
+void spice_liveness_sockopt(struct SpiceChannel * channel, short family);
+void spice_liveness_ping   (struct SpiceChannel * channel);
+bool spice_liveness_check  ();
+int  spice_liveness_timeout(int timeout);
+
+#if defined(USE_TLS)
+SPICE_STATUS spice_tls_begin    (struct SpiceChannel * channel);
+SPICE_STATUS spice_tls_handshake(struct SpiceChannel * channel);
+SPICE_STATUS spice_tls_recv_nl  (struct SpiceChannel * channel);
+ssize_t      spice_tls_writev_nl(struct SpiceChannel * channel, const struct iovec * iov, int iovcnt);
+void         spice_tls_reset    ();
+#endif
+
+#define SPICE_MIGRATE_CHANNEL(channel) \
+  ((channel) == &spice->mig.scMain || (channel) == &spice->mig.scInputs)
+
+SPICE_STATUS spice_migrate_begin (const uint8_t * data, uint32_t size, bool seamless);
+SPICE_STATUS spice_migrate_linked(struct SpiceChannel * channel);
+SPICE_STATUS spice_migrate_src   (struct SpiceChannel * channel, const uint8_t * data, uint32_t size);
+SPICE_STATUS spice_migrate_data  (struct SpiceChannel * channel, const uint8_t * data, uint32_t size);
+void         spice_migrate_process();
+void         spice_migrate_switch (struct SpiceChannel * channel, struct SpiceChannel * twin);
+void         spice_migrate_failed ();
+void         spice_migrate_abort  ();
+
+int  spice_process_timeout(int timeout);
+bool spice_process_io     (int timeout);
+bool spice_process_events (int timeout);
+bool spice_process_channel(struct SpiceChannel * channel);
 bool spice_process_ack(struct SpiceChannel * channel);
 
-SPICE_STATUS spice_on_common_read        (struct SpiceChannel * channel, SpiceMiniDataHeader * header, int * dataAvailable);
-SPICE_STATUS spice_on_main_channel_read  (int * dataAvailable);
-SPICE_STATUS spice_on_inputs_channel_read(int * dataAvailable);
-
-SPICE_STATUS spice_agent_process  (uint32_t dataSize, int * dataAvailable);
+SPICE_STATUS spice_on_common_read        (struct SpiceChannel * channel, SpiceMiniDataHeader * header, const uint8_t ** data);
+SPICE_STATUS spice_on_main_channel_read  ();
+SPICE_STATUS spice_on_inputs_channel_read();
+SPICE_STATUS spice_on_migrate_read       (struct SpiceChannel * channel);
+
+void spice_event      (SpiceEventType type, SpiceDataType dataType, uint8_t * buffer, uint32_t size);
+void spice_event_invoke(struct SpiceEvent * event);
+bool spice_event_drain ();
+
+int  spice_typing_timeout(int timeout);
+void spice_typing_process();
+void spice_typing_reset_nl();
+
+void spice_input_reset  ();
+void spice_input_detach ();
+bool spice_input_attach ();
+void spice_input_close  ();
+bool spice_input_push   (const struct SpiceInput * input);
+bool spice_input_push_n (const struct SpiceInput * inputs, size_t count);
+bool spice_input_pop    (struct SpiceInput * input);
+bool spice_input_pending();
+void spice_input_drain  ();
+void spice_input_kick   ();
+
+SPICE_STATUS spice_agent_process  (const uint8_t * data, uint32_t dataSize);
 SPICE_STATUS spice_agent_connect  ();
 SPICE_STATUS spice_agent_send_caps(bool request);
 void         spice_agent_on_clipboard();
+void         spice_agent_reset();
 
 // utility functions
 static uint32_t spice_type_to_agent_type(SpiceDataType type);
@@ -213,11 +747,16 @@ static SpiceDataType agent_type_to_spice_type(uint32_t type);
 // thread safe read/write methods
 bool spice_agent_start_msg(uint32_t type, ssize_t size);
 bool spice_agent_write_msg(const void * buffer, ssize_t size);
+bool spice_agent_drain_nl ();
 
 // non thread safe read/write methods (nl = non-locking)
-SPICE_STATUS spice_read_nl   (      struct SpiceChannel * channel, void * buffer, const ssize_t size, int * dataAvailable);
-SPICE_STATUS spice_discard_nl(      struct SpiceChannel * channel, ssize_t size, int * dataAvailable);
-ssize_t      spice_write_nl  (const struct SpiceChannel * channel, const void * buffer, const ssize_t size);
+SPICE_STATUS spice_rx_room_nl(      struct SpiceChannel * channel);
+SPICE_STATUS spice_recv_nl   (      struct SpiceChannel * channel, int flags);
+SPICE_STATUS spice_reserve_nl(      struct SpiceChannel * channel, const size_t size);
+ssize_t      spice_write_nl  (      struct SpiceChannel * channel, const void * buffer, const ssize_t size);
+ssize_t      spice_writev_nl (      struct SpiceChannel * channel, const struct iovec * iov, int iovcnt);
+SPICE_STATUS spice_flush_nl  (      struct SpiceChannel * channel);
+bool         spice_watch_nl  (      struct SpiceChannel * channel, bool writable);
 
 // ============================================================================
 
@@ -234,25 +773,61 @@ static uint64_t get_timestamp()
 
 bool spice_connect(const char * host, const unsigned short port, const char * password)
 {
-  strncpy(spice.password, password, sizeof(spice.password) - 1);
-  memset(&spice.addr, 0, sizeof(spice.addr));
+  if (!spice_init_reactor())
+    return false;
+
+  strncpy(spice->password, password, sizeof(spice->password) - 1);
+  memset(&spice->addr, 0, sizeof(spice->addr));
+  spice_resolve_abort();
 
+#if defined(USE_TLS)
+  // the certificate is checked against the name given, a session for
+  // another server is of no use
+  strncpy(spice->tlsHost, port ? host : "", sizeof(spice->tlsHost) - 1);
+  if (spice->tlsSession)
+  {
+    SSL_SESSION_free(spice->tlsSession);
+    spice->tlsSession = NULL;
+  }
+#endif
+
+  bool resolve = false;
   if (port == 0)
   {
-    spice.family = AF_UNIX;
-    spice.addr.un.sun_family = spice.family;
-    strncpy(spice.addr.un.sun_path, host, sizeof(spice.addr.un.sun_path) - 1);
+    spice->family = AF_UNIX;
+    spice->addr.un.sun_family = spice->family;
+    strncpy(spice->addr.un.sun_path, host, sizeof(spice->addr.un.sun_path) - 1);
   }
-  else
+  else if (inet_pton(AF_INET, host, &spice->addr.in.sin_addr) == 1)
   {
-    spice.family = AF_INET;
-    inet_pton(spice.family, host, &spice.addr.in.sin_addr);
-    spice.addr.in.sin_family = spice.family;
-    spice.addr.in.sin_port   = htons(port);
+    spice->family = AF_INET;
+    spice->addr.in.sin_family = spice->family;
+    spice->addr.in.sin_port   = htons(port);
   }
+  else if (inet_pton(AF_INET6, host, &spice->addr.in6.sin6_addr) == 1)
+  {
+    spice->family = AF_INET6;
+    spice->addr.in6.sin6_family = spice->family;
+    spice->addr.in6.sin6_port   = htons(port);
+  }
+  else
+    resolve = true;
+
+  spice_input_reset();
 
-  spice.channelID = 0;
-  if (spice_connect_channel(&spice.scMain) != SPICE_STATUS_OK)
+  spice->sessionID  = 0;
+  spice->channelID  = 0;
+  spice->rcAttempt  = 0;
+  spice->rcDue      = 0;
+  spice->rcDeadline = 0;
+  spice->rcStop     = false;
+
+  // a host name is looked up without blocking, the main channel is linked
+  // once one of its addresses has answered, see spice_resolve_complete
+  if (resolve)
+    return spice_resolve_start(host, port);
+
+  if (spice_connect_channel(&spice->scMain) != SPICE_STATUS_OK)
     return false;
 
   return true;
@@ -260,1357 +835,5264 @@ bool spice_connect(const char * host, const unsigned short port, const char * pa
 
 // ============================================================================
 
-void spice_disconnect()
+static int spice_resolve_race(struct SpiceResolve * rs)
 {
-  spice_disconnect_channel(&spice.scInputs);
-  spice_disconnect_channel(&spice.scMain  );
+  char port[8];
+  snprintf(port, sizeof(port), "%u", rs->port);
 
-  if (spice.motionBuffer)
+  const struct addrinfo hints =
   {
-    free(spice.motionBuffer);
-    spice.motionBuffer = NULL;
-  }
-}
-
-// ============================================================================
+    .ai_family   = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+    .ai_flags    = AI_ADDRCONFIG | AI_NUMERICSERV
+  };
 
-bool spice_ready()
-{
-  return spice.scMain.connected &&
-         spice.scInputs.connected;
-}
+  struct addrinfo * res;
+  if (getaddrinfo(rs->host, port, &hints, &res) != 0)
+    return -1;
 
-// ============================================================================
+  /* alternate between the families starting with the resolver's preferred
+   * one so an unreachable family costs no more than one attempt delay */
+  const struct addrinfo * order[SPICE_CONNECT_MAX_ADDRS];
+  size_t count = 0;
+  const int first = res->ai_family;
+  const struct addrinfo * a = res;
+  const struct addrinfo * b = res;
+  while(count < SPICE_CONNECT_MAX_ADDRS)
+  {
+    while(a && a->ai_family != first)
+      a = a->ai_next;
+    while(b && (b->ai_family == first ||
+          (b->ai_family != AF_INET && b->ai_family != AF_INET6)))
+      b = b->ai_next;
 
-bool spice_process(int timeout)
-{
-  int fds = 0;
-  fd_set readSet;
-  FD_ZERO(&readSet);
+    if (!a && !b)
+      break;
 
-  bool mainConnected   = false;
-  bool inputsConnected = false;
+    if (a)
+    {
+      order[count++] = a;
+      a = a->ai_next;
+    }
 
-  if (spice.scMain.connected)
-  {
-    mainConnected = true;
-    FD_SET(spice.scMain.socket, &readSet);
-    if (spice.scMain.socket > fds)
-      fds = spice.scMain.socket;
+    if (b && count < SPICE_CONNECT_MAX_ADDRS)
+    {
+      order[count++] = b;
+      b = b->ai_next;
+    }
   }
 
-  if (spice.scInputs.connected)
+  struct pollfd fds   [SPICE_CONNECT_MAX_ADDRS];
+  size_t        target[SPICE_CONNECT_MAX_ADDRS];
+  size_t   pending = 0;
+  size_t   next    = 0;
+  uint64_t nextAt  = 0;
+  int      winner  = -1;
+
+  while(winner < 0 && !atomic_load(&rs->cancel))
   {
-    inputsConnected = true;
-    FD_SET(spice.scInputs.socket, &readSet);
-    if (spice.scInputs.socket > fds)
-      fds = spice.scInputs.socket;
-  }
+    const uint64_t now = get_timestamp();
 
-  struct timeval tv;
-  tv.tv_sec  = timeout / 1000;
-  tv.tv_usec = (timeout % 1000) * 1000;
+    // start the next attempt once the last has had its head start, or
+    // straight away if nothing is left in flight
+    if (next < count && (pending == 0 || now >= nextAt))
+    {
+      const struct addrinfo * ai = order[next];
+      const int fd = socket(ai->ai_family,
+          SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
-  int rc = select(fds + 1, &readSet, NULL, NULL, &tv);
-  if (rc == 0)
-    return true;
+      if (fd >= 0 && (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 ||
+            errno == EINPROGRESS))
+      {
+        fds[pending].fd      = fd;
+        fds[pending].events  = POLLOUT;
+        fds[pending].revents = 0;
+        target[pending++]    = next;
+      }
+      else if (fd >= 0)
+        close(fd);
 
-  if (rc < 0)
-    return false;
+      ++next;
+      nextAt = now + SPICE_CONNECT_ATTEMPT_DELAY;
+      continue;
+    }
 
-  if (FD_ISSET(spice.scInputs.socket, &readSet))
-  {
-    // note: dataAvailable can go negative due to blocking reads
-    int dataAvailable;
-    ioctl(spice.scInputs.socket, FIONREAD, &dataAvailable);
+    if (pending == 0)
+      break;
 
-    // if there is no data then the socket is closed
-    if (!dataAvailable)
-      spice.scInputs.connected = false;
+    // wake up for the next attempt, or at the same rate to check for cancel
+    const int wait = next < count ?
+      (nextAt > now ? (int)(nextAt - now) : 0) : SPICE_CONNECT_ATTEMPT_DELAY;
+    if (poll(fds, pending, wait) < 0 && errno != EINTR)
+      break;
 
-    // process as much data as possible
-    while(dataAvailable > 0)
+    for(size_t i = 0; i < pending;)
     {
-      switch(spice_on_inputs_channel_read(&dataAvailable))
+      if (!fds[i].revents)
       {
-        case SPICE_STATUS_OK:
-        case SPICE_STATUS_HANDLED:
-          // if dataAvailable has gone negative then refresh it
-          if (dataAvailable < 0)
-            ioctl(spice.scInputs.socket, FIONREAD, &dataAvailable);
-          break;
-
-        case SPICE_STATUS_NODATA:
-          spice.scInputs.connected = false;
-          dataAvailable = 0;
-          break;
-
-        case SPICE_STATUS_ERROR:
-          return false;
+        ++i;
+        continue;
       }
 
-      if (!spice_process_ack(&spice.scInputs))
-        return false;
+      int error = 0;
+      socklen_t len = sizeof(error);
+      if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 &&
+          error == 0)
+      {
+        winner = i;
+        break;
+      }
+
+      // a refused attempt lets the next one go now rather than waiting
+      close(fds[i].fd);
+      fds   [i] = fds   [--pending];
+      target[i] = target[  pending];
+      nextAt    = 0;
     }
   }
 
-  if (FD_ISSET(spice.scMain.socket, &readSet))
+  int fd = -1;
+  for(size_t i = 0; i < pending; ++i)
   {
-    // note: dataAvailable can go negative due to blocking reads
-    int dataAvailable;
-    ioctl(spice.scMain.socket, FIONREAD, &dataAvailable);
-
-    // if there is no data then the socket is closed
-    if (!dataAvailable)
-      spice.scMain.connected = false;
-
-    // process as much data as possible
-    while(dataAvailable > 0)
+    if ((int)i != winner)
     {
-      switch(spice_on_main_channel_read(&dataAvailable))
-      {
-        case SPICE_STATUS_OK:
-        case SPICE_STATUS_HANDLED:
-          // if dataAvailable has gone negative then refresh it
-          if (dataAvailable < 0)
-            ioctl(spice.scInputs.socket, FIONREAD, &dataAvailable);
-          break;
-
-        case SPICE_STATUS_NODATA:
-          spice.scMain.connected = false;
-          dataAvailable = 0;
-          break;
-
-        default:
-          return false;
-      }
-
-      if (!spice_process_ack(&spice.scMain))
-        return false;
+      close(fds[i].fd);
+      continue;
     }
+
+    const struct addrinfo * ai = order[target[i]];
+    fd         = fds[i].fd;
+    rs->family = ai->ai_family;
+    memcpy(&rs->addr, ai->ai_addr, ai->ai_addrlen);
   }
 
-  if (spice.scMain.connected || spice.scInputs.connected)
-    return true;
+  freeaddrinfo(res);
+  return fd;
+}
 
-  /* shutdown */
-  spice.sessionID = 0;
-  if (spice.cbBuffer)
+// ============================================================================
+
+static void * spice_resolve_thread(void * opaque)
+{
+  struct Spice * session = opaque;
+  session->resolve.socket = spice_resolve_race(&session->resolve);
+  atomic_store(&session->resolve.done, true);
+
+  // wake the reactor of the session the lookup is for
+  spice = session;
+  spice_wakeup();
+  return NULL;
+}
+
+// ============================================================================
+
+bool spice_resolve_start(const char * host, unsigned short port)
+{
+  struct SpiceResolve * rs = &spice->resolve;
+  if (strlen(host) >= sizeof(rs->host))
+    return false;
+
+  strcpy(rs->host, host);
+  rs->port   = port;
+  rs->socket = -1;
+  memset(&rs->addr, 0, sizeof(rs->addr));
+  atomic_store(&rs->done  , false);
+  atomic_store(&rs->cancel, false);
+
+  if (pthread_create(&rs->thread, NULL, spice_resolve_thread, spice) != 0)
+    return false;
+
+  rs->running = true;
+  return true;
+}
+
+// ============================================================================
+
+void spice_resolve_complete()
+{
+  struct SpiceResolve * rs = &spice->resolve;
+  pthread_join(rs->thread, NULL);
+  rs->running = false;
+
+  // every address failed, spice_process fails as the connect would have
+  if (rs->socket < 0)
+    return;
+
+  if (spice->rcStop)
   {
-    free(spice.cbBuffer);
-    spice.cbBuffer = NULL;
+    close(rs->socket);
+    return;
   }
 
-  spice.cbRemain = 0;
-  spice.cbSize   = 0;
+  spice->family = rs->family;
+  memcpy(&spice->addr, &rs->addr, sizeof(spice->addr));
 
-  spice.cbAgentGrabbed  = false;
-  spice.cbClientGrabbed = false;
+  if (spice_connect_channel_fd(&spice->scMain, spice->family, &spice->addr,
+        rs->socket) != SPICE_STATUS_OK)
+    spice_close_channel(&spice->scMain);
+}
 
-  if (inputsConnected)
-    close(spice.scInputs.socket);
+// ============================================================================
 
-  if (mainConnected)
-    close(spice.scMain.socket);
+void spice_resolve_abort()
+{
+  struct SpiceResolve * rs = &spice->resolve;
+  if (!rs->running)
+    return;
 
-  return false;
+  // the lookup itself can't be interrupted, only the racing that follows
+  atomic_store(&rs->cancel, true);
+  pthread_join(rs->thread, NULL);
+  rs->running = false;
+
+  if (rs->socket >= 0)
+    close(rs->socket);
 }
 
 // ============================================================================
 
-bool spice_process_ack(struct SpiceChannel * channel)
+void spice_disconnect()
 {
-  if (channel->ackFrequency == 0)
-    return true;
+  // an explicit disconnect is never undone by a reconnect, wake spice_process
+  // so one that is pending is dropped straight away
+  spice->rcStop = true;
+  atomic_store(&spice->resolve.cancel, true);
 
-  if (channel->ackCount++ != channel->ackFrequency)
-    return true;
+  // the I/O thread owns the sockets while it runs
+  if (spice->ioRunning)
+  {
+    spice_io_request(SPICE_IO_DISCONNECT);
+    return;
+  }
 
-  channel->ackCount = 0;
+  spice_disconnect_session();
+  spice_wakeup();
+}
 
-  char * ack = SPICE_PACKET(SPICE_MSGC_ACK, char, 0);
-  *ack = 0;
-  return SPICE_SEND_PACKET(channel, ack);
+// ============================================================================
+
+void spice_disconnect_session()
+{
+  spice_disconnect_channel(&spice->scInputs);
+  spice_disconnect_channel(&spice->scMain  );
 }
 
 // ============================================================================
 
-SPICE_STATUS spice_on_common_read(struct SpiceChannel * channel, SpiceMiniDataHeader * header, int * dataAvailable)
+bool spice_set_reconnect(int attempts, unsigned int minDelay,
+    unsigned int maxDelay)
 {
-  SPICE_STATUS status;
-  if ((status = spice_read_nl(channel, header, sizeof(SpiceMiniDataHeader), dataAvailable)) != SPICE_STATUS_OK)
-    return status;
+  if (minDelay > maxDelay)
+    return false;
 
-  if (!channel->connected)
-    return SPICE_STATUS_HANDLED;
+  spice->rcAttempts = attempts;
+  spice->rcMinDelay = minDelay;
+  spice->rcMaxDelay = maxDelay;
+  return true;
+}
 
-  if (!channel->initDone)
-    return SPICE_STATUS_OK;
+// ============================================================================
 
-  switch(header->type)
+bool spice_set_liveness(unsigned int deadline, SpiceChannelDead cbDeadFn)
+{
+  spice->lvDeadline = deadline;
+  spice->deadFn     = cbDeadFn;
+
+  // apply the socket options to any channel that is already connected
+  if (spice->ioRunning)
+    spice_io_request(SPICE_IO_LIVENESS);
+  else
   {
-    case SPICE_MSG_MIGRATE:
-    case SPICE_MSG_MIGRATE_DATA:
-      return SPICE_STATUS_HANDLED;
+    spice_liveness_sockopt(&spice->scMain  , spice->family);
+    spice_liveness_sockopt(&spice->scInputs, spice->family);
+  }
+  return true;
+}
 
-    case SPICE_MSG_SET_ACK:
-    {
-      SpiceMsgSetAck in;
-      if ((status = spice_read_nl(channel, &in, sizeof(in), dataAvailable)) != SPICE_STATUS_OK)
-        return status;
+// ============================================================================
 
-      channel->ackFrequency = in.window;
+#if defined(USE_TLS)
+static int spice_tls_new_session(SSL * ssl, SSL_SESSION * session)
+{
+  /* keep the latest session for the next channel to resume, TLS 1.3 tickets
+   * are best used once so a fresh one is taken from every handshake. The
+   * destination of a migration is another server */
+  if (ssl == spice->mig.scMain.ssl || ssl == spice->mig.scInputs.ssl)
+    return 0;
 
-      SpiceMsgcAckSync * out =
-        SPICE_PACKET(SPICE_MSGC_ACK_SYNC, SpiceMsgcAckSync, 0);
+  if (spice->tlsSession)
+    SSL_SESSION_free(spice->tlsSession);
 
-      out->generation = in.generation;
-      return SPICE_SEND_PACKET(channel, out) ?
-        SPICE_STATUS_HANDLED : SPICE_STATUS_ERROR;
-    }
+  spice->tlsSession = session;
+  return 1;
+}
+#endif
 
-    case SPICE_MSG_PING:
-    {
-      SpiceMsgPing in;
-      if ((status = spice_read_nl(channel, &in, sizeof(in), dataAvailable)) != SPICE_STATUS_OK)
-        return status;
+// ============================================================================
 
-      const int discard = header->size - sizeof(in);
-      if ((status = spice_discard_nl(channel, discard, dataAvailable)) != SPICE_STATUS_OK)
-        return status;
+bool spice_set_tls(bool enable, const char * caFile, bool verify)
+{
+#if defined(USE_TLS)
+  spice_tls_reset();
+  if (!enable)
+    return true;
 
-      SpiceMsgcPong * out =
-        SPICE_PACKET(SPICE_MSGC_PONG, SpiceMsgcPong, 0);
+  SSL_CTX * ctx = SSL_CTX_new(TLS_client_method());
+  if (!ctx)
+    return false;
 
-      out->id        = in.id;
-      out->timestamp = in.timestamp;
-      return SPICE_SEND_PACKET(channel, out) ?
-        SPICE_STATUS_HANDLED : SPICE_STATUS_ERROR;
-    }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
 
-    case SPICE_MSG_WAIT_FOR_CHANNELS:
-      return SPICE_STATUS_HANDLED;
+  // behave as send does, a write may be partial and the rest is queued
+  SSL_CTX_set_mode(ctx,
+      SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
-    case SPICE_MSG_DISCONNECTING:
-    {
-      shutdown(channel->socket, SHUT_WR);
-      return SPICE_STATUS_HANDLED;
-    }
+#if defined(SSL_OP_IGNORE_UNEXPECTED_EOF)
+  // servers close without a close_notify, treat it as the end of the stream
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
 
-    case SPICE_MSG_NOTIFY:
-    {
-      SpiceMsgNotify in;
-      if ((status = spice_read_nl(channel, &in, sizeof(in), dataAvailable)) != SPICE_STATUS_OK)
-        return status;
+#if defined(SSL_OP_ENABLE_KTLS)
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
 
-      char msg[in.message_len + 1];
-      if ((status = spice_read_nl(channel, msg, in.message_len + 1, dataAvailable)) != SPICE_STATUS_OK)
-        return status;
-      *dataAvailable -= in.message_len + 1;
+  SSL_CTX_set_session_cache_mode(ctx,
+      SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, spice_tls_new_session);
 
-      return SPICE_STATUS_HANDLED;
+  if (verify)
+  {
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    if (!(caFile ?
+          SSL_CTX_load_verify_locations(ctx, caFile, NULL) :
+          SSL_CTX_set_default_verify_paths(ctx)))
+    {
+      SSL_CTX_free(ctx);
+      return false;
     }
   }
 
-  return SPICE_STATUS_OK;
+  spice->tlsCtx = ctx;
+  return true;
+#else
+  (void)caFile;
+  (void)verify;
+  return !enable;
+#endif
 }
 
 // ============================================================================
 
-SPICE_STATUS spice_on_main_channel_read(int * dataAvailable)
+bool spice_ready()
 {
-  struct SpiceChannel *channel = &spice.scMain;
+  // an early inputs link on reconnect may still be for the old session
+  // until MAIN_INIT has been seen
+  return spice->scMain  .connected && spice->scMain  .ready &&
+         spice->scInputs.connected && spice->scInputs.ready &&
+         spice->scMain  .initDone;
+}
 
-  SpiceMiniDataHeader header;
+// ============================================================================
 
-  SPICE_STATUS status;
-  if ((status = spice_on_common_read(channel, &header, dataAvailable)) != SPICE_STATUS_OK)
-    return status;
+#if defined(USE_IO_URING)
 
-  if (!channel->initDone)
-  {
-    if (header.type != SPICE_MSG_MAIN_INIT)
-    {
-      spice_disconnect();
-      return SPICE_STATUS_ERROR;
-    }
-
-    channel->initDone = true;
-    SpiceMsgMainInit msg;
-    if ((status = spice_read_nl(channel, &msg, sizeof(msg), dataAvailable)) != SPICE_STATUS_OK)
-    {
-      spice_disconnect();
-      return status;
-    }
+/* io_uring backend, completions are tagged with the channel (or NULL for the
+ * eventfd) and the operation in the low bits of user_data. The ring is only
+ * ever touched by the thread running spice_process. */
+#define SPICE_URING_RECV   0
+#define SPICE_URING_POLL   1
+#define SPICE_URING_WAKE   2
+#define SPICE_URING_CANCEL 3
+#define SPICE_URING_OP_MASK 3
 
-    spice.sessionID = msg.session_id;
-
-    spice.serverTokens = msg.agent_tokens;
-    spice.hasAgent     = msg.agent_connected;
-    if (spice.hasAgent && (status = spice_agent_connect()) != SPICE_STATUS_OK)
-    {
-      spice_disconnect();
-      return status;
-    }
+#define SPICE_URING_DATA(ptr, op) \
+  ((uint64_t)(uintptr_t)(ptr) | (op))
 
-    if (msg.current_mouse_mode != SPICE_MOUSE_MODE_CLIENT && !spice_mouse_mode(false))
-      return SPICE_STATUS_ERROR;
+#define SPICE_URING_UNARMED(channel) \
+  ((channel)->connected && (channel)->link != SPICE_LINK_CONNECTING && \
+   !(channel)->rxInflight)
 
-    void * packet = SPICE_RAW_PACKET(SPICE_MSGC_MAIN_ATTACH_CHANNELS, 0, 0);
-    if (!SPICE_SEND_PACKET(channel, packet))
-    {
-      spice_disconnect();
-      return SPICE_STATUS_ERROR;
-    }
+bool spice_init_reactor()
+{
+  if (spice->ringInit)
+    return true;
 
-    return SPICE_STATUS_OK;
-  }
+  if (io_uring_queue_init(16, &spice->ring, 0) < 0)
+    return false;
 
-  if (header.type == SPICE_MSG_MAIN_CHANNELS_LIST)
+  spice->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (spice->eventfd < 0)
   {
-    SpiceMainChannelsList msg;
-    if ((status = spice_read_nl(channel, &msg, sizeof(msg), dataAvailable)) != SPICE_STATUS_OK)
-    {
-      spice_disconnect();
-      return status;
-    }
+    io_uring_queue_exit(&spice->ring);
+    return false;
+  }
 
-    // documentation doesn't state that the array is null terminated but it seems that it is
-    SpiceChannelID channels[msg.num_of_channels];
-    if ((status = spice_read_nl(channel, &channels, msg.num_of_channels * sizeof(SpiceChannelID), dataAvailable)) != SPICE_STATUS_OK)
-    {
-      spice_disconnect();
-      return status;
-    }
+  spice->ringInit     = true;
+  spice->wakeInflight = false;
+  return true;
+}
 
-    for(int i = 0; i < msg.num_of_channels; ++i)
-    {
-      if (channels[i].type == SPICE_CHANNEL_INPUTS)
-      {
-        if (spice.scInputs.connected)
-        {
-          spice_disconnect();
-          return SPICE_STATUS_ERROR;
-        }
+// ============================================================================
 
-        if ((status = spice_connect_channel(&spice.scInputs)) != SPICE_STATUS_OK)
-        {
-          spice_disconnect();
-          return status;
-        }
-      }
-    }
+int spice_get_fd()
+{
+  if (spice->ioRunning)
+    return spice->evFd;
 
-    return SPICE_STATUS_OK;
-  }
+  if (!spice_init_reactor())
+    return -1;
 
-  if (header.type == SPICE_MSG_MAIN_AGENT_CONNECTED)
-  {
-    spice.hasAgent = true;
-    if ((status = spice_agent_connect()) != SPICE_STATUS_OK)
-    {
-      spice_disconnect();
-      return status;
-    }
-    return SPICE_STATUS_OK;
-  }
+  // the ring fd polls readable when completions are waiting
+  return spice->ring.ring_fd;
+}
 
-  if (header.type == SPICE_MSG_MAIN_AGENT_CONNECTED_TOKENS)
-  {
-    uint32_t num_tokens;
-    if ((status = spice_read_nl(channel, &num_tokens, sizeof(num_tokens), dataAvailable)) != SPICE_STATUS_OK)
-    {
-      spice_disconnect();
-      return status;
-    }
+// ============================================================================
 
-    spice.hasAgent    = true;
-    spice.serverTokens = num_tokens;
-    if ((status = spice_agent_connect()) != SPICE_STATUS_OK)
-    {
-      spice_disconnect();
-      return status;
-    }
-    return SPICE_STATUS_OK;
-  }
+static void spice_uring_complete(const struct io_uring_cqe * cqe)
+{
+  struct SpiceChannel * channel =
+    (struct SpiceChannel *)(uintptr_t)(cqe->user_data & ~SPICE_URING_OP_MASK);
 
-  if (header.type == SPICE_MSG_MAIN_AGENT_DISCONNECTED)
+  switch(cqe->user_data & SPICE_URING_OP_MASK)
   {
-    uint32_t error;
-    if ((status = spice_read_nl(channel, &error, sizeof(error), dataAvailable)) != SPICE_STATUS_OK)
-    {
-      spice_disconnect();
-      return status;
-    }
+    case SPICE_URING_RECV:
+      channel->rxInflight = false;
+      if (cqe->res > 0)
+      {
+        // the data is already in the receive buffer, there is no need to
+        // mark the channel readable
+        channel->rxLen    += cqe->res;
+        channel->rxPartial = false;
+        channel->rxLast    = get_timestamp();
+      }
+      else if (cqe->res == 0 || (cqe->res != -EINTR && cqe->res != -EAGAIN &&
+            cqe->res != -ECANCELED))
+        channel->connected = false;
+      break;
 
-    spice.hasAgent = false;
+    case SPICE_URING_POLL:
+      channel->txInflight = false;
+      if (cqe->res > 0)
+        channel->txReady = true;
+      break;
 
-    if (spice.cbBuffer)
-    {
-      free(spice.cbBuffer);
-      spice.cbBuffer = NULL;
-      spice.cbSize   = 0;
-      spice.cbRemain = 0;
-    }
+    case SPICE_URING_WAKE:
+      spice->wakeInflight = false;
+      break;
 
-    return SPICE_STATUS_OK;
+    case SPICE_URING_CANCEL:
+      break;
   }
+}
 
-  if (header.type == SPICE_MSG_MAIN_AGENT_DATA)
-  {
-    if (!spice.hasAgent)
-      return spice_discard_nl(channel, header.size, dataAvailable);
+// ============================================================================
 
-    if ((status = spice_agent_process(header.size, dataAvailable)) != SPICE_STATUS_OK)
-      spice_disconnect();
+static bool spice_uring_reap(unsigned waitNr, int timeout)
+{
+  struct io_uring_cqe * cqe;
+  struct __kernel_timespec ts =
+  {
+    .tv_sec  = timeout / 1000,
+    .tv_nsec = (timeout % 1000) * 1000000LL
+  };
 
-    return status;
-  }
+  // submit anything queued and wait in a single syscall
+  int rc = io_uring_submit_and_wait_timeout(&spice->ring, &cqe, waitNr,
+      timeout < 0 ? NULL : &ts, NULL);
+  if (rc < 0 && rc != -ETIME && rc != -EINTR)
+    return false;
 
-  if (header.type == SPICE_MSG_MAIN_AGENT_TOKEN)
+  while(io_uring_peek_cqe(&spice->ring, &cqe) == 0)
   {
-    uint32_t num_tokens;
-    if ((status = spice_read_nl(channel, &num_tokens, sizeof(num_tokens), dataAvailable)) != SPICE_STATUS_OK)
-    {
-      spice_disconnect();
-      return status;
-    }
-
-    spice.serverTokens = num_tokens;
-    return SPICE_STATUS_OK;
+    spice_uring_complete(cqe);
+    io_uring_cqe_seen(&spice->ring, cqe);
   }
 
-  return spice_discard_nl(channel, header.size, dataAvailable);
+  return true;
 }
 
 // ============================================================================
 
-SPICE_STATUS spice_on_inputs_channel_read(int * dataAvailable)
+static bool spice_uring_arm(struct SpiceChannel * channel)
 {
-  struct SpiceChannel *channel = &spice.scInputs;
+  if (!channel->connected)
+    return true;
 
-  SpiceMiniDataHeader header;
+  if (!channel->rxInflight && channel->link != SPICE_LINK_CONNECTING)
+  {
+    if (spice_rx_room_nl(channel) != SPICE_STATUS_OK)
+      return false;
 
-  SPICE_STATUS status;
-  if ((status = spice_on_common_read(channel, &header, dataAvailable)) != SPICE_STATUS_OK)
-    return status;
+    struct io_uring_sqe * sqe = io_uring_get_sqe(&spice->ring);
+    if (!sqe)
+      return false;
 
-  switch(header.type)
+    io_uring_prep_recv(sqe, channel->socket,
+        channel->rxBuffer + channel->rxLen,
+        channel->rxSize   - channel->rxLen, 0);
+    io_uring_sqe_set_data64(sqe, SPICE_URING_DATA(channel, SPICE_URING_RECV));
+    channel->rxInflight = true;
+  }
+
+  /* the outbound queue can be reallocated by other threads so it is not
+   * handed to the ring, instead we poll for writability and flush it with
+   * spice_flush_nl under the channel lock */
+  if (channel->txWatch && !channel->txInflight)
   {
-    case SPICE_MSG_INPUTS_INIT:
-    {
-      if (channel->initDone)
-        return SPICE_STATUS_ERROR;
+    struct io_uring_sqe * sqe = io_uring_get_sqe(&spice->ring);
+    if (!sqe)
+      return false;
 
-      channel->initDone = true;
+    io_uring_prep_poll_add(sqe, channel->socket, POLLOUT);
+    io_uring_sqe_set_data64(sqe, SPICE_URING_DATA(channel, SPICE_URING_POLL));
+    channel->txInflight = true;
+  }
 
-      SpiceMsgInputsInit in;
-      if ((status = spice_read_nl(channel, &in, sizeof(in), dataAvailable)) != SPICE_STATUS_OK)
-        return status;
+  return true;
+}
 
-      return SPICE_STATUS_OK;
-    }
+// ============================================================================
 
-    case SPICE_MSG_INPUTS_KEY_MODIFIERS:
-    {
-      SpiceMsgInputsInit in;
-      if ((status = spice_read_nl(channel, &in, sizeof(in), dataAvailable)) != SPICE_STATUS_OK)
-        return status;
+bool spice_reactor_wait(int timeout)
+{
+  if (!spice->ringInit)
+    return false;
 
-      spice.kb.modifiers = in.modifiers;
-      return SPICE_STATUS_OK;
-    }
+  if (!spice_uring_arm(&spice->scMain    ) ||
+      !spice_uring_arm(&spice->scInputs  ) ||
+      !spice_uring_arm(&spice->mig.scMain) ||
+      !spice_uring_arm(&spice->mig.scInputs))
+    return false;
 
-    case SPICE_MSG_INPUTS_MOUSE_MOTION_ACK:
-    {
-      const int count = atomic_fetch_sub(&spice.mouse.sentCount,
-          SPICE_INPUT_MOTION_ACK_BUNCH);
-      return (count >= SPICE_INPUT_MOTION_ACK_BUNCH) ?
-        SPICE_STATUS_OK : SPICE_STATUS_ERROR;
-    }
+  if (!spice->wakeInflight)
+  {
+    struct io_uring_sqe * sqe = io_uring_get_sqe(&spice->ring);
+    if (!sqe)
+      return false;
+
+    io_uring_prep_read(sqe, spice->eventfd, &spice->wakeValue,
+        sizeof(spice->wakeValue), 0);
+    io_uring_sqe_set_data64(sqe, SPICE_URING_DATA(NULL, SPICE_URING_WAKE));
+    spice->wakeInflight = true;
   }
 
-  return spice_discard_nl(channel, header.size, dataAvailable);
+  return spice_uring_reap(timeout == 0 ? 0 : 1, timeout);
 }
 
 // ============================================================================
 
-SPICE_STATUS spice_connect_channel(struct SpiceChannel * channel)
+bool spice_reactor_add(struct SpiceChannel * channel)
 {
-  SPICE_STATUS status;
+  // nothing to do, the receive is armed once the link is complete
+  channel->rxInflight = false;
+  channel->txInflight = false;
+  return true;
+}
 
-  channel->initDone     = false;
-  channel->ackFrequency = 0;
-  channel->ackCount     = 0;
+// ============================================================================
 
-  SPICE_LOCK_INIT(channel->lock);
+void spice_reactor_remove(struct SpiceChannel * channel)
+{
+  if (!spice->ringInit)
+    return;
 
-  size_t addrSize;
-  switch(spice.family)
+  // cancel anything still in flight and wait for it as the kernel may still
+  // write into the receive buffer until the cancellation completes
+  for(int op = SPICE_URING_RECV; op <= SPICE_URING_POLL; ++op)
   {
-    case AF_UNIX:
-      addrSize = sizeof(spice.addr.un);
-      break;
+    const bool inflight = op == SPICE_URING_RECV ?
+      channel->rxInflight : channel->txInflight;
+    if (!inflight)
+      continue;
 
-    case AF_INET:
-      addrSize = sizeof(spice.addr.in);
+    struct io_uring_sqe * sqe = io_uring_get_sqe(&spice->ring);
+    if (!sqe)
       break;
 
-    case AF_INET6:
-      addrSize = sizeof(spice.addr.in6);
+    io_uring_prep_cancel64(sqe, SPICE_URING_DATA(channel, op), 0);
+    io_uring_sqe_set_data64(sqe, SPICE_URING_DATA(NULL, SPICE_URING_CANCEL));
+  }
+
+  while(channel->rxInflight || channel->txInflight)
+    if (!spice_uring_reap(1, -1))
       break;
+}
 
-    default:
-      return SPICE_STATUS_ERROR;
-  }
+// ============================================================================
 
-  channel->socket = socket(spice.family, SOCK_STREAM, 0);
-  if (channel->socket == -1)
-    return SPICE_STATUS_ERROR;
+bool spice_watch_nl(struct SpiceChannel * channel, bool writable)
+{
+  if (channel->txWatch == writable)
+    return true;
 
-  if (spice.family != AF_UNIX)
-  {
-    const int flag = 1;
-    setsockopt(channel->socket, IPPROTO_TCP, TCP_NODELAY , &flag, sizeof(int));
-    setsockopt(channel->socket, IPPROTO_TCP, TCP_QUICKACK, &flag, sizeof(int));
-  }
+  // the ring belongs to the thread in spice_process, wake it so that it
+  // starts polling the socket for writability
+  channel->txWatch = writable;
+  return !writable || spice_wakeup();
+}
 
-  if (connect(channel->socket, &spice.addr.addr, addrSize) == -1)
-  {
-    close(channel->socket);
-    return SPICE_STATUS_ERROR;
-  }
+#else
 
-  channel->connected = true;
+bool spice_init_reactor()
+{
+  if (spice->epollfd >= 0)
+    return true;
 
-  typedef struct
+  spice->epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if (spice->epollfd < 0)
+    return false;
+
+  spice->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (spice->eventfd < 0)
   {
-    SpiceLinkHeader header;
-    SpiceLinkMess   message;
-    uint32_t        supportCaps[COMMON_CAPS_BYTES / sizeof(uint32_t)];
-    uint32_t        channelCaps[MAIN_CAPS_BYTES   / sizeof(uint32_t)];
+    close(spice->epollfd);
+    spice->epollfd = -1;
+    return false;
   }
-  __attribute__((packed)) ConnectPacket;
 
-  ConnectPacket p =
+  // the eventfd is registered with a NULL pointer so it can be told apart
+  // from the channel sockets which carry their SpiceChannel
+  struct epoll_event ev =
   {
-    .header = {
-      .magic         = SPICE_MAGIC        ,
-      .major_version = SPICE_VERSION_MAJOR,
-      .minor_version = SPICE_VERSION_MINOR,
-      .size          = sizeof(ConnectPacket) - sizeof(SpiceLinkHeader)
-    },
-    .message = {
-      .connection_id    = spice.sessionID,
-      .channel_type     = channel->channelType,
-      .channel_id       = spice.channelID,
-      .num_common_caps  = COMMON_CAPS_BYTES / sizeof(uint32_t),
-      .num_channel_caps = MAIN_CAPS_BYTES   / sizeof(uint32_t),
-      .caps_offset      = sizeof(SpiceLinkMess)
-    }
+    .events   = EPOLLIN,
+    .data.ptr = NULL
   };
 
-  COMMON_SET_CAPABILITY(p.supportCaps, SPICE_COMMON_CAP_PROTOCOL_AUTH_SELECTION);
-  COMMON_SET_CAPABILITY(p.supportCaps, SPICE_COMMON_CAP_AUTH_SPICE             );
-  COMMON_SET_CAPABILITY(p.supportCaps, SPICE_COMMON_CAP_MINI_HEADER            );
-
-  if (channel == &spice.scMain)
-    MAIN_SET_CAPABILITY(p.channelCaps, SPICE_MAIN_CAP_AGENT_CONNECTED_TOKENS);
-
-  if (spice_write_nl(channel, &p, sizeof(p)) != sizeof(p))
+  if (epoll_ctl(spice->epollfd, EPOLL_CTL_ADD, spice->eventfd, &ev) != 0)
   {
-    spice_disconnect_channel(channel);
-    return SPICE_STATUS_ERROR;
+    close(spice->eventfd);
+    close(spice->epollfd);
+    spice->eventfd = -1;
+    spice->epollfd = -1;
+    return false;
   }
 
-  if ((status = spice_read_nl(channel, &p.header, sizeof(p.header), NULL)) != SPICE_STATUS_OK)
-  {
-    spice_disconnect_channel(channel);
-    return status;
-  }
+  return true;
+}
 
-  if (p.header.magic         != SPICE_MAGIC ||
-      p.header.major_version != SPICE_VERSION_MAJOR)
-  {
-    spice_disconnect_channel(channel);
-    return SPICE_STATUS_ERROR;
-  }
+// ============================================================================
 
-  if (p.header.size < sizeof(SpiceLinkReply))
-  {
-    spice_disconnect_channel(channel);
-    return SPICE_STATUS_ERROR;
-  }
+int spice_get_fd()
+{
+  if (spice->ioRunning)
+    return spice->evFd;
 
-  SpiceLinkReply reply;
-  if ((status = spice_read_nl(channel, &reply, sizeof(reply), NULL)) != SPICE_STATUS_OK)
-  {
-    spice_disconnect_channel(channel);
-    return status;
-  }
+  if (!spice_init_reactor())
+    return -1;
 
-  if (reply.error != SPICE_LINK_ERR_OK)
-  {
-    spice_disconnect_channel(channel);
-    return SPICE_STATUS_ERROR;
-  }
+  return spice->epollfd;
+}
 
-  uint32_t capsCommon [reply.num_common_caps ];
-  uint32_t capsChannel[reply.num_channel_caps];
-  if ((status = spice_read_nl(channel, &capsCommon , sizeof(capsCommon ), NULL)) != SPICE_STATUS_OK ||
-      (status = spice_read_nl(channel, &capsChannel, sizeof(capsChannel), NULL)) != SPICE_STATUS_OK)
-  {
-    spice_disconnect_channel(channel);
-    return status;
-  }
+// ============================================================================
 
-  SpiceLinkAuthMechanism auth;
-  auth.auth_mechanism = SPICE_COMMON_CAP_AUTH_SPICE;
-  if (spice_write_nl(channel, &auth, sizeof(auth)) != sizeof(auth))
-  {
-    spice_disconnect_channel(channel);
-    return SPICE_STATUS_ERROR;
-  }
+bool spice_reactor_wait(int timeout)
+{
+  if (spice->epollfd < 0)
+    return false;
 
-  struct spice_password pass;
-  if (!spice_rsa_encrypt_password(reply.pub_key, spice.password, &pass))
-  {
-    spice_disconnect_channel(channel);
-    return SPICE_STATUS_ERROR;
-  }
+  struct epoll_event events[5];
+  int rc = epoll_wait(spice->epollfd, events,
+      sizeof(events) / sizeof(*events), timeout);
+
+  if (rc < 0)
+    return errno == EINTR;
 
-  if (spice_write_nl(channel, pass.data, pass.size) != pass.size)
+  for(int i = 0; i < rc; ++i)
   {
-    spice_rsa_free_password(&pass);
-    spice_disconnect_channel(channel);
-    return SPICE_STATUS_ERROR;
+    struct SpiceChannel * channel = events[i].data.ptr;
+    if (!channel)
+    {
+      uint64_t value;
+      if (read(spice->eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        return false;
+      continue;
+    }
+
+    channel->rxReady = events[i].events & (EPOLLIN  | EPOLLHUP | EPOLLERR);
+    channel->txReady = events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR);
   }
 
-  spice_rsa_free_password(&pass);
+  return true;
+}
 
-  uint32_t linkResult;
-  if ((status = spice_read_nl(channel, &linkResult, sizeof(linkResult), NULL)) != SPICE_STATUS_OK)
-  {
-    spice_disconnect_channel(channel);
-    return status;
-  }
+// ============================================================================
 
-  if (linkResult != SPICE_LINK_ERR_OK)
+bool spice_reactor_add(struct SpiceChannel * channel)
+{
+  struct epoll_event ev =
   {
-    spice_disconnect_channel(channel);
-    return SPICE_STATUS_ERROR;
-  }
+    .events   = EPOLLIN,
+    .data.ptr = channel
+  };
 
-  channel->ready = true;
-  return SPICE_STATUS_OK;
+  return epoll_ctl(spice->epollfd, EPOLL_CTL_ADD, channel->socket, &ev) == 0;
 }
 
 // ============================================================================
 
-void spice_disconnect_channel(struct SpiceChannel * channel)
+void spice_reactor_remove(struct SpiceChannel * channel)
 {
-  if (!channel->connected)
-    return;
+  epoll_ctl(spice->epollfd, EPOLL_CTL_DEL, channel->socket, NULL);
+}
 
-  if (channel->ready)
-  {
-    /* disable nodelay so we can trigger a flush after this message */
-    int flag;
-    if (spice.family != AF_UNIX)
-    {
-      flag = 0;
-      setsockopt(channel->socket, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
-    }
+// ============================================================================
 
-    SpiceMsgcDisconnecting * packet = SPICE_PACKET(SPICE_MSGC_DISCONNECTING,
-        SpiceMsgcDisconnecting, 0);
-    packet->time_stamp = get_timestamp();
-    packet->reason     = SPICE_LINK_ERR_OK;
-    SPICE_SEND_PACKET(channel, packet);
+bool spice_watch_nl(struct SpiceChannel * channel, bool writable)
+{
+  if (channel->txWatch == writable)
+    return true;
 
-    /* re-enable nodelay as this triggers a flush according to the man page */
-    if (spice.family != AF_UNIX)
-    {
-      flag = 1;
-      setsockopt(channel->socket, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
-    }
-  }
+  struct epoll_event ev =
+  {
+    .events   = EPOLLIN | (writable ? EPOLLOUT : 0),
+    .data.ptr = channel
+  };
 
-  shutdown(channel->socket, SHUT_WR);
+  if (epoll_ctl(spice->epollfd, EPOLL_CTL_MOD, channel->socket, &ev) != 0)
+    return false;
+
+  channel->txWatch = writable;
+  return true;
 }
 
+#endif
+
 // ============================================================================
 
-SPICE_STATUS spice_agent_connect()
+bool spice_wakeup()
 {
-  uint32_t * packet = SPICE_PACKET(SPICE_MSGC_MAIN_AGENT_START, uint32_t, 0);
-  *packet = SPICE_AGENT_TOKENS_MAX;
-  if (!SPICE_SEND_PACKET(&spice.scMain, packet))
-    return SPICE_STATUS_ERROR;
+  if (spice->eventfd < 0)
+    return false;
 
-  return spice_agent_send_caps(true);
+  const uint64_t value = 1;
+  return write(spice->eventfd, &value, sizeof(value)) == sizeof(value);
 }
 
 // ============================================================================
 
-SPICE_STATUS spice_agent_process(uint32_t dataSize, int * dataAvailable)
+void spice_io_request(unsigned int request)
 {
-  SPICE_STATUS status;
-  if (spice.cbRemain)
+  atomic_fetch_or(&spice->ioRequest, request);
+  spice_wakeup();
+}
+
+// ============================================================================
+
+void spice_io_requests()
+{
+  const unsigned int request = atomic_exchange(&spice->ioRequest, 0);
+
+  if (request & SPICE_IO_DISCONNECT)
+    spice_disconnect_session();
+
+  if (request & SPICE_IO_LIVENESS)
   {
-    const uint32_t r = spice.cbRemain > dataSize ? dataSize : spice.cbRemain;
-    if ((status = spice_read_nl(&spice.scMain, spice.cbBuffer + spice.cbSize, r, dataAvailable)) != SPICE_STATUS_OK)
+    spice_liveness_sockopt(&spice->scMain  , spice->family);
+    spice_liveness_sockopt(&spice->scInputs, spice->family);
+  }
+}
+
+// ============================================================================
+
+static void * spice_io_thread(void * opaque)
+{
+  spice = opaque;
+  while(!atomic_load(&spice->ioStop))
+    if (!spice_process_io(1000))
     {
-      free(spice.cbBuffer);
-      spice.cbBuffer = NULL;
-      spice.cbRemain = 0;
-      spice.cbSize   = 0;
-      return status;
+      spice_event(SPICE_EVENT_DISCONNECT, SPICE_DATA_NONE, NULL, 0);
+      break;
     }
 
-    spice.cbRemain -= r;
-    spice.cbSize   += r;
+  return NULL;
+}
 
-    if (spice.cbRemain == 0)
-      spice_agent_on_clipboard();
+// ============================================================================
 
-    return SPICE_STATUS_OK;
+bool spice_start_io_thread(int cpu, int priority)
+{
+  if (spice->ioRunning || !spice->scMain.connected)
+    return false;
+
+  spice->evFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (spice->evFd < 0)
+    return false;
+
+  SPICE_LOCK_INIT(spice->evLock);
+  spice->evHead = NULL;
+  spice->evTail = &spice->evHead;
+  atomic_store(&spice->ioStop, false);
+  atomic_store(&spice->ioRequest, 0);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+
+  if (cpu >= 0)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
   }
 
-  VDAgentMessage msg;
+  if (priority > 0)
+  {
+    struct sched_param param = { .sched_priority = priority };
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+    pthread_attr_setschedparam  (&attr, &param);
+  }
 
-  #pragma pack(push,1)
-  struct Selection
+  // callbacks must be queued from the moment the thread starts
+  spice->ioRunning = true;
+  const int rc = pthread_create(&spice->ioThread, &attr, spice_io_thread, spice);
+  pthread_attr_destroy(&attr);
+
+  if (rc != 0)
   {
-    uint8_t selection;
-    uint8_t reserved[3];
+    // most likely EPERM as the caller is not allowed to use SCHED_FIFO
+    spice->ioRunning = false;
+    close(spice->evFd);
+    spice->evFd = -1;
+    return false;
+  }
+
+  return true;
+}
+
+// ============================================================================
+
+void spice_stop_io_thread()
+{
+  if (!spice->ioRunning)
+    return;
+
+  atomic_store(&spice->ioStop, true);
+  spice_wakeup();
+  pthread_join(spice->ioThread, NULL);
+
+  // deliver anything the thread left behind before going back to invoking
+  // the callbacks directly
+  spice->ioRunning = false;
+  spice_event_drain();
+
+  close(spice->evFd);
+  spice->evFd = -1;
+}
+
+// ============================================================================
+
+void spice_event(SpiceEventType type, SpiceDataType dataType, uint8_t * buffer, uint32_t size)
+{
+  struct SpiceEvent event =
+  {
+    .type     = type,
+    .dataType = dataType,
+    .buffer   = buffer,
+    .size     = size
   };
-  #pragma pack(pop)
 
-  if ((status = spice_read_nl(&spice.scMain, &msg, sizeof(msg), dataAvailable)) != SPICE_STATUS_OK)
-    return status;
+  if (!spice->ioRunning)
+  {
+    spice_event_invoke(&event);
+    return;
+  }
 
-  dataSize -= sizeof(msg);
+  struct SpiceEvent * e = malloc(sizeof(*e));
+  if (!e)
+  {
+    free(buffer);
+    return;
+  }
 
-  if (msg.protocol != VD_AGENT_PROTOCOL)
-    return SPICE_STATUS_ERROR;
+  memcpy(e, &event, sizeof(*e));
 
-  switch(msg.type)
+  SPICE_LOCK(spice->evLock);
+  *spice->evTail = e;
+  spice->evTail  = &e->next;
+  SPICE_UNLOCK(spice->evLock);
+
+  const uint64_t value = 1;
+  if (write(spice->evFd, &value, sizeof(value)) != sizeof(value))
+    fprintf(stderr, "failed to signal the event queue\n");
+}
+
+// ============================================================================
+
+void spice_event_invoke(struct SpiceEvent * event)
+{
+  switch(event->type)
   {
-    case VD_AGENT_ANNOUNCE_CAPABILITIES:
-    {
-      // make sure the message size is not insane to avoid a stack overflow
-      // since we are using alloca for performance
-      if (msg.size > 1024)
-        return SPICE_STATUS_ERROR;
+    case SPICE_EVENT_CB_NOTICE:
+      if (spice->cbNoticeFn)
+        spice->cbNoticeFn(event->dataType);
+      break;
 
-      VDAgentAnnounceCapabilities *caps = (VDAgentAnnounceCapabilities *)alloca(msg.size);
+    case SPICE_EVENT_CB_DATA:
+      if (spice->cbDataFn)
+        spice->cbDataFn(event->dataType, event->buffer, event->size);
+      break;
 
-      if ((status = spice_read_nl(&spice.scMain, caps, msg.size, dataAvailable)) != SPICE_STATUS_OK)
-        return status;
+    case SPICE_EVENT_CB_RELEASE:
+      if (spice->cbReleaseFn)
+        spice->cbReleaseFn();
+      break;
 
-      const int capsSize = VD_AGENT_CAPS_SIZE_FROM_MSG_SIZE(msg.size);
-      spice.cbSupported  = VD_AGENT_HAS_CAPABILITY(caps->caps, capsSize, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND) ||
-                           VD_AGENT_HAS_CAPABILITY(caps->caps, capsSize, VD_AGENT_CAP_CLIPBOARD_SELECTION);
-      spice.cbSelection  = VD_AGENT_HAS_CAPABILITY(caps->caps, capsSize, VD_AGENT_CAP_CLIPBOARD_SELECTION);
+    case SPICE_EVENT_CB_REQUEST:
+      if (spice->cbRequestFn)
+        spice->cbRequestFn(event->dataType);
+      break;
 
-      if (caps->request)
-        return spice_agent_send_caps(false);
+    case SPICE_EVENT_TYPING_DONE:
+      if (spice->typingDoneFn)
+        spice->typingDoneFn(event->size != 0);
+      break;
 
-      return SPICE_STATUS_OK;
-    }
+    case SPICE_EVENT_READY:
+      if (spice->readyFn)
+        spice->readyFn();
+      break;
 
-    case VD_AGENT_CLIPBOARD:
-    case VD_AGENT_CLIPBOARD_REQUEST:
-    case VD_AGENT_CLIPBOARD_GRAB:
-    case VD_AGENT_CLIPBOARD_RELEASE:
-    {
-      uint32_t remaining = msg.size;
-      if (spice.cbSelection)
-      {
-        struct Selection selection;
-        if ((status = spice_read_nl(&spice.scMain, &selection, sizeof(selection), dataAvailable)) != SPICE_STATUS_OK)
-          return status;
-        remaining -= sizeof(selection);
-        dataSize  -= sizeof(selection);
-      }
+    case SPICE_EVENT_DEAD:
+      if (spice->deadFn)
+        spice->deadFn((SpiceChannelKind)event->size);
+      break;
 
-      if (msg.type == VD_AGENT_CLIPBOARD_RELEASE)
-      {
-        spice.cbAgentGrabbed = false;
-        if (spice.cbReleaseFn)
-          spice.cbReleaseFn();
-        return SPICE_STATUS_OK;
-      }
+    case SPICE_EVENT_DISCONNECT:
+      break;
+  }
 
-      if (msg.type == VD_AGENT_CLIPBOARD || msg.type == VD_AGENT_CLIPBOARD_REQUEST)
-      {
-        uint32_t type;
-        if ((status = spice_read_nl(&spice.scMain, &type, sizeof(type), dataAvailable)) != SPICE_STATUS_OK)
-          return status;
-        remaining -= sizeof(type);
-        dataSize  -= sizeof(type);
+  free(event->buffer);
+}
 
-        if (msg.type == VD_AGENT_CLIPBOARD)
-        {
-          if (spice.cbBuffer)
-            return SPICE_STATUS_ERROR;
+// ============================================================================
 
-          spice.cbSize     = 0;
-          spice.cbRemain   = remaining;
-          spice.cbBuffer   = (uint8_t *)malloc(remaining);
-          const uint32_t r = remaining > dataSize ? dataSize : remaining;
+bool spice_event_drain()
+{
+  SPICE_LOCK(spice->evLock);
+  struct SpiceEvent * e = spice->evHead;
+  spice->evHead = NULL;
+  spice->evTail = &spice->evHead;
+  SPICE_UNLOCK(spice->evLock);
+
+  bool connected = true;
+  while(e)
+  {
+    struct SpiceEvent * next = e->next;
+    if (e->type == SPICE_EVENT_DISCONNECT)
+      connected = false;
 
-          if ((status = spice_read_nl(&spice.scMain, spice.cbBuffer, r, dataAvailable)) != SPICE_STATUS_OK)
-          {
-            free(spice.cbBuffer);
-            spice.cbBuffer = NULL;
-            spice.cbRemain = 0;
-            spice.cbSize   = 0;
-            return status;
-          }
+    spice_event_invoke(e);
+    free(e);
+    e = next;
+  }
 
-          spice.cbRemain -= r;
-          spice.cbSize   += r;
+  return connected;
+}
 
-          if (spice.cbRemain == 0)
-            spice_agent_on_clipboard();
+// ============================================================================
 
-          return SPICE_STATUS_OK;
-        }
-        else
-        {
-          if (spice.cbRequestFn)
-            spice.cbRequestFn(agent_type_to_spice_type(type));
-          return SPICE_STATUS_OK;
-        }
-      }
-      else
-      {
-        if (remaining == 0)
-          return SPICE_STATUS_OK;
+bool spice_process_events(int timeout)
+{
+  struct pollfd pfd =
+  {
+    .fd     = spice->evFd,
+    .events = POLLIN
+  };
 
-        // ensure the size is sane to avoid a stack overflow since we use alloca
-        // for performance
-        if (remaining > 1024)
-          return SPICE_STATUS_ERROR;
+  if (poll(&pfd, 1, timeout) < 0)
+    return errno == EINTR;
 
-        uint32_t *types = alloca(remaining);
-        if ((status = spice_read_nl(&spice.scMain, types, remaining, dataAvailable)) != SPICE_STATUS_OK)
-          return status;
+  uint64_t value;
+  if (read(spice->evFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    return false;
 
-        // there is zero documentation on the types field, it might be a bitfield
-        // but for now we are going to assume it's not.
+  if (spice_event_drain())
+    return true;
 
-        spice.cbType          = agent_type_to_spice_type(types[0]);
-        spice.cbAgentGrabbed  = true;
-        spice.cbClientGrabbed = false;
-        if (spice.cbSelection)
-        {
-          // Windows doesnt support this, so until it's needed there is no point messing with it
-          return SPICE_STATUS_OK;
-        }
+  // the I/O thread has exited and the channels have been closed
+  pthread_join(spice->ioThread, NULL);
+  spice->ioRunning = false;
+  close(spice->evFd);
+  spice->evFd = -1;
+  return false;
+}
 
-        if (spice.cbNoticeFn)
-            spice.cbNoticeFn(spice.cbType);
+// ============================================================================
 
-        return SPICE_STATUS_OK;
-      }
-    }
+size_t spice_get_queued(SpiceChannelKind kind)
+{
+  struct SpiceChannel * channel;
+  switch(kind)
+  {
+    case SPICE_CHANNEL_KIND_MAIN  : channel = &spice->scMain  ; break;
+    case SPICE_CHANNEL_KIND_INPUTS: channel = &spice->scInputs; break;
+    default:
+      return 0;
   }
 
-  return spice_discard_nl(&spice.scMain, msg.size, dataAvailable);
-}
+  SPICE_LOCK(channel->lock);
+  const size_t queued = channel->txLen - channel->txPos;
+  SPICE_UNLOCK(channel->lock);
 
+  return queued;
+}
 
 // ============================================================================
 
-void spice_agent_on_clipboard()
+bool spice_get_lock_stats(SpiceChannelKind kind, SpiceLockStats * stats)
 {
-  if (spice.cbDataFn)
-    spice.cbDataFn(spice.cbType, spice.cbBuffer, spice.cbSize);
+  switch(kind)
+  {
+    case SPICE_CHANNEL_KIND_MAIN  : spice_lock_stats(&spice->scMain  .lock, stats); break;
+    case SPICE_CHANNEL_KIND_INPUTS: spice_lock_stats(&spice->scInputs.lock, stats); break;
+    default:
+      return false;
+  }
 
-  free(spice.cbBuffer);
-  spice.cbBuffer = NULL;
-  spice.cbSize   = 0;
-  spice.cbRemain = 0;
+  return true;
 }
 
 // ============================================================================
 
-SPICE_STATUS spice_agent_send_caps(bool request)
+bool spice_process(int timeout)
 {
-  const ssize_t capsSize = sizeof(VDAgentAnnounceCapabilities) + VD_AGENT_CAPS_BYTES;
-  VDAgentAnnounceCapabilities *caps = (VDAgentAnnounceCapabilities *)alloca(capsSize);
-  memset(caps, 0, capsSize);
+  if (spice->ioRunning)
+    return spice_process_events(timeout);
 
-  caps->request = request ? 1 : 0;
-  VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND);
-  VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_CLIPBOARD_SELECTION);
+  return spice_process_io(timeout);
+}
 
-  if (!spice_agent_start_msg(VD_AGENT_ANNOUNCE_CAPABILITIES, capsSize) ||
-      !spice_agent_write_msg(caps, capsSize))
-    return SPICE_STATUS_ERROR;
+// ============================================================================
 
-  return SPICE_STATUS_OK;
+int spice_process_timeout(int timeout)
+{
+  // data may already be buffered from the link handshake, if so don't block
+  // waiting on the socket as it may never become readable again
+  if (SPICE_RX_PENDING (&spice->scMain) || SPICE_RX_PENDING (&spice->scInputs) ||
+      SPICE_TLS_PENDING(&spice->scMain) || SPICE_TLS_PENDING(&spice->scInputs))
+    return 0;
+
+  // wake up in time for the next reconnect attempt, or to give up on one
+  const uint64_t due = spice->rcDue ? spice->rcDue : spice->rcDeadline;
+  if (due && !spice->rcStop)
+  {
+    const uint64_t now  = get_timestamp();
+    const int      wait = due > now ? (int)(due - now) : 0;
+    if (timeout < 0 || wait < timeout)
+      timeout = wait;
+  }
+
+  // wake up in time to give up on a silent channel
+  timeout = spice_liveness_timeout(timeout);
+
+  // wake up in time to send the next batch of typed text
+  return spice_typing_timeout(timeout);
 }
 
 // ============================================================================
 
-bool spice_agent_start_msg(uint32_t type, ssize_t size)
+bool spice_process_io(int timeout)
 {
-  VDAgentMessage * msg =
-    SPICE_PACKET(SPICE_MSGC_MAIN_AGENT_DATA, VDAgentMessage, 0);
+  if (!spice_reactor_wait(spice_process_timeout(timeout)))
+    return false;
 
-  msg->protocol  = VD_AGENT_PROTOCOL;
-  msg->type      = type;
-  msg->opaque    = 0;
-  msg->size      = size;
-  spice.agentMsg = size;
+  if (atomic_load(&spice->ioRequest))
+    spice_io_requests();
 
-  SPICE_LOCK(spice.scMain.lock);
-  if (!SPICE_SEND_PACKET_NL(&spice.scMain, msg))
-  {
-    SPICE_UNLOCK(spice.scMain.lock);
+  if (spice->resolve.running && atomic_load(&spice->resolve.done))
+    spice_resolve_complete();
+
+  if (spice->rcDue && !spice->rcStop && get_timestamp() >= spice->rcDue)
+    spice_reconnect_attempt();
+
+  spice_typing_process();
+
+  if (spice->scInputs.connected && SPICE_CHANNEL_PENDING(&spice->scInputs))
+    if (!spice_process_channel(&spice->scInputs) &&
+        !spice_channel_lost(&spice->scInputs))
+      return false;
+
+  if (spice->scMain.connected && SPICE_CHANNEL_PENDING(&spice->scMain))
+    if (!spice_process_channel(&spice->scMain) &&
+        !spice_channel_lost(&spice->scMain))
+      return false;
+
+  if (!spice_liveness_check())
+    return false;
+
+  // this may switch over channels the source has just closed
+  spice_migrate_process();
+
+  if (spice_session_lost() && spice_reconnect_schedule())
+    return true;
+
+  if (spice->scMain.connected || spice->scInputs.connected ||
+      spice->resolve.running || (spice->rcDue && !spice->rcStop))
+    return true;
+
+  /* shutdown */
+  spice->sessionID  = 0;
+  spice->rcDue      = 0;
+  spice->rcDeadline = 0;
+  spice_agent_reset();
+  spice_type_cancel();
+  spice_input_close();
+  spice_migrate_abort();
+
+  spice_close_channel(&spice->scInputs);
+  spice_close_channel(&spice->scMain  );
+  return false;
+}
+
+// ============================================================================
+
+bool spice_channel_lost(struct SpiceChannel * channel)
+{
+  // without reconnect a channel error ends the session as it always has
+  if (!spice->rcAttempts || spice->rcStop)
     return false;
+
+  channel->connected = false;
+  return true;
+}
+
+// ============================================================================
+
+bool spice_session_lost()
+{
+  if (!spice->rcAttempts || spice->rcStop || spice->rcDue)
+    return false;
+
+  // the attempt has stalled, the server may not accept the old session
+  if (spice->rcDeadline && get_timestamp() >= spice->rcDeadline)
+  {
+    spice->sessionID = 0;
+    return true;
+  }
+
+  // a channel that has gone away but not yet been closed
+  return
+    (spice->scMain  .socket >= 0 && !spice->scMain  .connected) ||
+    (spice->scInputs.socket >= 0 && !spice->scInputs.connected);
+}
+
+// ============================================================================
+
+bool spice_reconnect_schedule()
+{
+  /* if the server answered but the link still failed it may not know the
+   * session anymore (ie, QEMU restarted), start a new one next time */
+  if (spice->scMain.link != SPICE_LINK_CONNECTING &&
+      spice->scMain.link != SPICE_LINK_DONE)
+    spice->sessionID = 0;
+
+  // input is held from here on until the inputs channel is back
+  spice_input_detach();
+  spice_migrate_abort();
+  spice_close_channel(&spice->scInputs);
+  spice_close_channel(&spice->scMain  );
+
+  spice_agent_reset();
+  spice_type_cancel();
+  spice->rcDeadline = 0;
+
+  if (spice->rcAttempts > 0 && spice->rcAttempt >= spice->rcAttempts)
+  {
+    spice->rcStop = true;
+    return false;
+  }
+
+  // the delay doubles with each failed attempt up to the maximum
+  const int      shift = spice->rcAttempt < 16 ? spice->rcAttempt : 16;
+  const uint64_t delay = (uint64_t)spice->rcMinDelay << shift;
+
+  ++spice->rcAttempt;
+  spice->rcDue = get_timestamp() +
+    (delay < spice->rcMaxDelay ? delay : spice->rcMaxDelay);
+  return true;
+}
+
+// ============================================================================
+
+void spice_reconnect_attempt()
+{
+  spice->rcDue      = 0;
+  spice->rcDeadline = get_timestamp() + SPICE_RECONNECT_TIMEOUT;
+  spice->channelID  = 0;
+
+  /* the last session ID is offered so the server can resume it, the inputs
+   * channel is linked as soon as the main channel is, see spice_link_result */
+  if (spice_connect_channel(&spice->scMain) != SPICE_STATUS_OK)
+    spice_reconnect_schedule();
+}
+
+// ============================================================================
+
+void spice_liveness_sockopt(struct SpiceChannel * channel, short family)
+{
+  if (channel->socket < 0 || family == AF_UNIX)
+    return;
+
+  /* probe an idle connection often enough that the peer is given up on
+   * within the deadline, and don't wait longer than that for unacknowledged
+   * data either. TCP_USER_TIMEOUT also bounds the keepalive probes */
+  const unsigned int deadline = spice->lvDeadline;
+  const int keepalive = deadline ? 1 : 0;
+  const int timeout   = deadline;
+  const int interval  = deadline > 4000 ? deadline / 4000 : 1;
+  const int count     = 3;
+
+  setsockopt(channel->socket, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(int));
+  setsockopt(channel->socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(int));
+  if (!keepalive)
+    return;
+
+  setsockopt(channel->socket, IPPROTO_TCP, TCP_KEEPIDLE , &interval, sizeof(int));
+  setsockopt(channel->socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(int));
+  setsockopt(channel->socket, IPPROTO_TCP, TCP_KEEPCNT  , &count   , sizeof(int));
+}
+
+// ============================================================================
+
+void spice_liveness_ping(struct SpiceChannel * channel)
+{
+  const uint64_t now = get_timestamp();
+  if (channel->pingLast)
+  {
+    // smoothed so a single late ping doesn't stretch the limit
+    const uint64_t gap = now - channel->pingLast;
+    channel->pingInterval = channel->pingInterval ?
+      (uint32_t)((channel->pingInterval * 3ULL + gap) / 4) : (uint32_t)gap;
+  }
+
+  channel->pingLast = now;
+}
+
+// ============================================================================
+
+static uint64_t spice_liveness_expiry(const struct SpiceChannel * channel)
+{
+  /* a channel the server doesn't ping may simply be idle, it is left to the
+   * socket options. The limit is never less than two of the server's pings
+   * so a slow cadence doesn't look like a dead peer */
+  uint64_t limit = spice->lvDeadline;
+  if (!limit || !channel->connected || !channel->pingLast)
+    return 0;
+
+  if (limit < channel->pingInterval * 2ULL)
+    limit = channel->pingInterval * 2ULL;
+
+  return channel->rxLast + limit;
+}
+
+// ============================================================================
+
+bool spice_liveness_check()
+{
+  if (!spice->lvDeadline)
+    return true;
+
+  const uint64_t now = get_timestamp();
+  struct
+  {
+    struct SpiceChannel * channel;
+    SpiceChannelKind      kind;
+  }
+  channels[] =
+  {
+    { &spice->scInputs, SPICE_CHANNEL_KIND_INPUTS },
+    { &spice->scMain  , SPICE_CHANNEL_KIND_MAIN   }
+  };
+
+  for(int i = 0; i < 2; ++i)
+  {
+    struct SpiceChannel * channel = channels[i].channel;
+    const uint64_t expiry = spice_liveness_expiry(channel);
+    if (!expiry || now < expiry)
+      continue;
+
+    // let the application fail over before the channel is torn down
+    spice_event(SPICE_EVENT_DEAD, SPICE_DATA_NONE, NULL, channels[i].kind);
+    channel->connected = false;
+    spice_reactor_remove(channel);
+
+    if (!spice_channel_lost(channel))
+      return false;
+  }
+
+  return true;
+}
+
+// ============================================================================
+
+int spice_liveness_timeout(int timeout)
+{
+  const uint64_t expiry[] =
+  {
+    spice_liveness_expiry(&spice->scInputs),
+    spice_liveness_expiry(&spice->scMain  )
+  };
+
+  const uint64_t now = get_timestamp();
+  for(int i = 0; i < 2; ++i)
+  {
+    if (!expiry[i])
+      continue;
+
+    const int wait = expiry[i] > now ? (int)(expiry[i] - now) : 0;
+    if (timeout < 0 || wait < timeout)
+      timeout = wait;
+  }
+
+  return timeout;
+}
+
+// ============================================================================
+
+bool spice_process_channel(struct SpiceChannel * channel)
+{
+  const bool readable = channel->rxReady || SPICE_TLS_PENDING(channel);
+  const bool writable = channel->txReady;
+  channel->rxReady = false;
+  channel->txReady = false;
+
+  // the connect must complete before anything else touches the socket
+  if (channel->link == SPICE_LINK_CONNECTING)
+  {
+    if (!readable && !writable)
+      return true;
+
+    if (spice_link_send(channel) != SPICE_STATUS_OK)
+      return spice_link_failed(channel);
+  }
+
+  // send whatever is queued now that the socket can accept it, if another
+  // thread holds the lock it is writing and we will be called again
+  else if (writable && SPICE_TRYLOCK(channel->lock))
+  {
+    const SPICE_STATUS status = spice_flush_nl(channel);
+    SPICE_UNLOCK(channel->lock);
+
+    if (status == SPICE_STATUS_ERROR)
+      return false;
+
+    // the socket has drained, send the latest position if one was held back
+    if (channel == &spice->scInputs && status == SPICE_STATUS_OK &&
+        atomic_load(&spice->mouse.positionHeld))
+      spice_input_kick();
+  }
+
+  // pull in as much as is available with a single recv, this never blocks
+  if (readable)
+  {
+    SPICE_STATUS status = spice_recv_nl(channel, MSG_DONTWAIT);
+    if (status == SPICE_STATUS_NODATA)
+      channel->connected = false;
+    else if (status == SPICE_STATUS_ERROR)
+      return false;
+  }
+
+  if (channel->connected && channel->link != SPICE_LINK_DONE)
+  {
+    const SPICE_STATUS status = spice_link_process(channel);
+    if (status == SPICE_STATUS_ERROR)
+      return spice_link_failed(channel);
+
+    if (status == SPICE_STATUS_INCOMPLETE)
+      return true;
+  }
+
+  // process as many complete messages as possible, anything left over stays
+  // buffered until the rest of the message arrives
+  while(channel->connected && SPICE_RX_PENDING(channel))
+  {
+    SPICE_STATUS status;
+    if (SPICE_MIGRATE_CHANNEL(channel))
+      status = spice_on_migrate_read(channel);
+    else if (channel == &spice->scMain)
+      status = spice_on_main_channel_read();
+    else
+      status = spice_on_inputs_channel_read();
+
+    switch(status)
+    {
+      case SPICE_STATUS_OK:
+      case SPICE_STATUS_HANDLED:
+        break;
+
+      case SPICE_STATUS_INCOMPLETE:
+        channel->rxPartial = true;
+        return true;
+
+      case SPICE_STATUS_NODATA:
+        channel->connected = false;
+        break;
+
+      default:
+        return false;
+    }
+
+    if (!spice_process_ack(channel))
+      return false;
+  }
+
+  // stop watching the socket once it is closed, it will be cleaned up by
+  // spice_process when all the channels have gone away
+  if (!channel->connected)
+    spice_reactor_remove(channel);
+
+  return true;
+}
+
+// ============================================================================
+
+bool spice_process_ack(struct SpiceChannel * channel)
+{
+  if (channel->ackFrequency == 0)
+    return true;
+
+  if (channel->ackCount++ != channel->ackFrequency)
+    return true;
+
+  channel->ackCount = 0;
+
+  char * ack = SPICE_PACKET(SPICE_MSGC_ACK, char, 0);
+  *ack = 0;
+  return SPICE_SEND_PACKET(channel, ack);
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_on_common_read(struct SpiceChannel * channel,
+    SpiceMiniDataHeader * header, const uint8_t ** data)
+{
+  size_t available = channel->rxLen - channel->rxPos;
+
+  // finish discarding a message that was too large to buffer
+  if (channel->discard)
+  {
+    const size_t len = channel->discard > available ? available : channel->discard;
+    channel->discard -= len;
+    channel->rxPos   += len;
+    available        -= len;
+    if (channel->discard)
+      return SPICE_STATUS_INCOMPLETE;
+  }
+
+  if (!channel->hasHeader)
+  {
+    if (available < sizeof(SpiceMiniDataHeader))
+      return spice_reserve_nl(channel, sizeof(SpiceMiniDataHeader)) ==
+        SPICE_STATUS_OK ? SPICE_STATUS_INCOMPLETE : SPICE_STATUS_ERROR;
+
+    memcpy(&channel->header, channel->rxBuffer + channel->rxPos,
+        sizeof(SpiceMiniDataHeader));
+    channel->rxPos   += sizeof(SpiceMiniDataHeader);
+    available        -= sizeof(SpiceMiniDataHeader);
+    channel->hasHeader = true;
+
+    if (channel->header.size > SPICE_RX_MAX_MESSAGE)
+    {
+      channel->hasHeader = false;
+      channel->discard   = channel->header.size;
+      return SPICE_STATUS_HANDLED;
+    }
+  }
+
+  // wait until the entire message is buffered so it can be parsed in place,
+  // the message is consumed here and `data` remains valid until the next read
+  if (available < channel->header.size)
+    return spice_reserve_nl(channel, channel->header.size) ==
+      SPICE_STATUS_OK ? SPICE_STATUS_INCOMPLETE : SPICE_STATUS_ERROR;
+
+  *header            = channel->header;
+  *data              = channel->rxBuffer + channel->rxPos;
+  channel->rxPos    += header->size;
+  channel->hasHeader = false;
+
+  if (!channel->connected)
+    return SPICE_STATUS_HANDLED;
+
+  // a channel reset by a migration keeps answering pings until the init
+  if (!channel->initDone && !channel->migReset)
+    return SPICE_STATUS_OK;
+
+  switch(header->type)
+  {
+    case SPICE_MSG_MIGRATE:
+      return spice_migrate_src(channel, *data, header->size);
+
+    case SPICE_MSG_MIGRATE_DATA:
+      return spice_migrate_data(channel, *data, header->size);
+
+    case SPICE_MSG_SET_ACK:
+    {
+      if (header->size < sizeof(SpiceMsgSetAck))
+        return SPICE_STATUS_ERROR;
+
+      const SpiceMsgSetAck * in = (const SpiceMsgSetAck *)*data;
+      channel->ackFrequency = in->window;
+
+      SpiceMsgcAckSync * out =
+        SPICE_PACKET(SPICE_MSGC_ACK_SYNC, SpiceMsgcAckSync, 0);
+
+      out->generation = in->generation;
+      return SPICE_SEND_PACKET(channel, out) ?
+        SPICE_STATUS_HANDLED : SPICE_STATUS_ERROR;
+    }
+
+    case SPICE_MSG_PING:
+    {
+      if (header->size < sizeof(SpiceMsgPing))
+        return SPICE_STATUS_ERROR;
+
+      const SpiceMsgPing * in = (const SpiceMsgPing *)*data;
+      spice_liveness_ping(channel);
+
+      SpiceMsgcPong * out =
+        SPICE_PACKET(SPICE_MSGC_PONG, SpiceMsgcPong, 0);
+
+      out->id        = in->id;
+      out->timestamp = in->timestamp;
+      return SPICE_SEND_PACKET(channel, out) ?
+        SPICE_STATUS_HANDLED : SPICE_STATUS_ERROR;
+    }
+
+    case SPICE_MSG_WAIT_FOR_CHANNELS:
+      return SPICE_STATUS_HANDLED;
+
+    case SPICE_MSG_DISCONNECTING:
+    {
+      SPICE_LOCK(channel->lock);
+      channel->txClosed = true;
+      shutdown(channel->socket, SHUT_WR);
+      SPICE_UNLOCK(channel->lock);
+      return SPICE_STATUS_HANDLED;
+    }
+
+    case SPICE_MSG_NOTIFY:
+      return SPICE_STATUS_HANDLED;
+  }
+
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_on_main_channel_read()
+{
+  struct SpiceChannel *channel = &spice->scMain;
+
+  SpiceMiniDataHeader header;
+  const uint8_t * data;
+
+  SPICE_STATUS status;
+  if ((status = spice_on_common_read(channel, &header, &data)) != SPICE_STATUS_OK)
+    return status;
+
+  if (!channel->initDone)
+  {
+    /* after a semi-seamless migration the destination may send others, ie
+     * MAIN_MULTI_MEDIA_TIME, ahead of the init. These are of no use until the
+     * session has started over and are dropped */
+    if (channel->migReset && header.type != SPICE_MSG_MAIN_INIT)
+      return SPICE_STATUS_OK;
+
+    if (header.type != SPICE_MSG_MAIN_INIT ||
+        header.size < sizeof(SpiceMsgMainInit))
+    {
+      spice_disconnect_session();
+      return SPICE_STATUS_ERROR;
+    }
+
+    channel->initDone = true;
+    const SpiceMsgMainInit * msg = (const SpiceMsgMainInit *)data;
+
+    // the server didn't resume the session, an early inputs link is for the
+    // old one and has to be redone
+    if (spice->scInputs.socket >= 0 && msg->session_id != spice->sessionID)
+    {
+      spice_input_detach();
+      spice_close_channel(&spice->scInputs);
+    }
+
+    spice->sessionID = msg->session_id;
+
+    spice->serverTokens = msg->agent_tokens;
+    spice->hasAgent     = msg->agent_connected;
+    if (spice->hasAgent && (status = spice_agent_connect()) != SPICE_STATUS_OK)
+    {
+      spice_disconnect_session();
+      return status;
+    }
+
+    if (msg->current_mouse_mode != SPICE_MOUSE_MODE_CLIENT && !spice_mouse_mode(false))
+      return SPICE_STATUS_ERROR;
+
+    void * packet = SPICE_RAW_PACKET(SPICE_MSGC_MAIN_ATTACH_CHANNELS, 0, 0);
+    if (!SPICE_SEND_PACKET(channel, packet))
+    {
+      spice_disconnect_session();
+      return SPICE_STATUS_ERROR;
+    }
+
+    /* every server has an inputs channel, don't wait for the channel list to
+     * say so. Starting the link now that the session ID is known overlaps it
+     * with the attach round trip, on reconnect it may already be underway */
+    if (spice->scInputs.socket < 0 &&
+        (status = spice_connect_channel(&spice->scInputs)) != SPICE_STATUS_OK)
+    {
+      spice_disconnect_session();
+      return status;
+    }
+
+    spice_link_ready();
+
+    return SPICE_STATUS_OK;
+  }
+
+  if (header.type == SPICE_MSG_MAIN_MIGRATE_BEGIN ||
+      header.type == SPICE_MSG_MAIN_MIGRATE_BEGIN_SEAMLESS)
+  {
+    if ((status = spice_migrate_begin(data, header.size,
+        header.type == SPICE_MSG_MAIN_MIGRATE_BEGIN_SEAMLESS)) !=
+        SPICE_STATUS_OK)
+      spice_disconnect_session();
+
+    return status;
+  }
+
+  if (header.type == SPICE_MSG_MAIN_MIGRATE_CANCEL)
+  {
+    spice_migrate_abort();
+    return SPICE_STATUS_OK;
+  }
+
+  if (header.type == SPICE_MSG_MAIN_MIGRATE_END)
+  {
+    // semi-seamless, the source is done and every channel switches at once
+    if (spice->mig.state == SPICE_MIGRATE_CONNECTED)
+    {
+      spice_input_detach();
+      spice->scMain  .migSwitch = true;
+      spice->scInputs.migSwitch = true;
+    }
+    return SPICE_STATUS_OK;
+  }
+
+  if (header.type == SPICE_MSG_MAIN_CHANNELS_LIST)
+  {
+    if (header.size < sizeof(SpiceMainChannelsList))
+    {
+      spice_disconnect_session();
+      return SPICE_STATUS_ERROR;
+    }
+
+    const SpiceMainChannelsList * msg = (const SpiceMainChannelsList *)data;
+    if (header.size < sizeof(*msg) + msg->num_of_channels * sizeof(SpiceChannelID))
+    {
+      spice_disconnect_session();
+      return SPICE_STATUS_ERROR;
+    }
+
+    // documentation doesn't state that the array is null terminated but it seems that it is
+    const SpiceChannelID * channels = (const SpiceChannelID *)(msg + 1);
+    for(int i = 0; i < msg->num_of_channels; ++i)
+    {
+      // the inputs link is normally already underway, or may even have come
+      // and gone if we are disconnecting, the socket is only closed once the
+      // whole session has shut down
+      if (channels[i].type == SPICE_CHANNEL_INPUTS && spice->scInputs.socket < 0)
+      {
+        if ((status = spice_connect_channel(&spice->scInputs)) != SPICE_STATUS_OK)
+        {
+          spice_disconnect_session();
+          return status;
+        }
+      }
+    }
+
+    return SPICE_STATUS_OK;
+  }
+
+  if (header.type == SPICE_MSG_MAIN_AGENT_CONNECTED)
+  {
+    spice->hasAgent = true;
+    if ((status = spice_agent_connect()) != SPICE_STATUS_OK)
+    {
+      spice_disconnect_session();
+      return status;
+    }
+    return SPICE_STATUS_OK;
+  }
+
+  if (header.type == SPICE_MSG_MAIN_AGENT_CONNECTED_TOKENS)
+  {
+    if (header.size < sizeof(uint32_t))
+    {
+      spice_disconnect_session();
+      return SPICE_STATUS_ERROR;
+    }
+
+    spice->hasAgent     = true;
+    spice->serverTokens = *(const uint32_t *)data;
+    if ((status = spice_agent_connect()) != SPICE_STATUS_OK)
+    {
+      spice_disconnect_session();
+      return status;
+    }
+    return SPICE_STATUS_OK;
+  }
+
+  if (header.type == SPICE_MSG_MAIN_AGENT_DISCONNECTED)
+  {
+    spice->hasAgent  = false;
+    spice->agentSkip = 0;
+
+    if (spice->cbBuffer)
+    {
+      free(spice->cbBuffer);
+      spice->cbBuffer = NULL;
+      spice->cbSize   = 0;
+      spice->cbRemain = 0;
+    }
+
+    return SPICE_STATUS_OK;
+  }
+
+  if (header.type == SPICE_MSG_MAIN_AGENT_DATA)
+  {
+    if (!spice->hasAgent)
+      return SPICE_STATUS_OK;
+
+    if ((status = spice_agent_process(data, header.size)) != SPICE_STATUS_OK)
+      spice_disconnect_session();
+
+    return status;
+  }
+
+  if (header.type == SPICE_MSG_MAIN_AGENT_TOKEN)
+  {
+    if (header.size < sizeof(uint32_t))
+    {
+      spice_disconnect_session();
+      return SPICE_STATUS_ERROR;
+    }
+
+    spice->serverTokens = *(const uint32_t *)data;
+    return SPICE_STATUS_OK;
+  }
+
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_on_inputs_channel_read()
+{
+  struct SpiceChannel *channel = &spice->scInputs;
+
+  SpiceMiniDataHeader header;
+  const uint8_t * data;
+
+  SPICE_STATUS status;
+  if ((status = spice_on_common_read(channel, &header, &data)) != SPICE_STATUS_OK)
+    return status;
+
+  switch(header.type)
+  {
+    case SPICE_MSG_INPUTS_INIT:
+    {
+      if (channel->initDone || header.size < sizeof(SpiceMsgInputsInit))
+        return SPICE_STATUS_ERROR;
+
+      channel->initDone = true;
+      return SPICE_STATUS_OK;
+    }
+
+    case SPICE_MSG_INPUTS_KEY_MODIFIERS:
+    {
+      if (header.size < sizeof(SpiceMsgInputsKeyModifiers))
+        return SPICE_STATUS_ERROR;
+
+      const SpiceMsgInputsKeyModifiers * in =
+        (const SpiceMsgInputsKeyModifiers *)data;
+
+      spice->kb.modifiers = in->modifiers;
+      return SPICE_STATUS_OK;
+    }
+
+    case SPICE_MSG_INPUTS_MOUSE_MOTION_ACK:
+    {
+      // the count was reset when input was detached for a migration
+      if (!spice->inputLinked)
+        return SPICE_STATUS_OK;
+
+      const int count = atomic_fetch_sub(&spice->mouse.sentCount,
+          SPICE_INPUT_MOTION_ACK_BUNCH);
+      if (count < SPICE_INPUT_MOTION_ACK_BUNCH)
+        return SPICE_STATUS_ERROR;
+
+      // the window has opened up, send anything held back while it was full
+      if (atomic_load(&spice->mouse.window) ||
+          atomic_load(&spice->mouse.positionHeld))
+        spice_input_kick();
+
+      return SPICE_STATUS_OK;
+    }
+  }
+
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_connect_channel(struct SpiceChannel * channel)
+{
+  return spice_connect_channel_to(channel, spice->family, &spice->addr);
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_connect_channel_to(struct SpiceChannel * channel,
+    short family, const union SpiceAddr * addr)
+{
+  return spice_connect_channel_fd(channel, family, addr, -1);
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_connect_channel_fd(struct SpiceChannel * channel,
+    short family, const union SpiceAddr * addr, int fd)
+{
+  channel->initDone     = false;
+  channel->migReset     = false;
+  channel->ready        = false;
+  channel->ackFrequency = 0;
+  channel->ackCount     = 0;
+  channel->rxPos        = 0;
+  channel->rxLen        = 0;
+  channel->rxPartial    = false;
+  channel->hasHeader    = false;
+  channel->discard      = 0;
+  channel->txPos        = 0;
+  channel->txLen        = 0;
+  channel->txWatch      = false;
+  channel->txShutdown   = false;
+  channel->txClosed     = false;
+  channel->txCork       = false;
+  channel->rxReady      = false;
+  channel->txReady      = false;
+  channel->link         = SPICE_LINK_CONNECTING;
+  channel->authSpice    = spice;
+  channel->authRunning  = false;
+  channel->authOk       = false;
+  channel->migData      = false;
+  channel->migSwitch    = false;
+  channel->rxLast       = get_timestamp();
+  channel->pingLast     = 0;
+  channel->pingInterval = 0;
+#if defined(USE_TLS)
+  channel->ktlsTx       = false;
+#endif
+  atomic_store(&channel->authDone, false);
+
+  if (!channel->rxBuffer)
+  {
+    channel->rxBuffer = malloc(SPICE_RX_BUFFER_SIZE);
+    if (!channel->rxBuffer)
+    {
+      if (fd >= 0)
+        close(fd);
+      return SPICE_STATUS_ERROR;
+    }
+    channel->rxSize = SPICE_RX_BUFFER_SIZE;
+  }
+
+  // a socket the resolver has already connected goes straight to the link,
+  // it is still reported writable so the link message is sent as usual
+  if (fd >= 0)
+  {
+    channel->socket = fd;
+    goto connected;
+  }
+
+  size_t addrSize;
+  switch(family)
+  {
+    case AF_UNIX:
+      addrSize = sizeof(addr->un);
+      break;
+
+    case AF_INET:
+      addrSize = sizeof(addr->in);
+      break;
+
+    case AF_INET6:
+      addrSize = sizeof(addr->in6);
+      break;
+
+    default:
+      return SPICE_STATUS_ERROR;
+  }
+
+  // the socket is non-blocking from the start, the connect and the link
+  // handshake are driven by spice_process like everything else
+  channel->socket = socket(family,
+      SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (channel->socket == -1)
+    return SPICE_STATUS_ERROR;
+
+  if (connect(channel->socket, &addr->addr, addrSize) == -1 &&
+      errno != EINPROGRESS)
+  {
+    close(channel->socket);
+    channel->socket = -1;
+    return SPICE_STATUS_ERROR;
+  }
+
+connected:
+  if (family != AF_UNIX)
+  {
+    const int flag = 1;
+    setsockopt(channel->socket, IPPROTO_TCP, TCP_NODELAY , &flag, sizeof(int));
+    setsockopt(channel->socket, IPPROTO_TCP, TCP_QUICKACK, &flag, sizeof(int));
+  }
+
+  if (spice->lvDeadline)
+    spice_liveness_sockopt(channel, family);
+
+  if (!spice_reactor_add(channel))
+  {
+    close(channel->socket);
+    channel->socket = -1;
+    return SPICE_STATUS_ERROR;
+  }
+
+  channel->connected = true;
+
+  // the link message is sent once the socket reports writable
+  SPICE_LOCK(channel->lock);
+  const bool watch = spice_watch_nl(channel, true);
+  SPICE_UNLOCK(channel->lock);
+
+  return watch ? SPICE_STATUS_OK : SPICE_STATUS_ERROR;
+}
+
+// ============================================================================
+
+static void spice_auth_encrypt(struct SpiceChannel * channel)
+{
+  // the channels share the session's parsed copy of the server key
+  struct Spice * session = channel->authSpice;
+  SPICE_LOCK(session->rsaLock);
+  channel->authOk = spice_rsa_encrypt_password(&session->rsaKey,
+      channel->authKey, session->password, &channel->authPass);
+  SPICE_UNLOCK(session->rsaLock);
+
+  atomic_store(&channel->authDone, true);
+}
+
+// ============================================================================
+
+static void * spice_auth_thread(void * opaque)
+{
+  struct SpiceChannel * channel = opaque;
+  spice_auth_encrypt(channel);
+
+  // wake the reactor of the session the channel belongs to
+  spice = channel->authSpice;
+  spice_wakeup();
+  return NULL;
+}
+
+// ============================================================================
+
+#if defined(USE_TLS)
+void spice_tls_reset()
+{
+  if (spice->tlsSession)
+  {
+    SSL_SESSION_free(spice->tlsSession);
+    spice->tlsSession = NULL;
+  }
+
+  if (spice->tlsCtx)
+  {
+    SSL_CTX_free(spice->tlsCtx);
+    spice->tlsCtx = NULL;
+  }
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_tls_begin(struct SpiceChannel * channel)
+{
+  channel->ssl = SSL_new(spice->tlsCtx);
+  if (!channel->ssl)
+    return SPICE_STATUS_ERROR;
+
+  if (!SSL_set_fd(channel->ssl, channel->socket))
+  {
+    SSL_free(channel->ssl);
+    channel->ssl = NULL;
+    return SPICE_STATUS_ERROR;
+  }
+
+  SSL_set_connect_state(channel->ssl);
+
+  // a migration destination is checked against the name the source gave
+  const char * host = SPICE_MIGRATE_CHANNEL(channel) ?
+    spice->mig.host : spice->tlsHost;
+
+  if (*host)
+  {
+    struct in6_addr numeric;
+    if (inet_pton(AF_INET , host, &numeric) == 1 ||
+        inet_pton(AF_INET6, host, &numeric) == 1)
+      X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(channel->ssl), host);
+    else
+    {
+      SSL_set_tlsext_host_name(channel->ssl, host);
+      SSL_set1_host(channel->ssl, host);
+    }
+  }
+
+  /* the server issues a session on the main channel's handshake, the others
+   * resume it. The destination of a migration is another server */
+  if (spice->tlsSession && !SPICE_MIGRATE_CHANNEL(channel))
+    SSL_set_session(channel->ssl, spice->tlsSession);
+
+  channel->link = SPICE_LINK_TLS;
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_tls_handshake(struct SpiceChannel * channel)
+{
+  const int rc = SPICE_TLS_NOSIGPIPE(SSL_do_handshake(channel->ssl));
+  if (rc == 1)
+  {
+#if defined(SSL_OP_ENABLE_KTLS)
+    channel->ktlsTx = BIO_get_ktls_send(SSL_get_wbio(channel->ssl));
+#endif
+    return SPICE_STATUS_OK;
+  }
+
+  switch(SSL_get_error(channel->ssl, rc))
+  {
+    case SSL_ERROR_WANT_READ:
+      return SPICE_STATUS_INCOMPLETE;
+
+    case SSL_ERROR_WANT_WRITE:
+    {
+      SPICE_LOCK(channel->lock);
+      const bool watch = spice_watch_nl(channel, true);
+      SPICE_UNLOCK(channel->lock);
+      return watch ? SPICE_STATUS_INCOMPLETE : SPICE_STATUS_ERROR;
+    }
+
+    default:
+      return SPICE_STATUS_ERROR;
+  }
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_tls_recv_nl(struct SpiceChannel * channel)
+{
+  // the handshake reads from the socket itself, see spice_tls_handshake
+  if (!SSL_is_init_finished(channel->ssl))
+    return SPICE_STATUS_INCOMPLETE;
+
+  // take every record that is available, they arrive up to 16KB at a time
+  bool got = false;
+  while(channel->rxLen < channel->rxSize)
+  {
+    size_t len;
+    const int rc = SPICE_TLS_NOSIGPIPE(SSL_read_ex(channel->ssl,
+        channel->rxBuffer + channel->rxLen,
+        channel->rxSize   - channel->rxLen, &len));
+
+    if (rc == 1)
+    {
+      channel->rxLen += len;
+      got = true;
+      continue;
+    }
+
+    switch(SSL_get_error(channel->ssl, rc))
+    {
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+        break;
+
+      case SSL_ERROR_ZERO_RETURN:
+        if (!got)
+          return SPICE_STATUS_NODATA;
+        break;
+
+      default:
+        channel->connected = false;
+        return SPICE_STATUS_ERROR;
+    }
+
+    break;
+  }
+
+  if (!got)
+    return SPICE_STATUS_INCOMPLETE;
+
+  channel->rxPartial = false;
+  channel->rxLast    = get_timestamp();
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+ssize_t spice_tls_writev_nl(struct SpiceChannel * channel,
+    const struct iovec * iov, int iovcnt)
+{
+  // each buffer is encrypted into its own records, there is no writev
+  ssize_t total = 0;
+  for(int i = 0; i < iovcnt; ++i)
+  {
+    if (iov[i].iov_len == 0)
+      continue;
+
+    size_t wrote;
+    const int rc = SPICE_TLS_NOSIGPIPE(SSL_write_ex(channel->ssl,
+        iov[i].iov_base, iov[i].iov_len, &wrote));
+
+    if (rc == 1)
+    {
+      total += wrote;
+      if (wrote < iov[i].iov_len)
+        break;
+      continue;
+    }
+
+    if (total > 0)
+      break;
+
+    switch(SSL_get_error(channel->ssl, rc))
+    {
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+
+      default:
+        errno = EIO;
+        return -1;
+    }
+  }
+
+  return total;
+}
+#endif
+
+// ============================================================================
+
+SPICE_STATUS spice_link_send(struct SpiceChannel * channel)
+{
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(channel->socket, SOL_SOCKET, SO_ERROR, &error, &len) != 0 ||
+      error != 0)
+    return SPICE_STATUS_ERROR;
+
+#if defined(USE_TLS)
+  // the link happens inside TLS, this is called again once it is up
+  if (spice->tlsCtx && !channel->ssl)
+    return spice_tls_begin(channel);
+#endif
+
+  typedef struct
+  {
+    SpiceLinkHeader header;
+    SpiceLinkMess   message;
+    uint32_t        supportCaps[COMMON_CAPS_BYTES / sizeof(uint32_t)];
+    uint32_t        channelCaps[MAIN_CAPS_BYTES   / sizeof(uint32_t)];
+  }
+  __attribute__((packed)) ConnectPacket;
+
+  ConnectPacket p =
+  {
+    .header = {
+      .magic         = SPICE_MAGIC        ,
+      .major_version = SPICE_VERSION_MAJOR,
+      .minor_version = SPICE_VERSION_MINOR,
+      .size          = sizeof(ConnectPacket) - sizeof(SpiceLinkHeader)
+    },
+    .message = {
+      .connection_id    = spice->sessionID,
+      .channel_type     = channel->channelType,
+      .channel_id       = spice->channelID,
+      .num_common_caps  = COMMON_CAPS_BYTES / sizeof(uint32_t),
+      .num_channel_caps = MAIN_CAPS_BYTES   / sizeof(uint32_t),
+      .caps_offset      = sizeof(SpiceLinkMess)
+    }
+  };
+
+  COMMON_SET_CAPABILITY(p.supportCaps, SPICE_COMMON_CAP_PROTOCOL_AUTH_SELECTION);
+  COMMON_SET_CAPABILITY(p.supportCaps, SPICE_COMMON_CAP_AUTH_SPICE             );
+  COMMON_SET_CAPABILITY(p.supportCaps, SPICE_COMMON_CAP_MINI_HEADER            );
+
+  if (channel->channelType == SPICE_CHANNEL_MAIN)
+  {
+    MAIN_SET_CAPABILITY(p.channelCaps, SPICE_MAIN_CAP_AGENT_CONNECTED_TOKENS);
+    MAIN_SET_CAPABILITY(p.channelCaps, SPICE_MAIN_CAP_SEMI_SEAMLESS_MIGRATE );
+    MAIN_SET_CAPABILITY(p.channelCaps, SPICE_MAIN_CAP_SEAMLESS_MIGRATE      );
+  }
+
+  if (channel->channelType == SPICE_CHANNEL_INPUTS)
+    INPUTS_SET_CAPABILITY(p.channelCaps, SPICE_INPUTS_CAP_KEY_SCANCODE);
+
+  SPICE_LOCK(channel->lock);
+  const bool sent = spice_write_nl(channel, &p, sizeof(p)) == sizeof(p) &&
+    (channel->txLen > channel->txPos || spice_watch_nl(channel, false));
+  SPICE_UNLOCK(channel->lock);
+
+  if (!sent)
+    return SPICE_STATUS_ERROR;
+
+  channel->link = SPICE_LINK_REPLY;
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_link_reply(struct SpiceChannel * channel)
+{
+  const size_t available = channel->rxLen - channel->rxPos;
+  if (available < sizeof(SpiceLinkHeader))
+    return spice_reserve_nl(channel, sizeof(SpiceLinkHeader)) ==
+      SPICE_STATUS_OK ? SPICE_STATUS_INCOMPLETE : SPICE_STATUS_ERROR;
+
+  SpiceLinkHeader header;
+  memcpy(&header, channel->rxBuffer + channel->rxPos, sizeof(header));
+
+  if (header.magic         != SPICE_MAGIC         ||
+      header.major_version != SPICE_VERSION_MAJOR ||
+      header.size < sizeof(SpiceLinkReply)        ||
+      header.size > SPICE_RX_MAX_MESSAGE)
+    return SPICE_STATUS_ERROR;
+
+  if (available < sizeof(header) + header.size)
+    return spice_reserve_nl(channel, sizeof(header) + header.size) ==
+      SPICE_STATUS_OK ? SPICE_STATUS_INCOMPLETE : SPICE_STATUS_ERROR;
+
+  const uint8_t * data = channel->rxBuffer + channel->rxPos + sizeof(header);
+  channel->rxPos += sizeof(header) + header.size;
+
+  SpiceLinkReply reply;
+  memcpy(&reply, data, sizeof(reply));
+  if (reply.error != SPICE_LINK_ERR_OK)
+    return SPICE_STATUS_ERROR;
+
+  // the channel capabilities follow the common ones
+  if ((uint64_t)reply.caps_offset + ((uint64_t)reply.num_common_caps +
+        reply.num_channel_caps) * sizeof(uint32_t) > header.size)
+    return SPICE_STATUS_ERROR;
+
+  channel->numCaps = reply.num_channel_caps < SPICE_CHANNEL_CAPS ?
+    reply.num_channel_caps : SPICE_CHANNEL_CAPS;
+  memset(channel->caps, 0, sizeof(channel->caps));
+  memcpy(channel->caps, data + reply.caps_offset +
+      reply.num_common_caps * sizeof(uint32_t),
+      channel->numCaps * sizeof(uint32_t));
+
+  if (channel == &spice->scInputs)
+    atomic_store(&spice->kb.scancode, HAS_CAPABILITY(channel->caps,
+          channel->numCaps, SPICE_INPUTS_CAP_KEY_SCANCODE));
+
+  SpiceLinkAuthMechanism auth;
+  auth.auth_mechanism = SPICE_COMMON_CAP_AUTH_SPICE;
+
+  SPICE_LOCK(channel->lock);
+  const bool sent = spice_write_nl(channel, &auth, sizeof(auth)) == sizeof(auth);
+  SPICE_UNLOCK(channel->lock);
+
+  if (!sent)
+    return SPICE_STATUS_ERROR;
+
+  memcpy(channel->authKey, reply.pub_key, sizeof(channel->authKey));
+  channel->link = SPICE_LINK_AUTH;
+
+  if (pthread_create(&channel->authThread, NULL, spice_auth_thread, channel) == 0)
+    channel->authRunning = true;
+  else
+  {
+    // no thread to spare, do it here instead
+    spice_auth_encrypt(channel);
+  }
+
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_link_auth(struct SpiceChannel * channel)
+{
+  if (!atomic_load(&channel->authDone))
+    return SPICE_STATUS_INCOMPLETE;
+
+  if (channel->authRunning)
+  {
+    pthread_join(channel->authThread, NULL);
+    channel->authRunning = false;
+  }
+
+  if (!channel->authOk)
+    return SPICE_STATUS_ERROR;
+
+  SPICE_LOCK(channel->lock);
+  const bool sent = spice_write_nl(channel, channel->authPass.data,
+      channel->authPass.size) == channel->authPass.size;
+  SPICE_UNLOCK(channel->lock);
+
+  spice_rsa_free_password(&channel->authPass);
+  channel->authOk = false;
+
+  if (!sent)
+    return SPICE_STATUS_ERROR;
+
+  channel->link = SPICE_LINK_RESULT;
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_link_result(struct SpiceChannel * channel)
+{
+  // this is small enough that spice_rx_room_nl always leaves space for it
+  uint32_t linkResult;
+  if (channel->rxLen - channel->rxPos < sizeof(linkResult))
+    return SPICE_STATUS_INCOMPLETE;
+
+  memcpy(&linkResult, channel->rxBuffer + channel->rxPos, sizeof(linkResult));
+  channel->rxPos += sizeof(linkResult);
+
+  if (linkResult != SPICE_LINK_ERR_OK)
+    return SPICE_STATUS_ERROR;
+
+  channel->link = SPICE_LINK_DONE;
+
+  if (SPICE_MIGRATE_CHANNEL(channel))
+    return spice_migrate_linked(channel);
+
+  // anything held while the channel was down goes out before new input
+  if (channel == &spice->scInputs && !spice_input_attach())
+    return SPICE_STATUS_ERROR;
+
+  /* when reconnecting the server already knows the session so the inputs
+   * channel can be linked now rather than after the MAIN_INIT round trip */
+  if (channel == &spice->scMain && spice->sessionID &&
+      spice->scInputs.socket < 0 &&
+      spice_connect_channel(&spice->scInputs) != SPICE_STATUS_OK)
+    return SPICE_STATUS_ERROR;
+
+  channel->ready = true;
+  spice_link_ready();
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+void spice_link_ready()
+{
+  if (!spice_ready())
+    return;
+
+  spice->rcAttempt  = 0;
+  spice->rcDeadline = 0;
+  spice_event(SPICE_EVENT_READY, SPICE_DATA_NONE, NULL, 0);
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_link_process(struct SpiceChannel * channel)
+{
+  SPICE_STATUS status = SPICE_STATUS_OK;
+  while(status == SPICE_STATUS_OK && channel->link != SPICE_LINK_DONE)
+    switch(channel->link)
+    {
+      case SPICE_LINK_CONNECTING:
+        return SPICE_STATUS_INCOMPLETE;
+
+      case SPICE_LINK_TLS:
+#if defined(USE_TLS)
+        if ((status = spice_tls_handshake(channel)) == SPICE_STATUS_OK)
+          status = spice_link_send(channel);
+#endif
+        break;
+
+      case SPICE_LINK_REPLY:
+        if ((status = spice_link_reply(channel)) == SPICE_STATUS_INCOMPLETE)
+          channel->rxPartial = true;
+        break;
+
+      case SPICE_LINK_AUTH:
+        status = spice_link_auth(channel);
+        break;
+
+      case SPICE_LINK_RESULT:
+        if ((status = spice_link_result(channel)) == SPICE_STATUS_INCOMPLETE)
+          channel->rxPartial = true;
+        break;
+
+      case SPICE_LINK_DONE:
+        break;
+    }
+
+  return status;
+}
+
+// ============================================================================
+
+bool spice_link_failed(struct SpiceChannel * channel)
+{
+  // the destination of a migration can't be reached, carry on as we are
+  if (SPICE_MIGRATE_CHANNEL(channel))
+  {
+    spice_migrate_failed();
+    return true;
+  }
+
+  /* an inputs link started early on reconnect is refused if the server has
+   * started a new session, MAIN_INIT will link it again with the new ID */
+  if (channel == &spice->scInputs && !spice->scMain.initDone)
+  {
+    spice_close_channel(channel);
+    return true;
+  }
+
+  // the session is of no use without every channel, shut it all down and let
+  // spice_process clean up once everything has closed
+  channel->connected = false;
+  spice_disconnect_session();
+  return true;
+}
+
+// ============================================================================
+
+void spice_disconnect_channel(struct SpiceChannel * channel)
+{
+  if (!channel->connected)
+    return;
+
+  // there is nothing to shut down cleanly until the link is complete, just
+  // abandon it and let spice_process close the socket
+  if (channel->link != SPICE_LINK_DONE)
+  {
+    channel->connected = false;
+    spice_wakeup();
+    return;
+  }
+
+  if (channel->ready)
+  {
+    /* disable nodelay so we can trigger a flush after this message */
+    int flag;
+    if (spice->family != AF_UNIX)
+    {
+      flag = 0;
+      setsockopt(channel->socket, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+    }
+
+    SpiceMsgcDisconnecting * packet = SPICE_PACKET(SPICE_MSGC_DISCONNECTING,
+        SpiceMsgcDisconnecting, 0);
+    packet->time_stamp = get_timestamp();
+    packet->reason     = SPICE_LINK_ERR_OK;
+
+    SPICE_LOCK(channel->lock);
+
+    // a batch still being built ends with the session, send what it has so
+    // that the disconnect is not held behind the cork
+    channel->txCork = false;
+    SPICE_SEND_PACKET_NL(channel, packet);
+
+    // nothing may follow DISCONNECTING, late replies (ie, pongs) are dropped
+    // rather than failing on the half closed socket
+    channel->txClosed = true;
+
+    /* re-enable nodelay as this triggers a flush according to the man page */
+    if (spice->family != AF_UNIX)
+    {
+      flag = 1;
+      setsockopt(channel->socket, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+    }
+
+    // don't cut off anything still queued, spice_flush_nl will shutdown the
+    // socket once it has been sent
+    if (channel->txLen > channel->txPos)
+    {
+      channel->txShutdown = true;
+      SPICE_UNLOCK(channel->lock);
+      return;
+    }
+
+    SPICE_UNLOCK(channel->lock);
+  }
+
+  shutdown(channel->socket, SHUT_WR);
+}
+
+// ============================================================================
+
+void spice_close_channel(struct SpiceChannel * channel)
+{
+  /* other threads queue to the channel under its lock, once it is marked as
+   * disconnected they leave it alone and it can be torn down */
+  SPICE_LOCK(channel->lock);
+  channel->connected = false;
+  SPICE_UNLOCK(channel->lock);
+
+  // the worker only touches the channel's auth fields
+  if (channel->authRunning)
+  {
+    pthread_join(channel->authThread, NULL);
+    channel->authRunning = false;
+  }
+
+  if (channel->authOk)
+  {
+    spice_rsa_free_password(&channel->authPass);
+    channel->authOk = false;
+  }
+
+  // the buffers outlive a socket that failed to connect and are still freed
+  if (channel->socket >= 0)
+    spice_reactor_remove(channel);
+
+  SPICE_LOCK(channel->lock);
+  if (channel->socket >= 0)
+  {
+#if defined(USE_TLS)
+    if (channel->ssl)
+    {
+      /* a lost connection would otherwise make OpenSSL drop the session, it
+       * is still good for the reconnect to resume */
+      SSL_set_shutdown(channel->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+      SSL_free(channel->ssl);
+      channel->ssl = NULL;
+    }
+#endif
+    close(channel->socket);
+    channel->socket = -1;
+  }
+
+  free(channel->rxBuffer);
+  channel->rxBuffer = NULL;
+  channel->rxSize   = 0;
+  channel->rxPos    = 0;
+  channel->rxLen    = 0;
+
+  free(channel->txBuffer);
+  channel->txBuffer = NULL;
+  channel->txSize   = 0;
+  channel->txPos    = 0;
+  channel->txLen    = 0;
+  SPICE_UNLOCK(channel->lock);
+}
+
+// ============================================================================
+
+static bool spice_migrate_addr(const char * host, uint16_t port)
+{
+  struct SpiceMigrate * mig = &spice->mig;
+  memset(&mig->addr, 0, sizeof(mig->addr));
+
+  if (inet_pton(AF_INET, host, &mig->addr.in.sin_addr) == 1)
+  {
+    mig->family              = AF_INET;
+    mig->addr.in.sin_family  = AF_INET;
+    mig->addr.in.sin_port    = htons(port);
+    return true;
+  }
+
+  if (inet_pton(AF_INET6, host, &mig->addr.in6.sin6_addr) == 1)
+  {
+    mig->family               = AF_INET6;
+    mig->addr.in6.sin6_family = AF_INET6;
+    mig->addr.in6.sin6_port   = htons(port);
+    return true;
+  }
+
+  return false;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_migrate_begin(const uint8_t * data, uint32_t size,
+    bool seamless)
+{
+  if (size < (seamless ?
+        sizeof(SpiceMsgMainMigrateBeginSeamless) :
+        sizeof(SpiceMsgMainMigrationBegin)))
+    return SPICE_STATUS_ERROR;
+
+  // a new destination replaces one we may still be linking to
+  spice_migrate_abort();
+
+  const SpiceMigrationDstInfo * info = (const SpiceMigrationDstInfo *)data;
+  struct SpiceMigrate * mig = &spice->mig;
+  mig->state      = SPICE_MIGRATE_LINKING;
+  mig->seamless   = seamless;
+  mig->srcVersion = seamless ?
+    ((const SpiceMsgMainMigrateBeginSeamless *)data)->src_mig_version : 0;
+
+  // the destination's TLS port is used if the session is over TLS
+  uint16_t port = info->port;
+#if defined(USE_TLS)
+  if (spice->tlsCtx)
+    port = info->sport;
+#endif
+
+  // the host is a string stored after the fixed part of the message
+  char * host = mig->host;
+  bool ok = port != 0 && info->host_size > 0 &&
+    (uint64_t)info->host_offset + info->host_size <= size;
+
+  if (ok)
+  {
+    const size_t len = strnlen((const char *)data + info->host_offset,
+        info->host_size);
+    if ((ok = len < sizeof(mig->host)))
+    {
+      memcpy(host, data + info->host_offset, len);
+      host[len] = '\0';
+    }
+  }
+
+  /* the destination channels link with the current session ID so the
+   * destination can tie them to the session being migrated, inputs follows
+   * once main is up */
+  if (!ok || !spice_migrate_addr(host, port) ||
+      spice_connect_channel_to(&mig->scMain, mig->family, &mig->addr) !=
+        SPICE_STATUS_OK)
+    spice_migrate_failed();
+
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+static SPICE_STATUS spice_migrate_link_inputs()
+{
+  struct SpiceMigrate * mig = &spice->mig;
+  return spice_connect_channel_to(&mig->scInputs, mig->family, &mig->addr);
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_migrate_linked(struct SpiceChannel * channel)
+{
+  // the destination carries on the session, there is no init to wait for
+  channel->ready    = true;
+  channel->initDone = true;
+
+  if (channel == &spice->mig.scMain)
+  {
+    if (!spice->mig.seamless)
+      return spice_migrate_link_inputs();
+
+    // ask the destination if it can take over the session state
+    SpiceMsgcMainMigrateDstDoSeamless * msg = SPICE_PACKET(
+        SPICE_MSGC_MAIN_MIGRATE_DST_DO_SEAMLESS,
+        SpiceMsgcMainMigrateDstDoSeamless, 0);
+    msg->src_version = spice->mig.srcVersion;
+    return SPICE_SEND_PACKET(channel, msg) ?
+      SPICE_STATUS_OK : SPICE_STATUS_ERROR;
+  }
+
+  // every channel is linked, the source can go ahead
+  spice->mig.state = SPICE_MIGRATE_CONNECTED;
+  void * packet = SPICE_RAW_PACKET(spice->mig.seamless ?
+      SPICE_MSGC_MAIN_MIGRATE_CONNECTED_SEAMLESS :
+      SPICE_MSGC_MAIN_MIGRATE_CONNECTED, 0, 0);
+
+  return SPICE_SEND_PACKET(&spice->scMain, packet) ?
+    SPICE_STATUS_OK : SPICE_STATUS_ERROR;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_on_migrate_read(struct SpiceChannel * channel)
+{
+  SpiceMiniDataHeader header;
+  const uint8_t * data;
+
+  SPICE_STATUS status;
+  if ((status = spice_on_common_read(channel, &header, &data)) != SPICE_STATUS_OK)
+    return status;
+
+  // nothing else is expected from the destination until it takes over
+  if (channel != &spice->mig.scMain)
+    return SPICE_STATUS_OK;
+
+  switch(header.type)
+  {
+    case SPICE_MSG_MAIN_MIGRATE_DST_SEAMLESS_ACK:
+      return spice_migrate_link_inputs();
+
+    case SPICE_MSG_MAIN_MIGRATE_DST_SEAMLESS_NACK:
+      // fall back to semi-seamless, the channels are reset after the switch
+      spice->mig.seamless = false;
+      return spice_migrate_link_inputs();
+  }
+
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_migrate_src(struct SpiceChannel * channel,
+    const uint8_t * data, uint32_t size)
+{
+  if (SPICE_MIGRATE_CHANNEL(channel) ||
+      spice->mig.state != SPICE_MIGRATE_CONNECTED)
+    return SPICE_STATUS_HANDLED;
+
+  if (size < sizeof(SpiceMsgMigrate))
+    return SPICE_STATUS_ERROR;
+
+  const SpiceMsgMigrate * msg = (const SpiceMsgMigrate *)data;
+
+  // hold input until the destination takes over
+  if (channel == &spice->scInputs)
+    spice_input_detach();
+
+  if (msg->flags & SPICE_MIGRATE_NEED_FLUSH)
+  {
+    void * packet = SPICE_RAW_PACKET(SPICE_MSGC_MIGRATE_FLUSH_MARK, 0, 0);
+    if (!SPICE_SEND_PACKET(channel, packet))
+      return SPICE_STATUS_ERROR;
+  }
+
+  if (msg->flags & SPICE_MIGRATE_NEED_DATA_TRANSFER)
+    channel->migData = true;
+  else
+    channel->migSwitch = true;
+
+  return SPICE_STATUS_HANDLED;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_migrate_data(struct SpiceChannel * channel,
+    const uint8_t * data, uint32_t size)
+{
+  if (!channel->migData)
+    return SPICE_STATUS_HANDLED;
+
+  struct SpiceChannel * twin = channel == &spice->scMain ?
+    &spice->mig.scMain : &spice->mig.scInputs;
+
+  // the source's state is passed on to the destination untouched
+  SpiceMiniDataHeader header =
+  {
+    .type = SPICE_MSGC_MIGRATE_DATA,
+    .size = size
+  };
+
+  const struct iovec iov[2] =
+  {
+    { .iov_base = &header       , .iov_len = sizeof(header) },
+    { .iov_base = (void *)data  , .iov_len = size           }
+  };
+
+  SPICE_LOCK(twin->lock);
+  const bool sent = spice_writev_nl(twin, iov, 2) ==
+    (ssize_t)(sizeof(header) + size);
+  SPICE_UNLOCK(twin->lock);
+
+  if (!sent)
+  {
+    spice_migrate_failed();
+    return SPICE_STATUS_HANDLED;
+  }
+
+  channel->migData   = false;
+  channel->migSwitch = true;
+  return SPICE_STATUS_HANDLED;
+}
+
+// ============================================================================
+
+void spice_migrate_process()
+{
+  struct SpiceMigrate * mig = &spice->mig;
+  if (mig->state == SPICE_MIGRATE_NONE)
+    return;
+
+  struct SpiceChannel * twins[] = { &mig->scInputs, &mig->scMain };
+  for(int i = 0; i < 2; ++i)
+  {
+    struct SpiceChannel * twin = twins[i];
+    if (twin->connected && SPICE_CHANNEL_PENDING(twin) &&
+        !spice_process_channel(twin))
+      twin->connected = false;
+
+    // the destination went away before taking over
+    if (twin->socket >= 0 && !twin->connected)
+    {
+      spice_migrate_failed();
+      return;
+    }
+  }
+
+  if (spice->scInputs.migSwitch)
+    spice_migrate_switch(&spice->scInputs, &mig->scInputs);
+
+  if (spice->scMain.migSwitch)
+    spice_migrate_switch(&spice->scMain, &mig->scMain);
+
+  if (mig->state != SPICE_MIGRATE_CONNECTED ||
+      mig->scMain.socket >= 0 || mig->scInputs.socket >= 0)
+    return;
+
+  // every channel has switched over, reconnects now go to the new host
+  spice->family = mig->family;
+  memcpy(&spice->addr, &mig->addr, sizeof(spice->addr));
+  mig->state = SPICE_MIGRATE_NONE;
+
+  void * packet = SPICE_RAW_PACKET(SPICE_MSGC_MAIN_MIGRATE_END, 0, 0);
+  SPICE_SEND_PACKET(&spice->scMain, packet);
+}
+
+// ============================================================================
+
+void spice_migrate_switch(struct SpiceChannel * channel,
+    struct SpiceChannel * twin)
+{
+  /* the twin takes the channel's place so that nothing else has to know
+   * about the migration, other threads may be waiting on the lock to send */
+  SPICE_LOCK(channel->lock);
+  spice_reactor_remove(channel);
+#if defined(USE_TLS)
+  if (channel->ssl)
+    SSL_free(channel->ssl);
+#endif
+  close(channel->socket);
+  free(channel->rxBuffer);
+  free(channel->txBuffer);
+
+  spice_reactor_remove(twin);
+
+  /* everything but the lock is taken from the twin, the lock is held here
+   * and may have waiters so it must never be written */
+  const size_t lockStart = offsetof(struct SpiceChannel, lock);
+  const size_t lockEnd   = lockStart + sizeof(channel->lock);
+  memcpy(channel, twin, lockStart);
+  memcpy((uint8_t *)channel + lockEnd, (const uint8_t *)twin + lockEnd,
+      sizeof(*channel) - lockEnd);
+
+  if (channel == &spice->scInputs)
+    atomic_store(&spice->kb.scancode, HAS_CAPABILITY(channel->caps,
+          channel->numCaps, SPICE_INPUTS_CAP_KEY_SCANCODE));
+
+  twin->socket    = -1;
+  twin->connected = false;
+#if defined(USE_TLS)
+  twin->ssl       = NULL;
+#endif
+  twin->rxBuffer  = NULL;
+  twin->rxSize    = 0;
+  twin->rxPos     = 0;
+  twin->rxLen     = 0;
+  twin->txBuffer  = NULL;
+  twin->txSize    = 0;
+  twin->txPos     = 0;
+  twin->txLen     = 0;
+
+  // after a semi-seamless migration the destination starts over with init
+  channel->initDone = spice->mig.seamless;
+  channel->migReset = !spice->mig.seamless;
+
+  const bool watch = channel->txWatch;
+  channel->txWatch = false;
+  if (!spice_reactor_add(channel) || (watch && !spice_watch_nl(channel, true)))
+    channel->connected = false;
+  SPICE_UNLOCK(channel->lock);
+
+  if (channel == &spice->scInputs)
+    spice_input_attach();
+  else if (!spice->mig.seamless)
+    spice_agent_reset();
+}
+
+// ============================================================================
+
+void spice_migrate_failed()
+{
+  // let the source know so it can carry on without us
+  if (spice->mig.state == SPICE_MIGRATE_LINKING)
+  {
+    void * packet = SPICE_RAW_PACKET(SPICE_MSGC_MAIN_MIGRATE_CONNECT_ERROR, 0, 0);
+    SPICE_SEND_PACKET(&spice->scMain, packet);
+  }
+
+  spice_migrate_abort();
+}
+
+// ============================================================================
+
+void spice_migrate_abort()
+{
+  spice->mig.state = SPICE_MIGRATE_NONE;
+  spice_close_channel(&spice->mig.scInputs);
+  spice_close_channel(&spice->mig.scMain  );
+
+  spice->scMain  .migData   = false;
+  spice->scMain  .migSwitch = false;
+  spice->scInputs.migData   = false;
+  spice->scInputs.migSwitch = false;
+}
+
+// ============================================================================
+
+void spice_agent_reset()
+{
+  if (spice->cbBuffer)
+  {
+    free(spice->cbBuffer);
+    spice->cbBuffer = NULL;
+  }
+
+  spice->cbRemain  = 0;
+  spice->cbSize    = 0;
+  spice->agentSkip = 0;
+
+  spice->cbAgentGrabbed  = false;
+  spice->cbClientGrabbed = false;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_agent_connect()
+{
+  uint32_t * packet = SPICE_PACKET(SPICE_MSGC_MAIN_AGENT_START, uint32_t, 0);
+  *packet = SPICE_AGENT_TOKENS_MAX;
+  if (!SPICE_SEND_PACKET(&spice->scMain, packet))
+    return SPICE_STATUS_ERROR;
+
+  return spice_agent_send_caps(true);
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_agent_process(const uint8_t * data, uint32_t dataSize)
+{
+  if (spice->cbRemain)
+  {
+    const uint32_t r = spice->cbRemain > dataSize ? dataSize : spice->cbRemain;
+    memcpy(spice->cbBuffer + spice->cbSize, data, r);
+
+    spice->cbRemain -= r;
+    spice->cbSize   += r;
+
+    if (spice->cbRemain == 0)
+      spice_agent_on_clipboard();
+
+    return SPICE_STATUS_OK;
+  }
+
+  // skip the remainder of a message we are not interested in that has been
+  // split over multiple chunks
+  if (spice->agentSkip)
+  {
+    spice->agentSkip -= spice->agentSkip > dataSize ? dataSize : spice->agentSkip;
+    return SPICE_STATUS_OK;
+  }
+
+  #pragma pack(push,1)
+  struct Selection
+  {
+    uint8_t selection;
+    uint8_t reserved[3];
+  };
+  #pragma pack(pop)
+
+  if (dataSize < sizeof(VDAgentMessage))
+    return SPICE_STATUS_ERROR;
+
+  const VDAgentMessage * msg = (const VDAgentMessage *)data;
+  data     += sizeof(*msg);
+  dataSize -= sizeof(*msg);
+
+  if (msg->protocol != VD_AGENT_PROTOCOL)
+    return SPICE_STATUS_ERROR;
+
+  switch(msg->type)
+  {
+    case VD_AGENT_ANNOUNCE_CAPABILITIES:
+    {
+      if (msg->size > dataSize || msg->size < sizeof(VDAgentAnnounceCapabilities))
+        return SPICE_STATUS_ERROR;
+
+      const VDAgentAnnounceCapabilities * caps =
+        (const VDAgentAnnounceCapabilities *)data;
+
+      const int capsSize = VD_AGENT_CAPS_SIZE_FROM_MSG_SIZE(msg->size);
+      spice->cbSupported  = VD_AGENT_HAS_CAPABILITY(caps->caps, capsSize, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND) ||
+                           VD_AGENT_HAS_CAPABILITY(caps->caps, capsSize, VD_AGENT_CAP_CLIPBOARD_SELECTION);
+      spice->cbSelection  = VD_AGENT_HAS_CAPABILITY(caps->caps, capsSize, VD_AGENT_CAP_CLIPBOARD_SELECTION);
+
+      if (caps->request)
+        return spice_agent_send_caps(false);
+
+      return SPICE_STATUS_OK;
+    }
+
+    case VD_AGENT_CLIPBOARD:
+    case VD_AGENT_CLIPBOARD_REQUEST:
+    case VD_AGENT_CLIPBOARD_GRAB:
+    case VD_AGENT_CLIPBOARD_RELEASE:
+    {
+      uint32_t remaining = msg->size;
+      if (spice->cbSelection)
+      {
+        if (dataSize < sizeof(struct Selection) || remaining < sizeof(struct Selection))
+          return SPICE_STATUS_ERROR;
+
+        remaining -= sizeof(struct Selection);
+        dataSize  -= sizeof(struct Selection);
+        data      += sizeof(struct Selection);
+      }
+
+      if (msg->type == VD_AGENT_CLIPBOARD_RELEASE)
+      {
+        spice->cbAgentGrabbed = false;
+        spice_event(SPICE_EVENT_CB_RELEASE, SPICE_DATA_NONE, NULL, 0);
+        return SPICE_STATUS_OK;
+      }
+
+      if (msg->type == VD_AGENT_CLIPBOARD || msg->type == VD_AGENT_CLIPBOARD_REQUEST)
+      {
+        if (dataSize < sizeof(uint32_t) || remaining < sizeof(uint32_t))
+          return SPICE_STATUS_ERROR;
+
+        const uint32_t type = *(const uint32_t *)data;
+        remaining -= sizeof(type);
+        dataSize  -= sizeof(type);
+        data      += sizeof(type);
+
+        if (msg->type == VD_AGENT_CLIPBOARD)
+        {
+          if (spice->cbBuffer)
+            return SPICE_STATUS_ERROR;
+
+          spice->cbSize     = 0;
+          spice->cbRemain   = remaining;
+          spice->cbBuffer   = (uint8_t *)malloc(remaining);
+          if (!spice->cbBuffer)
+          {
+            spice->cbRemain = 0;
+            return SPICE_STATUS_ERROR;
+          }
+
+          const uint32_t r = remaining > dataSize ? dataSize : remaining;
+          memcpy(spice->cbBuffer, data, r);
+
+          spice->cbRemain -= r;
+          spice->cbSize   += r;
+
+          if (spice->cbRemain == 0)
+            spice_agent_on_clipboard();
+
+          return SPICE_STATUS_OK;
+        }
+        else
+        {
+          spice_event(SPICE_EVENT_CB_REQUEST,
+              agent_type_to_spice_type(type), NULL, 0);
+          return SPICE_STATUS_OK;
+        }
+      }
+      else
+      {
+        if (remaining == 0)
+          return SPICE_STATUS_OK;
+
+        if (remaining > dataSize)
+          return SPICE_STATUS_ERROR;
+
+        const uint32_t * types = (const uint32_t *)data;
+
+        // there is zero documentation on the types field, it might be a bitfield
+        // but for now we are going to assume it's not.
+
+        spice->cbType          = agent_type_to_spice_type(types[0]);
+        spice->cbAgentGrabbed  = true;
+        spice->cbClientGrabbed = false;
+        if (spice->cbSelection)
+        {
+          // Windows doesnt support this, so until it's needed there is no point messing with it
+          return SPICE_STATUS_OK;
+        }
+
+        spice_event(SPICE_EVENT_CB_NOTICE, spice->cbType, NULL, 0);
+
+        return SPICE_STATUS_OK;
+      }
+    }
+  }
+
+  if (msg->size > dataSize)
+    spice->agentSkip = msg->size - dataSize;
+
+  return SPICE_STATUS_OK;
+}
+
+
+// ============================================================================
+
+void spice_agent_on_clipboard()
+{
+  // the event takes ownership of the buffer
+  spice_event(SPICE_EVENT_CB_DATA, spice->cbType, spice->cbBuffer, spice->cbSize);
+  spice->cbBuffer = NULL;
+  spice->cbSize   = 0;
+  spice->cbRemain = 0;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_agent_send_caps(bool request)
+{
+  const ssize_t capsSize = sizeof(VDAgentAnnounceCapabilities) + VD_AGENT_CAPS_BYTES;
+  VDAgentAnnounceCapabilities *caps = (VDAgentAnnounceCapabilities *)alloca(capsSize);
+  memset(caps, 0, capsSize);
+
+  caps->request = request ? 1 : 0;
+  VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND);
+  VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_CLIPBOARD_SELECTION);
+
+  if (!spice_agent_start_msg(VD_AGENT_ANNOUNCE_CAPABILITIES, capsSize) ||
+      !spice_agent_write_msg(caps, capsSize))
+    return SPICE_STATUS_ERROR;
+
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+bool spice_agent_start_msg(uint32_t type, ssize_t size)
+{
+  VDAgentMessage * msg =
+    SPICE_PACKET(SPICE_MSGC_MAIN_AGENT_DATA, VDAgentMessage, 0);
+
+  msg->protocol  = VD_AGENT_PROTOCOL;
+  msg->type      = type;
+  msg->opaque    = 0;
+  msg->size      = size;
+
+  SPICE_LOCK(spice->agentLock);
+  spice->agentMsg = size;
+  if (!SPICE_SEND_PACKET(&spice->scMain, msg))
+  {
+    SPICE_UNLOCK(spice->agentLock);
+    return false;
+  }
+
+  if (size == 0)
+    SPICE_UNLOCK(spice->agentLock);
+
+  return true;
+}
+
+// ============================================================================
+
+bool spice_agent_write_msg(const void * buffer, ssize_t size)
+{
+  assert(size <= spice->agentMsg);
+
+  /* the data is split into VD_AGENT_MAX_DATA_SIZE chunks each with it's own
+   * header, rather then a send per header and chunk these are gathered so
+   * that many chunks are written with a single syscall */
+  SpiceMiniDataHeader headers[SPICE_AGENT_IOV_CHUNKS];
+  struct iovec        iov    [SPICE_AGENT_IOV_CHUNKS * 2];
+  const uint8_t *     data = (const uint8_t *)buffer;
+
+  while(size)
+  {
+    int     chunks = 0;
+    ssize_t total  = 0;
+
+    while(size && chunks < SPICE_AGENT_IOV_CHUNKS)
+    {
+      const ssize_t toWrite = size > VD_AGENT_MAX_DATA_SIZE ?
+        VD_AGENT_MAX_DATA_SIZE : size;
+
+      headers[chunks].type = SPICE_MSGC_MAIN_AGENT_DATA;
+      headers[chunks].size = toWrite;
+
+      iov[chunks * 2    ].iov_base = &headers[chunks];
+      iov[chunks * 2    ].iov_len  = sizeof(*headers);
+      iov[chunks * 2 + 1].iov_base = (void *)data;
+      iov[chunks * 2 + 1].iov_len  = toWrite;
+
+      total += sizeof(*headers) + toWrite;
+      size  -= toWrite;
+      data  += toWrite;
+      ++chunks;
+    }
+
+    SPICE_LOCK(spice->scMain.lock);
+    if (!spice_agent_drain_nl() ||
+        spice_writev_nl(&spice->scMain, iov, chunks * 2) != total)
+    {
+      SPICE_UNLOCK(spice->scMain.lock);
+      goto err;
+    }
+    SPICE_UNLOCK(spice->scMain.lock);
+
+    spice->agentMsg -= total - chunks * sizeof(*headers);
+  }
+
+  if (!spice->agentMsg)
+    SPICE_UNLOCK(spice->agentLock);
+
+  return true;
+
+err:
+  SPICE_UNLOCK(spice->agentLock);
+  return false;
+}
+
+// ============================================================================
+
+bool spice_agent_drain_nl()
+{
+  struct SpiceChannel * channel = &spice->scMain;
+  const uint64_t deadline = get_timestamp() + SPICE_AGENT_DRAIN_TIMEOUT;
+
+  /* the caller's buffer can't be kept once it returns, so rather than copying
+   * all of a large payload into the queue it is fed in as the socket drains.
+   * The lock is dropped while waiting so the reactor keeps servicing the
+   * channel, it may have flushed or closed it by the time it is retaken */
+  while(channel->txLen - channel->txPos >= SPICE_AGENT_QUEUE_MAX)
+  {
+    if (!channel->connected)
+      return false;
+
+    if (spice_flush_nl(channel) == SPICE_STATUS_ERROR)
+      return false;
+
+    if (channel->txLen - channel->txPos < SPICE_AGENT_QUEUE_MAX)
+      break;
+
+    const uint64_t now = get_timestamp();
+    if (now >= deadline)
+      return false;
+
+    struct pollfd pfd =
+    {
+      .fd     = channel->socket,
+      .events = POLLOUT
+    };
+
+    SPICE_UNLOCK(channel->lock);
+    const int ret = poll(&pfd, 1, deadline - now);
+    SPICE_LOCK(channel->lock);
+
+    if (ret < 0 && errno != EINTR)
+      return false;
+  }
+
+  return true;
+}
+
+// ============================================================================
+
+ssize_t spice_write_nl(struct SpiceChannel * channel, const void * buffer, const ssize_t size)
+{
+  if (!buffer)
+    return -1;
+
+  const struct iovec iov =
+  {
+    .iov_base = (void *)buffer,
+    .iov_len  = size
+  };
+
+  return spice_writev_nl(channel, &iov, 1);
+}
+
+// ============================================================================
+
+static ssize_t spice_sendv_nl(struct SpiceChannel * channel,
+    const struct iovec * iov, int iovcnt)
+{
+#if defined(USE_TLS)
+  if (channel->ssl && !channel->ktlsTx)
+    return spice_tls_writev_nl(channel, iov, iovcnt);
+#endif
+
+  struct msghdr msg =
+  {
+    .msg_iov    = (struct iovec *)iov,
+    .msg_iovlen = iovcnt
+  };
+
+  ssize_t wrote;
+  do
+    wrote = sendmsg(channel->socket, &msg, MSG_NOSIGNAL);
+  while(wrote < 0 && errno == EINTR);
+
+  return wrote;
+}
+
+// ============================================================================
+
+ssize_t spice_writev_nl(struct SpiceChannel * channel, const struct iovec * iov, int iovcnt)
+{
+  if (!channel->connected)
+    return -1;
+
+  ssize_t size = 0;
+  for(int i = 0; i < iovcnt; ++i)
+    size += iov[i].iov_len;
+
+  if (channel->txClosed)
+    return size;
+
+  // anything already queued must go out first to preserve ordering, unless
+  // the channel is corked in which case everything is held until the flush
+  if (!channel->txCork && channel->txLen > channel->txPos &&
+      spice_flush_nl(channel) == SPICE_STATUS_ERROR)
+    return -1;
+
+  ssize_t wrote = 0;
+  if (!channel->txCork && channel->txLen == channel->txPos)
+  {
+    wrote = spice_sendv_nl(channel, iov, iovcnt);
+
+    if (wrote < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+      wrote = 0;
+    }
+
+    if (wrote == size)
+      return size;
+  }
+
+  // queue the remainder to be sent when the socket becomes writable
+  const size_t remain = size - wrote;
+  if (channel->txLen + remain > channel->txSize)
+  {
+    if (channel->txPos > 0)
+    {
+      memmove(channel->txBuffer, channel->txBuffer + channel->txPos,
+          channel->txLen - channel->txPos);
+      channel->txLen -= channel->txPos;
+      channel->txPos  = 0;
+    }
+
+    if (channel->txLen + remain > channel->txSize)
+    {
+      size_t newSize = channel->txSize ? channel->txSize : SPICE_TX_BUFFER_SIZE;
+      while(newSize < channel->txLen + remain)
+        newSize *= 2;
+
+      uint8_t * newBuffer = realloc(channel->txBuffer, newSize);
+      if (!newBuffer)
+        return -1;
+
+      channel->txBuffer = newBuffer;
+      channel->txSize   = newSize;
+    }
+  }
+
+  for(int i = 0; i < iovcnt; ++i)
+  {
+    if (wrote >= iov[i].iov_len)
+    {
+      wrote -= iov[i].iov_len;
+      continue;
+    }
+
+    const size_t len = iov[i].iov_len - wrote;
+    memcpy(channel->txBuffer + channel->txLen,
+        (const uint8_t *)iov[i].iov_base + wrote, len);
+    channel->txLen += len;
+    wrote = 0;
+  }
+
+  if (!channel->txCork && !spice_watch_nl(channel, true))
+    return -1;
+
+  return size;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_flush_nl(struct SpiceChannel * channel)
+{
+  // a batch is being built, it is only sent by spice_input_flush. Stop
+  // watching for writability until then or epoll would keep waking us
+  if (channel->txCork)
+    return spice_watch_nl(channel, false) ?
+      SPICE_STATUS_INCOMPLETE : SPICE_STATUS_ERROR;
+
+  while(channel->txLen > channel->txPos)
+  {
+    const struct iovec iov =
+    {
+      .iov_base = channel->txBuffer + channel->txPos,
+      .iov_len  = channel->txLen    - channel->txPos
+    };
+
+    const ssize_t wrote = spice_sendv_nl(channel, &iov, 1);
+    if (wrote < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return spice_watch_nl(channel, true) ?
+          SPICE_STATUS_INCOMPLETE : SPICE_STATUS_ERROR;
+
+      channel->connected = false;
+      return SPICE_STATUS_ERROR;
+    }
+
+    channel->txPos += wrote;
+  }
+
+  channel->txPos = 0;
+  channel->txLen = 0;
+
+  if (channel->txShutdown)
+  {
+#if defined(USE_TLS)
+    if (channel->ssl)
+      SPICE_TLS_NOSIGPIPE(SSL_shutdown(channel->ssl));
+#endif
+    shutdown(channel->socket, SHUT_WR);
+    channel->txShutdown = false;
+  }
+
+  return spice_watch_nl(channel, false) ?
+    SPICE_STATUS_OK : SPICE_STATUS_ERROR;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_rx_room_nl(struct SpiceChannel * channel)
+{
+  if (channel->rxPos == channel->rxLen)
+    channel->rxPos = channel->rxLen = 0;
+  else if (channel->rxLen == channel->rxSize)
+  {
+    // the buffer is full, make room by moving the unread data to the front or
+    // growing it if it is all unread
+    return spice_reserve_nl(channel,
+        channel->rxSize * (channel->rxPos > 0 ? 1 : 2));
+  }
+
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_recv_nl(struct SpiceChannel * channel, int flags)
+{
+  SPICE_STATUS status;
+  if ((status = spice_rx_room_nl(channel)) != SPICE_STATUS_OK)
+    return status;
+
+#if defined(USE_TLS)
+  if (channel->ssl)
+    return spice_tls_recv_nl(channel);
+#endif
+
+  ssize_t len;
+  do
+    len = recv(channel->socket, channel->rxBuffer + channel->rxLen,
+        channel->rxSize - channel->rxLen, flags);
+  while(len < 0 && errno == EINTR);
+
+  if (len == 0)
+    return SPICE_STATUS_NODATA;
+
+  if (len < 0)
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return SPICE_STATUS_INCOMPLETE;
+
+    channel->connected = false;
+    return SPICE_STATUS_ERROR;
+  }
+
+  channel->rxLen    += len;
+  channel->rxPartial = false;
+  channel->rxLast    = get_timestamp();
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+SPICE_STATUS spice_reserve_nl(struct SpiceChannel * channel, const size_t size)
+{
+  // make sure `size` bytes from the read position will fit contiguously in
+  // the buffer, moving the unread data to the front or growing it as needed
+  if (channel->rxPos + size <= channel->rxSize)
+    return SPICE_STATUS_OK;
+
+  memmove(channel->rxBuffer, channel->rxBuffer + channel->rxPos,
+      channel->rxLen - channel->rxPos);
+  channel->rxLen -= channel->rxPos;
+  channel->rxPos  = 0;
+
+  if (size > channel->rxSize)
+  {
+    uint8_t * buffer = realloc(channel->rxBuffer, size);
+    if (!buffer)
+      return SPICE_STATUS_ERROR;
+
+    channel->rxBuffer = buffer;
+    channel->rxSize   = size;
+  }
+
+  return SPICE_STATUS_OK;
+}
+
+// ============================================================================
+
+void spice_input_reset()
+{
+  for(size_t i = 0; i < SPICE_INPUT_RING_SIZE; ++i)
+    atomic_init(&spice->inputRing[i].seq, i);
+
+  atomic_init(&spice->inputHead, 0);
+  spice->inputTail = 0;
+  SPICE_LOCK_INIT(spice->inputDrain);
+  atomic_store(&spice->inputFlush, false);
+
+  spice->mouse.buttonState = 0;
+  spice->mouse.pendingX    = 0;
+  spice->mouse.pendingY    = 0;
+  spice->mouse.wheelY      = 0;
+  for(int i = 0; i < SPICE_MAX_DISPLAYS; ++i)
+    spice->mouse.position[i].pending = false;
+  atomic_store(&spice->mouse.positionHeld, false);
+  atomic_store(&spice->mouse.sentCount, 0);
+
+  spice->inputLinked = false;
+  spice->backlogLen  = 0;
+}
+
+// ============================================================================
+
+static void spice_input_hold(const void * data, size_t len)
+{
+  if (spice->backlogLen + len > spice->backlogSize)
+  {
+    size_t size = spice->backlogSize ? spice->backlogSize :
+      SPICE_INPUT_BATCH_SIZE;
+    while(size < spice->backlogLen + len)
+      size *= 2;
+
+    uint8_t * backlog = realloc(spice->inputBacklog, size);
+    if (!backlog)
+      return;
+
+    spice->inputBacklog = backlog;
+    spice->backlogSize  = size;
+  }
+
+  memcpy(spice->inputBacklog + spice->backlogLen, data, len);
+  spice->backlogLen += len;
+}
+
+// ============================================================================
+
+bool spice_input_push(const struct SpiceInput * input)
+{
+  return spice_input_push_n(input, 1);
+}
+
+// ============================================================================
+
+bool spice_input_push_n(const struct SpiceInput * inputs, size_t count)
+{
+  // while reconnecting input is accepted and held until the channel is back
+  const bool open = spice->scInputs.connected || (spice->rcAttempts &&
+    !spice->rcStop && (spice->scMain.socket >= 0 || spice->rcDue));
+
+  if (!open || count == 0 || count > SPICE_INPUT_RING_SIZE)
+    return false;
+
+  /* claim count consecutive slots, each slot's sequence tells us if it is
+   * free for this lap of the ring, if it is behind the ring is full. Slots
+   * are freed in order so if the last one is free so are the others */
+  size_t pos = atomic_load_explicit(&spice->inputHead, memory_order_relaxed);
+  for(;;)
+  {
+    const size_t last = pos + count - 1;
+    struct SpiceInputSlot * slot =
+      &spice->inputRing[last & (SPICE_INPUT_RING_SIZE - 1)];
+    const size_t   seq  = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    const intptr_t diff = (intptr_t)seq - (intptr_t)last;
+
+    if (diff == 0)
+    {
+      if (atomic_compare_exchange_weak_explicit(&spice->inputHead, &pos,
+            pos + count, memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+      return false;
+    else
+      pos = atomic_load_explicit(&spice->inputHead, memory_order_relaxed);
+  }
+
+  for(size_t i = 0; i < count; ++i)
+  {
+    struct SpiceInputSlot * slot =
+      &spice->inputRing[(pos + i) & (SPICE_INPUT_RING_SIZE - 1)];
+    memcpy(&slot->input, &inputs[i], sizeof(*inputs));
+    atomic_store_explicit(&slot->seq, pos + i + 1, memory_order_release);
+  }
+
+  spice_input_drain();
+  return true;
+}
+
+// ============================================================================
+
+bool spice_input_pending()
+{
+  const size_t pos = spice->inputTail;
+  struct SpiceInputSlot * slot =
+    &spice->inputRing[pos & (SPICE_INPUT_RING_SIZE - 1)];
+
+  return atomic_load_explicit(&slot->seq, memory_order_acquire) == pos + 1;
+}
+
+// ============================================================================
+
+bool spice_input_pop(struct SpiceInput * input)
+{
+  if (!spice_input_pending())
+    return false;
+
+  const size_t pos = spice->inputTail;
+  struct SpiceInputSlot * slot =
+    &spice->inputRing[pos & (SPICE_INPUT_RING_SIZE - 1)];
+
+  memcpy(input, &slot->input, sizeof(*input));
+  atomic_store_explicit(&slot->seq, pos + SPICE_INPUT_RING_SIZE,
+      memory_order_release);
+
+  spice->inputTail = pos + 1;
+  return true;
+}
+
+// ============================================================================
+
+static void spice_input_send_nl(struct SpiceInputBatch * batch)
+{
+  if (batch->len == 0)
+    return;
+
+  // failures surface as a disconnect through spice_process
+  if (spice->inputLinked)
+    spice_write_nl(&spice->scInputs, batch->buffer, batch->len);
+  else
+    spice_input_hold(batch->buffer, batch->len);
+
+  batch->len      = 0;
+  batch->scancode = NULL;
+}
+
+// ============================================================================
+
+static void * spice_input_msg_nl(struct SpiceInputBatch * batch,
+    uint16_t type, uint32_t size)
+{
+  if (batch->len + sizeof(SpiceMiniDataHeader) + size > sizeof(batch->buffer))
+    spice_input_send_nl(batch);
+
+  SpiceMiniDataHeader * header =
+    (SpiceMiniDataHeader *)(batch->buffer + batch->len);
+
+  header->type    = type;
+  header->size    = size;
+  batch->len     += sizeof(*header) + size;
+  batch->scancode = NULL;
+  return header + 1;
+}
+
+// ============================================================================
+
+static uint32_t spice_button_mask(uint32_t button)
+{
+  switch(button)
+  {
+    case SPICE_MOUSE_BUTTON_LEFT   : return SPICE_MOUSE_BUTTON_MASK_LEFT   ;
+    case SPICE_MOUSE_BUTTON_MIDDLE : return SPICE_MOUSE_BUTTON_MASK_MIDDLE ;
+    case SPICE_MOUSE_BUTTON_RIGHT  : return SPICE_MOUSE_BUTTON_MASK_RIGHT  ;
+    case _SPICE_MOUSE_BUTTON_SIDE  : return _SPICE_MOUSE_BUTTON_MASK_SIDE  ;
+    case _SPICE_MOUSE_BUTTON_EXTRA : return _SPICE_MOUSE_BUTTON_MASK_EXTRA ;
+    default:
+      return 0;
+  }
+}
+
+// ============================================================================
+
+static void spice_input_motion_nl(struct SpiceInputBatch * batch, bool force)
+{
+  int32_t x = spice->mouse.pendingX;
+  int32_t y = spice->mouse.pendingY;
+  if (x == 0 && y == 0)
+    return;
+
+  // hold the motion back while the window is full, unless something that
+  // depends on the pointer location (ie, a click) needs it sent first
+  // the same applies while the inputs channel is down so it is coalesced
+  const unsigned int window = atomic_load(&spice->mouse.window);
+  if (!force && (!spice->inputLinked || (window &&
+      (unsigned int)atomic_load(&spice->mouse.sentCount) >= window)))
+    return;
+
+  /* while the protocol supports movements greater then +-127 the QEMU
+   * virtio-mouse device does not, so we need to split this up into seperate
+   * messages, these all go into the same batch so they are still sent
+   * together */
+  while(x != 0 || y != 0)
+  {
+    SpiceMsgcMouseMotion * msg = spice_input_msg_nl(batch,
+        SPICE_MSGC_INPUTS_MOUSE_MOTION, sizeof(*msg));
+
+    msg->x = x > 127 ? 127 : (x < -127 ? -127 : x);
+    msg->y = y > 127 ? 127 : (y < -127 ? -127 : y);
+    msg->button_state = spice->mouse.buttonState;
+
+    x -= msg->x;
+    y -= msg->y;
+
+    atomic_fetch_add(&spice->mouse.sentCount, 1);
+  }
+
+  spice->mouse.pendingX = 0;
+  spice->mouse.pendingY = 0;
+}
+
+// ============================================================================
+
+static void spice_input_position_nl(struct SpiceInputBatch * batch, bool force)
+{
+  // absolute positions are only worth sending when they are current, so
+  // while the socket is backed up or down, or the window is full only the
+  // latest one per display is kept
+  const unsigned int window = atomic_load(&spice->mouse.window);
+  const bool held = !force && (!spice->inputLinked ||
+    (!spice->scInputs.txCork &&
+      spice->scInputs.txLen > spice->scInputs.txPos) ||
+    (window && (unsigned int)atomic_load(&spice->mouse.sentCount) >= window));
+
+  bool pending = false;
+  for(int i = 0; i < SPICE_MAX_DISPLAYS; ++i)
+  {
+    if (!spice->mouse.position[i].pending)
+      continue;
+
+    if (held)
+    {
+      pending = true;
+      continue;
+    }
+
+    SpiceMsgcMousePosition * msg = spice_input_msg_nl(batch,
+        SPICE_MSGC_INPUTS_MOUSE_POSITION, sizeof(*msg));
+
+    msg->display_id   = i;
+    msg->button_state = spice->mouse.buttonState;
+    msg->x            = spice->mouse.position[i].x;
+    msg->y            = spice->mouse.position[i].y;
+
+    spice->mouse.position[i].pending = false;
+    atomic_fetch_add(&spice->mouse.sentCount, 1);
+  }
+
+  atomic_store(&spice->mouse.positionHeld, pending);
+}
+
+// ============================================================================
+
+static void spice_input_serialize_nl(struct SpiceInputBatch * batch,
+    const struct SpiceInput * input)
+{
+  switch(input->type)
+  {
+    case SPICE_INPUT_KEY_DOWN:
+    {
+      SpiceMsgcKeyDown * msg = spice_input_msg_nl(batch,
+          SPICE_MSGC_INPUTS_KEY_DOWN, sizeof(*msg));
+      msg->code = input->code;
+      break;
+    }
+
+    case SPICE_INPUT_KEY_UP:
+    {
+      SpiceMsgcKeyUp * msg = spice_input_msg_nl(batch,
+          SPICE_MSGC_INPUTS_KEY_UP, sizeof(*msg));
+      msg->code = input->code;
+      break;
+    }
+
+    case SPICE_INPUT_KEY_SCANCODE:
+    {
+      // scancodes in the PC XT set, extended keys are prefixed with 0xe0
+      uint8_t codes[2];
+      size_t  len = 0;
+      if (input->code >= 0x100)
+        codes[len++] = 0xe0;
+      codes[len++] = (input->code & 0x7f) | (input->x ? 0x00 : 0x80);
+
+      // add to the previous KEY_SCANCODE message if it is still the last in
+      // the buffer and there is room, otherwise start a new one
+      if (batch->scancode && batch->len + len <= sizeof(batch->buffer))
+      {
+        memcpy(batch->buffer + batch->len, codes, len);
+        batch->scancode->size += len;
+        batch->len            += len;
+        break;
+      }
+
+      uint8_t * msg = spice_input_msg_nl(batch,
+          SPICE_MSGC_INPUTS_KEY_SCANCODE, len);
+      memcpy(msg, codes, len);
+      batch->scancode = (SpiceMiniDataHeader *)msg - 1;
+      break;
+    }
+
+    case SPICE_INPUT_MOUSE_POSITION:
+      spice_input_motion_nl(batch, true);
+      spice->mouse.position[input->code].x       = input->x;
+      spice->mouse.position[input->code].y       = input->y;
+      spice->mouse.position[input->code].pending = true;
+      spice_input_position_nl(batch, false);
+      break;
+
+    case SPICE_INPUT_MOUSE_MOTION:
+      spice->mouse.pendingX += input->x;
+      spice->mouse.pendingY += input->y;
+      spice_input_motion_nl(batch, false);
+      break;
+
+
+    case SPICE_INPUT_MOUSE_PRESS:
+    {
+      spice_input_motion_nl  (batch, true);
+      spice_input_position_nl(batch, true);
+      spice->mouse.buttonState |= spice_button_mask(input->code);
+
+      SpiceMsgcMousePress * msg = spice_input_msg_nl(batch,
+          SPICE_MSGC_INPUTS_MOUSE_PRESS, sizeof(*msg));
+      msg->button       = input->code;
+      msg->button_state = spice->mouse.buttonState;
+      break;
+    }
+
+    case SPICE_INPUT_MOUSE_RELEASE:
+    {
+      spice_input_motion_nl  (batch, true);
+      spice_input_position_nl(batch, true);
+      spice->mouse.buttonState &= ~spice_button_mask(input->code);
+
+      SpiceMsgcMouseRelease * msg = spice_input_msg_nl(batch,
+          SPICE_MSGC_INPUTS_MOUSE_RELEASE, sizeof(*msg));
+      msg->button       = input->code;
+      msg->button_state = spice->mouse.buttonState;
+      break;
+    }
+
+    case SPICE_INPUT_MOUSE_WHEEL:
+    {
+      /* the wheel is reported as a press and release of the up or down
+       * buttons for each notch, partial notches are carried over so smooth
+       * scrolling still adds up to whole notches */
+      spice->mouse.wheelY += input->y;
+
+      const int32_t  notches = spice->mouse.wheelY / SPICE_WHEEL_NOTCH;
+      const uint32_t button  = notches > 0 ?
+        SPICE_MOUSE_BUTTON_UP : SPICE_MOUSE_BUTTON_DOWN;
+
+      if (notches == 0)
+        break;
+
+      spice_input_motion_nl  (batch, true);
+      spice_input_position_nl(batch, true);
+
+      spice->mouse.wheelY -= notches * SPICE_WHEEL_NOTCH;
+      for(int32_t i = abs(notches); i > 0; --i)
+      {
+        SpiceMsgcMousePress * press = spice_input_msg_nl(batch,
+            SPICE_MSGC_INPUTS_MOUSE_PRESS, sizeof(*press));
+        press->button       = button;
+        press->button_state = spice->mouse.buttonState;
+
+        SpiceMsgcMouseRelease * release = spice_input_msg_nl(batch,
+            SPICE_MSGC_INPUTS_MOUSE_RELEASE, sizeof(*release));
+        release->button       = button;
+        release->button_state = spice->mouse.buttonState;
+      }
+      break;
+    }
+  }
+}
+
+// ============================================================================
+
+void spice_input_detach()
+{
+  SPICE_LOCK(spice->inputDrain);
+  if (spice->inputLinked)
+  {
+    spice->inputLinked = false;
+    atomic_store(&spice->mouse.sentCount, 0);
+
+    /* the server may be a new one, put the keyboard LEDs and any held buttons
+     * back ahead of whatever is sent while the channel is down */
+    struct SpiceInputBatch batch;
+    batch.len      = 0;
+    batch.scancode = NULL;
+
+    if (spice->kb.modifiers)
+    {
+      SpiceMsgcInputsKeyModifiers * msg = spice_input_msg_nl(&batch,
+          SPICE_MSGC_INPUTS_KEY_MODIFIERS, sizeof(*msg));
+      msg->modifiers = spice->kb.modifiers;
+    }
+
+    uint32_t state = 0;
+    for(uint32_t button = SPICE_MOUSE_BUTTON_LEFT;
+        button <= _SPICE_MOUSE_BUTTON_EXTRA; ++button)
+    {
+      const uint32_t mask = spice_button_mask(button);
+      if (!(spice->mouse.buttonState & mask))
+        continue;
+
+      state |= mask;
+      SpiceMsgcMousePress * msg = spice_input_msg_nl(&batch,
+          SPICE_MSGC_INPUTS_MOUSE_PRESS, sizeof(*msg));
+      msg->button       = button;
+      msg->button_state = state;
+    }
+
+    spice_input_send_nl(&batch);
+  }
+  SPICE_UNLOCK(spice->inputDrain);
+}
+
+// ============================================================================
+
+bool spice_input_attach()
+{
+  SPICE_LOCK(spice->inputDrain);
+  SPICE_LOCK(spice->scInputs.lock);
+
+  /* the backlog is kept until it has been written, if the channel fails it is
+   * still held for the next time the inputs channel links */
+  if (spice->backlogLen &&
+      spice_write_nl(&spice->scInputs, spice->inputBacklog,
+        spice->backlogLen) != (ssize_t)spice->backlogLen)
+  {
+    SPICE_UNLOCK(spice->scInputs.lock);
+    SPICE_UNLOCK(spice->inputDrain);
+    return false;
+  }
+
+  spice->backlogLen  = 0;
+  spice->inputLinked = true;
+
+  SPICE_UNLOCK(spice->scInputs.lock);
+  SPICE_UNLOCK(spice->inputDrain);
+
+  // send anything that was left queued or held back
+  spice_input_kick();
+  return true;
+}
+
+// ============================================================================
+
+void spice_input_close()
+{
+  SPICE_LOCK(spice->inputDrain);
+  spice->inputLinked = false;
+
+  free(spice->inputBacklog);
+  spice->inputBacklog = NULL;
+  spice->backlogLen   = 0;
+  spice->backlogSize  = 0;
+  SPICE_UNLOCK(spice->inputDrain);
+}
+
+// ============================================================================
+
+void spice_input_drain()
+{
+  /* only one thread drains at a time, the others just leave their events in
+   * the queue. The queue is checked again after the drain is released as an
+   * event may have been published after we stopped popping but before the
+   * publisher's own attempt to drain saw the flag clear */
+  while((spice_input_pending() || atomic_load(&spice->inputFlush)) &&
+      SPICE_TRYLOCK(spice->inputDrain))
+  {
+    struct SpiceInputBatch batch;
+    batch.len      = 0;
+    batch.scancode = NULL;
+
+    // while the channel is down events are serialized into the backlog
+    // until it fills, the rest wait in the queue
+    const bool linked = spice->inputLinked;
+    if (linked)
+      SPICE_LOCK(spice->scInputs.lock);
+
+    struct SpiceInput input;
+    while((linked || spice->backlogLen < SPICE_INPUT_BACKLOG_SIZE) &&
+        spice_input_pop(&input))
+      spice_input_serialize_nl(&batch, &input);
+
+    // send anything that was held back if there is now room for it
+    if (atomic_exchange(&spice->inputFlush, false))
+    {
+      spice_input_motion_nl  (&batch, false);
+      spice_input_position_nl(&batch, false);
+    }
+
+    spice_input_send_nl(&batch);
+    if (linked)
+      SPICE_UNLOCK(spice->scInputs.lock);
+
+    const bool full = !linked &&
+      spice->backlogLen >= SPICE_INPUT_BACKLOG_SIZE;
+    SPICE_UNLOCK(spice->inputDrain);
+
+    // spice_input_attach drains the queue once there is room again
+    if (full)
+      break;
+  }
+}
+
+// ============================================================================
+
+void spice_input_kick()
+{
+  // this can't go through the queue as it may be full, a flag is used instead
+  // so the request is never lost
+  atomic_store(&spice->inputFlush, true);
+  spice_input_drain();
+}
+
+// ============================================================================
+
+static inline uint32_t spice_scancode_down(uint32_t code)
+{
+  // extended keys are given as 0x100 plus the code that follows the 0xe0
+  return code >= 0x100 ? 0xe0 | ((code - 0x100) << 8) : code;
+}
+
+static inline uint32_t spice_scancode_up(uint32_t code)
+{
+  return code >= 0x100 ? 0x80e0 | ((code - 0x100) << 8) : code | 0x80;
+}
+
+// ============================================================================
+
+bool spice_key_down(uint32_t code)
+{
+  const struct SpiceInput input =
+  {
+    .type = SPICE_INPUT_KEY_DOWN,
+    .code = spice_scancode_down(code)
+  };
+
+  return spice_input_push(&input);
+}
+
+// ============================================================================
+
+bool spice_key_up(uint32_t code)
+{
+  const struct SpiceInput input =
+  {
+    .type = SPICE_INPUT_KEY_UP,
+    .code = spice_scancode_up(code)
+  };
+
+  return spice_input_push(&input);
+}
+
+// ============================================================================
+
+static inline bool spice_key_push(SpiceInputType type, uint32_t code)
+{
+  if (!code)
+    return false;
+
+  const struct SpiceInput input =
+  {
+    .type = type,
+    .code = code
+  };
+
+  return spice_input_push(&input);
+}
+
+// ============================================================================
+
+bool spice_key_down_evdev(uint32_t code)
+{
+  if (code >= SPICE_KEYMAP_EVDEV_SIZE)
+    return false;
+
+  return spice_key_push(SPICE_INPUT_KEY_DOWN, spice_keymap_evdev[code].down);
+}
+
+// ============================================================================
+
+bool spice_key_up_evdev(uint32_t code)
+{
+  if (code >= SPICE_KEYMAP_EVDEV_SIZE)
+    return false;
+
+  return spice_key_push(SPICE_INPUT_KEY_UP, spice_keymap_evdev[code].up);
+}
+
+// ============================================================================
+
+bool spice_key_down_hid(uint32_t usage)
+{
+  if (usage >= SPICE_KEYMAP_HID_SIZE)
+    return false;
+
+  return spice_key_push(SPICE_INPUT_KEY_DOWN, spice_keymap_hid[usage].down);
+}
+
+// ============================================================================
+
+bool spice_key_up_hid(uint32_t usage)
+{
+  if (usage >= SPICE_KEYMAP_HID_SIZE)
+    return false;
+
+  return spice_key_push(SPICE_INPUT_KEY_UP, spice_keymap_hid[usage].up);
+}
+
+// ============================================================================
+
+bool spice_key_scancodes(const uint32_t * codes, size_t count, const bool * down)
+{
+  const bool scancode = atomic_load(&spice->kb.scancode);
+
+  /* each transition is queued as its own event so they interleave correctly
+   * with other input, the drainer merges runs of them into a single
+   * KEY_SCANCODE message. Servers without the capability get the usual
+   * KEY_DOWN/KEY_UP messages instead, still in the same write */
+  struct SpiceInput inputs[64];
+  while(count > 0)
+  {
+    const size_t n = count > 64 ? 64 : count;
+    for(size_t i = 0; i < n; ++i)
+    {
+      uint32_t       code = codes[i];
+      SpiceInputType type;
+      if (scancode)
+        type = SPICE_INPUT_KEY_SCANCODE;
+      else if (down[i])
+      {
+        code = spice_scancode_down(code);
+        type = SPICE_INPUT_KEY_DOWN;
+      }
+      else
+      {
+        code = spice_scancode_up(code);
+        type = SPICE_INPUT_KEY_UP;
+      }
+
+      inputs[i] = (struct SpiceInput)
+      {
+        .type = type,
+        .code = code,
+        .x    = down[i]
+      };
+    }
+
+    if (!spice_input_push_n(inputs, n))
+      return false;
+
+    codes += n;
+    down  += n;
+    count -= n;
+  }
+
+  return true;
+}
+
+// ============================================================================
+
+static const char * utf8_decode(const char * str, uint32_t * cp)
+{
+  const uint8_t * s = (const uint8_t *)str;
+  int len;
+
+  if      (s[0] < 0x80)           { *cp = s[0]       ; len = 1; }
+  else if ((s[0] & 0xe0) == 0xc0) { *cp = s[0] & 0x1f; len = 2; }
+  else if ((s[0] & 0xf0) == 0xe0) { *cp = s[0] & 0x0f; len = 3; }
+  else if ((s[0] & 0xf8) == 0xf0) { *cp = s[0] & 0x07; len = 4; }
+  else
+    return NULL;
+
+  for(int i = 1; i < len; ++i)
+  {
+    if ((s[i] & 0xc0) != 0x80)
+      return NULL;
+    *cp = (*cp << 6) | (s[i] & 0x3f);
+  }
+
+  return str + len;
+}
+
+// ============================================================================
+
+static const SpiceKeyMap * spice_layout_find(const SpiceKeyLayout * layout,
+    uint32_t codepoint)
+{
+  for(size_t i = 0; i < layout->count; ++i)
+    if (layout->keys[i].codepoint == codepoint)
+      return &layout->keys[i];
+
+  return NULL;
+}
+
+// ============================================================================
+
+// the scancodes typing presses for each modifier
+static const struct SpiceTypingMod
+{
+  uint32_t mod;
+  uint32_t code;
+}
+spice_typing_mods[] =
+{
+  { SPICE_KEYMOD_SHIFT, 0x2a  },
+  { SPICE_KEYMOD_ALTGR, 0x138 }
+};
+
+#define SPICE_TYPING_MOD_COUNT \
+  (sizeof(spice_typing_mods) / sizeof(*spice_typing_mods))
+
+// ============================================================================
+
+bool spice_type_text(const char * text, const SpiceKeyLayout * layout, unsigned int cps)
+{
+  if (!spice->scInputs.connected || !layout)
+    return false;
+
+  // worst case every character toggles both modifiers on the way in and out
+  const size_t len = strlen(text);
+  uint32_t * codes   = malloc(sizeof(*codes) * (len * 6 + 2));
+  bool     * down    = malloc(sizeof(*down ) * (len * 6 + 2));
+  size_t   * charEnd = malloc(sizeof(*charEnd) * (len + 1));
+  if (!codes || !down || !charEnd)
+    goto fail;
+
+  // modifiers are only pressed and released when they change between
+  // characters so runs of capitals don't toggle shift for each one
+  const struct SpiceTypingMod * mods = spice_typing_mods;
+
+  uint32_t held    = 0;
+  size_t   strokes = 0;
+  size_t   chars   = 0;
+  while(*text)
+  {
+    uint32_t cp;
+    if (!(text = utf8_decode(text, &cp)))
+      goto fail;
+
+    // type CRLF as a single enter
+    if (cp == '\r' && *text == '\n')
+      continue;
+
+    const SpiceKeyMap * key = spice_layout_find(layout, cp == '\r' ? '\n' : cp);
+    if (!key)
+      goto fail;
+
+    for(size_t i = 0; i < SPICE_TYPING_MOD_COUNT; ++i)
+      if ((key->modifiers ^ held) & mods[i].mod)
+      {
+        codes[strokes] = mods[i].code;
+        down [strokes] = key->modifiers & mods[i].mod;
+        ++strokes;
+      }
+    held = key->modifiers;
+
+    codes[strokes] = key->scancode; down[strokes++] = true;
+    codes[strokes] = key->scancode; down[strokes++] = false;
+    charEnd[chars++] = strokes;
+  }
+
+  for(size_t i = 0; i < SPICE_TYPING_MOD_COUNT; ++i)
+    if (held & mods[i].mod)
+    {
+      codes[strokes] = mods[i].code;
+      down [strokes] = false;
+      ++strokes;
+    }
+
+  if (chars == 0)
+    goto fail;
+
+  // the final release of any modifiers belongs to the last character
+  charEnd[chars - 1] = strokes;
+
+  SPICE_LOCK(spice->typing.lock);
+  if (spice->typing.active)
+  {
+    SPICE_UNLOCK(spice->typing.lock);
+    goto fail;
+  }
+
+  spice->typing.codes   = codes;
+  spice->typing.down    = down;
+  spice->typing.charEnd = charEnd;
+  spice->typing.strokes = strokes;
+  spice->typing.sent    = 0;
+  spice->typing.total   = chars;
+  spice->typing.cps     = cps;
+  spice->typing.start   = get_timestamp();
+  spice->typing.held    = 0;
+  spice->typing.retry   = 0;
+  spice->typing.active  = true;
+  atomic_store(&spice->typing.typed, 0);
+  SPICE_UNLOCK(spice->typing.lock);
+
+  // start straight away rather than waiting for the reactor to time out
+  spice_wakeup();
+  return true;
+
+fail:
+  free(codes);
+  free(down);
+  free(charEnd);
+  return false;
+}
+
+// ============================================================================
+
+bool spice_type_cancel()
+{
+  SPICE_LOCK(spice->typing.lock);
+  if (!spice->typing.active)
+  {
+    SPICE_UNLOCK(spice->typing.lock);
+    return false;
+  }
+
+  /* don't leave a modifier stuck down if we stopped part way through, only
+   * those typing pressed are released as the user may be holding the others */
+  uint32_t codes[SPICE_TYPING_MOD_COUNT];
+  bool     down [SPICE_TYPING_MOD_COUNT];
+  size_t   count = 0;
+  for(size_t i = 0; i < SPICE_TYPING_MOD_COUNT; ++i)
+    if (spice->typing.held & spice_typing_mods[i].mod)
+    {
+      codes[count] = spice_typing_mods[i].code;
+      down [count] = false;
+      ++count;
+    }
+
+  if (count)
+    spice_key_scancodes(codes, count, down);
+
+  spice_typing_reset_nl();
+  SPICE_UNLOCK(spice->typing.lock);
+
+  // outside of the lock as the callback may start typing something else
+  spice_event(SPICE_EVENT_TYPING_DONE, SPICE_DATA_NONE, NULL, false);
+  return true;
+}
+
+// ============================================================================
+
+bool spice_type_progress(size_t * typed, size_t * total)
+{
+  SPICE_LOCK(spice->typing.lock);
+  const bool active = spice->typing.active;
+  if (typed)
+    *typed = atomic_load(&spice->typing.typed);
+  if (total)
+    *total = spice->typing.total;
+  SPICE_UNLOCK(spice->typing.lock);
+
+  return active;
+}
+
+// ============================================================================
+
+void spice_typing_reset_nl()
+{
+  free(spice->typing.codes);
+  free(spice->typing.down);
+  free(spice->typing.charEnd);
+  spice->typing.codes   = NULL;
+  spice->typing.down    = NULL;
+  spice->typing.charEnd = NULL;
+  spice->typing.active  = false;
+}
+
+// ============================================================================
+
+int spice_typing_timeout(int timeout)
+{
+  // this is only a hint and runs on the same thread as spice_typing_process,
+  // the lock is not needed
+  if (!spice->typing.active)
+    return timeout;
+
+  // the input queue is full, wait for it to drain rather than spinning
+  uint64_t next;
+  if (spice->typing.retry)
+    next = spice->typing.retry;
+  else if (spice->typing.cps == 0)
+    return 0;
+  else
+    next = spice->typing.start +
+      (atomic_load(&spice->typing.typed) * 1000ULL) / spice->typing.cps;
+
+  const uint64_t now  = get_timestamp();
+  const int      wait = next > now ? (int)(next - now) : 0;
+
+  return (timeout < 0 || wait < timeout) ? wait : timeout;
+}
+
+// ============================================================================
+
+void spice_typing_process()
+{
+  if (!spice->typing.active || !SPICE_TRYLOCK(spice->typing.lock))
+    return;
+
+  if (!spice->typing.active)
+  {
+    SPICE_UNLOCK(spice->typing.lock);
+    return;
+  }
+
+  // work out how many characters should have been typed by now and send
+  // everything up to there in one go
+  size_t due = spice->typing.total;
+  if (spice->typing.cps)
+  {
+    const uint64_t elapsed = get_timestamp() - spice->typing.start;
+    due = elapsed * spice->typing.cps / 1000 + 1;
+    if (due > spice->typing.total)
+      due = spice->typing.total;
+  }
+
+  size_t typed = atomic_load(&spice->typing.typed);
+  if (due > typed)
+  {
+    // push in runs the input queue takes atomically, if it fills up the
+    // rest is retried on the next pass
+    const size_t end = spice->typing.charEnd[due - 1];
+    spice->typing.retry = 0;
+    while(spice->typing.sent < end)
+    {
+      const size_t n = end - spice->typing.sent > 64 ?
+        64 : end - spice->typing.sent;
+
+      const uint32_t * codes = spice->typing.codes + spice->typing.sent;
+      const bool     * down  = spice->typing.down  + spice->typing.sent;
+      if (!spice_key_scancodes(codes, n, down))
+      {
+        spice->typing.retry = get_timestamp() + SPICE_TYPING_RETRY;
+        break;
+      }
+
+      // track the modifiers that are down so a cancel can release them
+      for(size_t i = 0; i < n; ++i)
+        for(size_t m = 0; m < SPICE_TYPING_MOD_COUNT; ++m)
+          if (codes[i] == spice_typing_mods[m].code)
+          {
+            if (down[i])
+              spice->typing.held |=  spice_typing_mods[m].mod;
+            else
+              spice->typing.held &= ~spice_typing_mods[m].mod;
+          }
+
+      spice->typing.sent += n;
+    }
+
+    while(typed < due && spice->typing.charEnd[typed] <= spice->typing.sent)
+      ++typed;
+    atomic_store(&spice->typing.typed, typed);
+  }
+
+  const bool done = atomic_load(&spice->typing.typed) == spice->typing.total;
+  if (done)
+    spice_typing_reset_nl();
+  SPICE_UNLOCK(spice->typing.lock);
+
+  // outside of the lock as the callback may start typing something else
+  if (done)
+    spice_event(SPICE_EVENT_TYPING_DONE, SPICE_DATA_NONE, NULL, true);
+}
+
+// ============================================================================
+
+bool spice_input_begin()
+{
+  if (!spice->scInputs.connected)
+    return false;
+
+  SPICE_LOCK(spice->scInputs.lock);
+  spice->scInputs.txCork = true;
+  SPICE_UNLOCK(spice->scInputs.lock);
+  return true;
+}
+
+// ============================================================================
+
+bool spice_input_flush()
+{
+  if (!spice->scInputs.connected)
+    return false;
+
+  SPICE_LOCK(spice->scInputs.lock);
+  spice->scInputs.txCork = false;
+  const SPICE_STATUS status = spice_flush_nl(&spice->scInputs);
+  SPICE_UNLOCK(spice->scInputs.lock);
+
+  return status != SPICE_STATUS_ERROR;
+}
+
+// ============================================================================
+
+bool spice_mouse_mode(bool server)
+{
+  if (!spice->scMain.connected)
+    return false;
+
+  SpiceMsgcMainMouseModeRequest * msg = SPICE_PACKET(
+    SPICE_MSGC_MAIN_MOUSE_MODE_REQUEST,
+    SpiceMsgcMainMouseModeRequest, 0);
+
+  msg->mouse_mode = server ? SPICE_MOUSE_MODE_SERVER : SPICE_MOUSE_MODE_CLIENT;
+  return SPICE_SEND_PACKET(&spice->scMain, msg);
+}
+
+// ============================================================================
+
+bool spice_mouse_position(uint32_t x, uint32_t y)
+{
+  return spice_mouse_display_position(0, x, y);
+}
+
+// ============================================================================
+
+bool spice_mouse_display_position(uint8_t display, uint32_t x, uint32_t y)
+{
+  if (display >= SPICE_MAX_DISPLAYS)
+    return false;
+
+  const struct SpiceInput input =
+  {
+    .type = SPICE_INPUT_MOUSE_POSITION,
+    .code = display,
+    .x    = x,
+    .y    = y
+  };
+
+  return spice_input_push(&input);
+}
+
+// ============================================================================
+
+bool spice_mouse_motion(int32_t x, int32_t y)
+{
+  const struct SpiceInput input =
+  {
+    .type = SPICE_INPUT_MOUSE_MOTION,
+    .x    = x,
+    .y    = y
+  };
+
+  return spice_input_push(&input);
+}
+
+// ============================================================================
+
+bool spice_mouse_wheel(int32_t dx, int32_t dy)
+{
+  // SPICE only has buttons for the vertical wheel so dx can't be sent
+  if (dy == 0)
+    return true;
+
+  const struct SpiceInput input =
+  {
+    .type = SPICE_INPUT_MOUSE_WHEEL,
+    .x    = dx,
+    .y    = dy
+  };
+
+  return spice_input_push(&input);
+}
+
+// ============================================================================
+
+void spice_set_motion_window(unsigned int window)
+{
+  // the server only acks every SPICE_INPUT_MOTION_ACK_BUNCH messages, any
+  // smaller window would stall waiting for an ack that never comes
+  if (window && window < SPICE_INPUT_MOTION_ACK_BUNCH)
+    window = SPICE_INPUT_MOTION_ACK_BUNCH;
+
+  atomic_store(&spice->mouse.window, window);
+
+  // flush anything held back if the window was widened or disabled
+  spice_input_kick();
+}
+
+// ============================================================================
+
+bool spice_mouse_press(uint32_t button)
+{
+  const struct SpiceInput input =
+  {
+    .type = SPICE_INPUT_MOUSE_PRESS,
+    .code = button
+  };
+
+  return spice_input_push(&input);
+}
+
+// ============================================================================
+
+bool spice_mouse_release(uint32_t button)
+{
+  const struct SpiceInput input =
+  {
+    .type = SPICE_INPUT_MOUSE_RELEASE,
+    .code = button
+  };
+
+  return spice_input_push(&input);
+}
+
+// ============================================================================
+
+static uint32_t spice_type_to_agent_type(SpiceDataType type)
+{
+  switch(type)
+  {
+    case SPICE_DATA_TEXT: return VD_AGENT_CLIPBOARD_UTF8_TEXT ; break;
+    case SPICE_DATA_PNG : return VD_AGENT_CLIPBOARD_IMAGE_PNG ; break;
+    case SPICE_DATA_BMP : return VD_AGENT_CLIPBOARD_IMAGE_BMP ; break;
+    case SPICE_DATA_TIFF: return VD_AGENT_CLIPBOARD_IMAGE_TIFF; break;
+    case SPICE_DATA_JPEG: return VD_AGENT_CLIPBOARD_IMAGE_JPG ; break;
+    default:
+      return VD_AGENT_CLIPBOARD_NONE;
+  }
+}
+
+static SpiceDataType agent_type_to_spice_type(uint32_t type)
+{
+  switch(type)
+  {
+    case VD_AGENT_CLIPBOARD_UTF8_TEXT : return SPICE_DATA_TEXT; break;
+    case VD_AGENT_CLIPBOARD_IMAGE_PNG : return SPICE_DATA_PNG ; break;
+    case VD_AGENT_CLIPBOARD_IMAGE_BMP : return SPICE_DATA_BMP ; break;
+    case VD_AGENT_CLIPBOARD_IMAGE_TIFF: return SPICE_DATA_TIFF; break;
+    case VD_AGENT_CLIPBOARD_IMAGE_JPG : return SPICE_DATA_JPEG; break;
+    default:
+      return SPICE_DATA_NONE;
+  }
+}
+
+// ============================================================================
+
+bool spice_clipboard_request(SpiceDataType type)
+{
+  VDAgentClipboardRequest req;
+
+  if (!spice->cbAgentGrabbed)
+    return false;
+
+  if (type != spice->cbType)
+    return false;
+
+  req.type = spice_type_to_agent_type(type);
+  if (!spice_agent_start_msg(VD_AGENT_CLIPBOARD_REQUEST, sizeof(req)) ||
+      !spice_agent_write_msg(&req, sizeof(req)))
+    return false;
+
+  return true;
+}
+
+// ============================================================================
+
+bool spice_set_typing_cb(SpiceTypingDone cbDoneFn)
+{
+  spice->typingDoneFn = cbDoneFn;
+  return true;
+}
+
+// ============================================================================
+
+bool spice_set_ready_cb(SpiceReady cbReadyFn)
+{
+  spice->readyFn = cbReadyFn;
+  return true;
+}
+
+// ============================================================================
+
+bool spice_set_clipboard_cb(SpiceClipboardNotice cbNoticeFn, SpiceClipboardData cbDataFn, SpiceClipboardRelease cbReleaseFn, SpiceClipboardRequest cbRequestFn)
+{
+  if ((cbNoticeFn && !cbDataFn) || (cbDataFn && !cbNoticeFn))
+    return false;
+
+  spice->cbNoticeFn  = cbNoticeFn;
+  spice->cbDataFn    = cbDataFn;
+  spice->cbReleaseFn = cbReleaseFn;
+  spice->cbRequestFn = cbRequestFn;
+
+  return true;
+}
+
+// ============================================================================
+
+bool spice_clipboard_grab(SpiceDataType type)
+{
+  if (type == SPICE_DATA_NONE)
+    return false;
+
+  if (spice->cbSelection)
+  {
+    uint8_t req[8] = { VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD };
+    ((uint32_t*)req)[1] = spice_type_to_agent_type(type);
+
+    if (!spice_agent_start_msg(VD_AGENT_CLIPBOARD_GRAB, sizeof(req)) ||
+        !spice_agent_write_msg(req, sizeof(req)))
+      return false;
+
+    spice->cbClientGrabbed = true;
+    return true;
+  }
+
+  uint32_t req = spice_type_to_agent_type(type);
+  if (!spice_agent_start_msg(VD_AGENT_CLIPBOARD_GRAB, sizeof(req)) ||
+      !spice_agent_write_msg(&req, sizeof(req)))
+    return false;
+
+  spice->cbClientGrabbed = true;
+  return true;
+}
+
+// ============================================================================
+
+bool spice_clipboard_release()
+{
+  // check if if there is anything to release first
+  if (!spice->cbClientGrabbed)
+    return true;
+
+  if (spice->cbSelection)
+  {
+    uint8_t req[4] = { VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD };
+    if (!spice_agent_start_msg(VD_AGENT_CLIPBOARD_RELEASE, sizeof(req)) ||
+        !spice_agent_write_msg(req, sizeof(req)))
+      return false;
+
+    spice->cbClientGrabbed = false;
+    return true;
+  }
+
+   if (!spice_agent_start_msg(VD_AGENT_CLIPBOARD_RELEASE, 0))
+     return false;
+
+   spice->cbClientGrabbed = false;
+   return true;
+}
+
+// ============================================================================
+
+bool spice_clipboard_data_start(SpiceDataType type, size_t size)
+{
+  uint8_t buffer[8];
+  size_t  bufSize;
+
+  if (spice->cbSelection)
+  {
+    bufSize                = 8;
+    buffer[0]              = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+    buffer[1]              = buffer[2] = buffer[3] = 0;
+    ((uint32_t*)buffer)[1] = spice_type_to_agent_type(type);
+  }
+  else
+  {
+    bufSize                = 4;
+    ((uint32_t*)buffer)[0] = spice_type_to_agent_type(type);
   }
 
-  if (size == 0)
-    SPICE_UNLOCK(spice.scMain.lock);
-
-  return true;
+  return spice_agent_start_msg(VD_AGENT_CLIPBOARD, bufSize + size) &&
+    spice_agent_write_msg(buffer, bufSize);
 }
 
 // ============================================================================
 
-bool spice_agent_write_msg(const void * buffer, ssize_t size)
+bool spice_clipboard_data(SpiceDataType type, uint8_t * data, size_t size)
 {
-  assert(size <= spice.agentMsg);
+  return spice_agent_write_msg(data, size);
+}
 
-  while(size)
-  {
-    const ssize_t toWrite = size > VD_AGENT_MAX_DATA_SIZE ?
-      VD_AGENT_MAX_DATA_SIZE : size;
+// ============================================================================
 
-    void * p = SPICE_RAW_PACKET(SPICE_MSGC_MAIN_AGENT_DATA, 0, toWrite);
-    if (!SPICE_SEND_PACKET_NL(&spice.scMain, p))
-      goto err;
+SpiceCtx * spice_ctx_new()
+{
+  struct Spice * ctx = malloc(sizeof(*ctx));
+  if (!ctx)
+    return NULL;
+
+  static const struct Spice init = SPICE_CTX_INITIALIZER;
+  memcpy(ctx, &init, sizeof(*ctx));
+
+  // the channel locks last the session, they are not reset on reconnect
+  SPICE_LOCK_INIT(ctx->scMain      .lock);
+  SPICE_LOCK_INIT(ctx->scInputs    .lock);
+  SPICE_LOCK_INIT(ctx->mig.scMain  .lock);
+  SPICE_LOCK_INIT(ctx->mig.scInputs.lock);
+  SPICE_LOCK_INIT(ctx->agentLock);
+  return ctx;
+}
 
-    if (spice_write_nl(&spice.scMain, buffer, toWrite) != toWrite)
-      goto err;
+// ============================================================================
 
-    size           -= toWrite;
-    buffer         += toWrite;
-    spice.agentMsg -= toWrite;
-  }
+void spice_ctx_free(SpiceCtx * ctx)
+{
+  if (!ctx || ctx == &spiceDefault)
+    return;
 
-  if (!spice.agentMsg)
-    SPICE_UNLOCK(spice.scMain.lock);
+  struct Spice * prev = spice;
+  spice = ctx;
+
+  spice_stop_io_thread();
+
+  // the session may be dropped without waiting for it to shut down
+  spice_resolve_abort();
+  spice_migrate_abort();
+  spice_close_channel(&spice->scInputs);
+  spice_close_channel(&spice->scMain  );
+
+  spice_rsa_free_key(spice->rsaKey);
+#if defined(USE_TLS)
+  spice_tls_reset();
+#endif
+  free(spice->inputBacklog);
+  free(spice->cbBuffer);
+  free(spice->typing.codes);
+  free(spice->typing.down);
+  free(spice->typing.charEnd);
+
+#if defined(USE_IO_URING)
+  if (spice->ringInit)
+    io_uring_queue_exit(&spice->ring);
+#else
+  if (spice->epollfd >= 0)
+    close(spice->epollfd);
+#endif
+
+  if (spice->eventfd >= 0)
+    close(spice->eventfd);
+
+  spice = prev;
+  free(ctx);
+}
 
-  return true;
+// ============================================================================
 
-err:
-  SPICE_UNLOCK(spice.scMain.lock);
-  return false;
+SpiceCtx * spice_ctx_current()
+{
+  return spice;
 }
 
 // ============================================================================
 
-ssize_t spice_write_nl(const struct SpiceChannel * channel, const void * buffer, const ssize_t size)
+void spice_ctx_set_user(SpiceCtx * ctx, void * user)
 {
-  if (!channel->connected)
-    return -1;
+  ctx->user = user;
+}
 
-  if (!buffer)
-    return -1;
+// ============================================================================
 
-  return send(channel->socket, buffer, size, 0);
+void * spice_ctx_get_user(SpiceCtx * ctx)
+{
+  return ctx->user;
 }
 
 // ============================================================================
 
-SPICE_STATUS spice_read_nl(struct SpiceChannel * channel, void * buffer, const ssize_t size, int * dataAvailable)
+static int spice_ctx_wait(int timeout)
 {
-  if (!channel->connected)
-    return SPICE_STATUS_ERROR;
+#if defined(USE_IO_URING)
+  // nothing completes on the ring until spice_reactor_wait arms the receives
+  if (!spice->ioRunning &&
+      (SPICE_URING_UNARMED(&spice->scMain) ||
+       SPICE_URING_UNARMED(&spice->scInputs)))
+    return 0;
+#endif
+
+  return spice_process_timeout(timeout);
+}
 
-  if (!buffer)
-    return SPICE_STATUS_ERROR;
+// ============================================================================
 
-  size_t    left = size;
-  uint8_t * buf  = (uint8_t *)buffer;
-  while(left)
+bool spice_ctx_process_all(SpiceCtx * const * ctx, bool * connected,
+    size_t count, int timeout)
+{
+  struct pollfd   stackFds[16];
+  struct pollfd * fds = stackFds;
+  if (count > sizeof(stackFds) / sizeof(*stackFds))
   {
-    ssize_t len = read(channel->socket, buf, left);
-    if (len == 0)
-      return SPICE_STATUS_NODATA;
+    fds = malloc(count * sizeof(*fds));
+    if (!fds)
+      return false;
+  }
 
-    if (len < 0)
-    {
-      channel->connected = false;
-      return SPICE_STATUS_ERROR;
-    }
-    left -= len;
-    buf  += len;
+  /* every session's reactor fd is polled together and only the sessions with
+   * something to do are processed, so an idle session costs nothing more
+   * than its pollfd */
+  for(size_t i = 0; i < count; ++i)
+  {
+    const int wait = SPICE_CTX_CALL(ctx[i], spice_ctx_wait(timeout));
+    if (wait >= 0 && (timeout < 0 || wait < timeout))
+      timeout = wait;
 
-    if (dataAvailable)
-      *dataAvailable -= len;
+    connected[i]  = true;
+    fds[i].fd     = SPICE_CTX_CALL(ctx[i], spice_get_fd());
+    fds[i].events = POLLIN;
   }
 
-  return SPICE_STATUS_OK;
+  bool ret = poll(fds, count, timeout) >= 0 || errno == EINTR;
+  for(size_t i = 0; ret && i < count; ++i)
+  {
+    if (!(fds[i].revents & POLLIN) &&
+        SPICE_CTX_CALL(ctx[i], spice_ctx_wait(-1)) != 0)
+      continue;
+
+    connected[i] = SPICE_CTX_CALL(ctx[i], spice_process(0));
+  }
+
+  if (fds != stackFds)
+    free(fds);
+
+  return ret;
 }
 
 // ============================================================================
 
-SPICE_STATUS spice_discard_nl(struct SpiceChannel * channel, ssize_t size, int * dataAvailable)
+bool spice_ctx_connect(SpiceCtx * ctx, const char * host,
+    const unsigned short port, const char * password)
 {
-  uint8_t c[1024];
-  ssize_t left = size;
-  while(left)
-  {
-    size_t len = read(channel->socket, c, left > sizeof(c) ? sizeof(c) : left);
-    if (len == 0)
-      return SPICE_STATUS_NODATA;
+  return SPICE_CTX_CALL(ctx, spice_connect(host, port, password));
+}
 
-    if (len < 0)
-    {
-      channel->connected = false;
-      return SPICE_STATUS_ERROR;
-    }
+// ============================================================================
 
-    left -= len;
+void spice_ctx_disconnect(SpiceCtx * ctx)
+{
+  SPICE_CTX_CALL_VOID(ctx, spice_disconnect());
+}
 
-    if (dataAvailable)
-      *dataAvailable -= len;
-  }
+// ============================================================================
 
-  return SPICE_STATUS_OK;
+bool spice_ctx_process(SpiceCtx * ctx, int timeout)
+{
+  return SPICE_CTX_CALL(ctx, spice_process(timeout));
 }
 
 // ============================================================================
 
-bool spice_key_down(uint32_t code)
+bool spice_ctx_ready(SpiceCtx * ctx)
 {
-  if (!spice.scInputs.connected)
-    return false;
+  return SPICE_CTX_CALL(ctx, spice_ready());
+}
 
-  if (code > 0x100)
-    code = 0xe0 | ((code - 0x100) << 8);
+// ============================================================================
 
-  SpiceMsgcKeyDown * msg =
-    SPICE_PACKET(SPICE_MSGC_INPUTS_KEY_DOWN, SpiceMsgcKeyDown, 0);
-  msg->code = code;
-  return SPICE_SEND_PACKET(&spice.scInputs, msg);
+bool spice_ctx_set_reconnect(SpiceCtx * ctx, int attempts,
+    unsigned int minDelay, unsigned int maxDelay)
+{
+  return SPICE_CTX_CALL(ctx, spice_set_reconnect(attempts, minDelay, maxDelay));
 }
 
 // ============================================================================
 
-bool spice_key_up(uint32_t code)
+bool spice_ctx_set_liveness(SpiceCtx * ctx, unsigned int deadline,
+    SpiceChannelDead cbDeadFn)
 {
-  if (!spice.scInputs.connected)
-    return false;
+  return SPICE_CTX_CALL(ctx, spice_set_liveness(deadline, cbDeadFn));
+}
 
-  if (code < 0x100)
-    code |= 0x80;
-  else
-    code = 0x80e0 | ((code - 0x100) << 8);
+// ============================================================================
 
-  SpiceMsgcKeyUp * msg =
-    SPICE_PACKET(SPICE_MSGC_INPUTS_KEY_UP, SpiceMsgcKeyUp, 0);
-  msg->code = code;
-  return SPICE_SEND_PACKET(&spice.scInputs, msg);
+bool spice_ctx_set_tls(SpiceCtx * ctx, bool enable, const char * caFile,
+    bool verify)
+{
+  return SPICE_CTX_CALL(ctx, spice_set_tls(enable, caFile, verify));
 }
 
 // ============================================================================
 
-bool spice_mouse_mode(bool server)
+int spice_ctx_get_fd(SpiceCtx * ctx)
 {
-  if (!spice.scMain.connected)
-    return false;
+  return SPICE_CTX_CALL(ctx, spice_get_fd());
+}
 
-  SpiceMsgcMainMouseModeRequest * msg = SPICE_PACKET(
-    SPICE_MSGC_MAIN_MOUSE_MODE_REQUEST,
-    SpiceMsgcMainMouseModeRequest, 0);
+// ============================================================================
 
-  msg->mouse_mode = server ? SPICE_MOUSE_MODE_SERVER : SPICE_MOUSE_MODE_CLIENT;
-  return SPICE_SEND_PACKET(&spice.scMain, msg);
+bool spice_ctx_wakeup(SpiceCtx * ctx)
+{
+  return SPICE_CTX_CALL(ctx, spice_wakeup());
 }
 
 // ============================================================================
 
-bool spice_mouse_position(uint32_t x, uint32_t y)
+size_t spice_ctx_get_queued(SpiceCtx * ctx, SpiceChannelKind kind)
 {
-  if (!spice.scInputs.connected)
-    return false;
+  return SPICE_CTX_CALL(ctx, spice_get_queued(kind));
+}
 
-  SpiceMsgcMousePosition * msg =
-    SPICE_PACKET(SPICE_MSGC_INPUTS_MOUSE_POSITION, SpiceMsgcMousePosition, 0);
+// ============================================================================
 
-  msg->display_id   = 0;
-  msg->button_state = spice.mouse.buttonState;
-  msg->x            = x;
-  msg->y            = y;
+bool spice_ctx_get_lock_stats(SpiceCtx * ctx, SpiceChannelKind kind,
+    SpiceLockStats * stats)
+{
+  return SPICE_CTX_CALL(ctx, spice_get_lock_stats(kind, stats));
+}
 
-  atomic_fetch_add(&spice.mouse.sentCount, 1);
-  if (!SPICE_SEND_PACKET(&spice.scInputs, msg))
-    return false;
+// ============================================================================
 
-  return true;
+bool spice_ctx_start_io_thread(SpiceCtx * ctx, int cpu, int priority)
+{
+  return SPICE_CTX_CALL(ctx, spice_start_io_thread(cpu, priority));
 }
 
 // ============================================================================
 
-bool spice_mouse_motion(int32_t x, int32_t y)
+void spice_ctx_stop_io_thread(SpiceCtx * ctx)
 {
-  if (!spice.scInputs.connected)
-    return false;
-
-  /* while the protocol supports movements greater then +-127 the QEMU
-   * virtio-mouse device does not, so we need to split this up into seperate
-   * messages. For performance we build this as a single buffer otherwise this
-   * will be split into multiple packets */
+  SPICE_CTX_CALL_VOID(ctx, spice_stop_io_thread());
+}
 
-  const unsigned delta = abs(x) > abs(y) ? abs(x) : abs(y);
-  const unsigned msgs  = (delta + 126) / 127;
-  const ssize_t bufferSize = (
-    sizeof(SpiceMiniDataHeader ) +
-    sizeof(SpiceMsgcMouseMotion)
-  ) * msgs;
+// ============================================================================
 
-  if (bufferSize > spice.motionBufferSize)
-  {
-    if (spice.motionBuffer)
-      free(spice.motionBuffer);
-    spice.motionBuffer     = malloc(bufferSize);
-    spice.motionBufferSize = bufferSize;
-  }
+bool spice_ctx_input_begin(SpiceCtx * ctx)
+{
+  return SPICE_CTX_CALL(ctx, spice_input_begin());
+}
 
-  uint8_t * buffer = spice.motionBuffer;
-  uint8_t * msg    = buffer;
+// ============================================================================
 
-  while(x != 0 || y != 0)
-  {
-    SpiceMiniDataHeader  *h = (SpiceMiniDataHeader  *)msg;
-    SpiceMsgcMouseMotion *m = (SpiceMsgcMouseMotion *)(h + 1);
-    msg = (uint8_t*)(m + 1);
+bool spice_ctx_input_flush(SpiceCtx * ctx)
+{
+  return SPICE_CTX_CALL(ctx, spice_input_flush());
+}
 
-    h->size = sizeof(SpiceMsgcMouseMotion);
-    h->type = SPICE_MSGC_INPUTS_MOUSE_MOTION;
+// ============================================================================
 
-    m->x = x > 127 ? 127 : (x < -127 ? -127 : x);
-    m->y = y > 127 ? 127 : (y < -127 ? -127 : y);
-    m->button_state = spice.mouse.buttonState;
+bool spice_ctx_key_down(SpiceCtx * ctx, uint32_t code)
+{
+  return SPICE_CTX_CALL(ctx, spice_key_down(code));
+}
 
-    x -= m->x;
-    y -= m->y;
-  }
+// ============================================================================
 
-  atomic_fetch_add(&spice.mouse.sentCount, msgs);
+bool spice_ctx_key_up(SpiceCtx * ctx, uint32_t code)
+{
+  return SPICE_CTX_CALL(ctx, spice_key_up(code));
+}
 
-  SPICE_LOCK(spice.scInputs.lock);
-  const ssize_t wrote = send(spice.scInputs.socket, buffer, bufferSize, 0);
-  SPICE_UNLOCK(spice.scInputs.lock);
+// ============================================================================
 
-  return wrote == bufferSize;
+bool spice_ctx_key_down_evdev(SpiceCtx * ctx, uint32_t code)
+{
+  return SPICE_CTX_CALL(ctx, spice_key_down_evdev(code));
 }
 
 // ============================================================================
 
-bool spice_mouse_press(uint32_t button)
+bool spice_ctx_key_up_evdev(SpiceCtx * ctx, uint32_t code)
 {
-  if (!spice.scInputs.connected)
-    return false;
+  return SPICE_CTX_CALL(ctx, spice_key_up_evdev(code));
+}
 
-  switch(button)
-  {
-    case SPICE_MOUSE_BUTTON_LEFT   : spice.mouse.buttonState |= SPICE_MOUSE_BUTTON_MASK_LEFT   ; break;
-    case SPICE_MOUSE_BUTTON_MIDDLE : spice.mouse.buttonState |= SPICE_MOUSE_BUTTON_MASK_MIDDLE ; break;
-    case SPICE_MOUSE_BUTTON_RIGHT  : spice.mouse.buttonState |= SPICE_MOUSE_BUTTON_MASK_RIGHT  ; break;
-    case _SPICE_MOUSE_BUTTON_SIDE  : spice.mouse.buttonState |= _SPICE_MOUSE_BUTTON_MASK_SIDE  ; break;
-    case _SPICE_MOUSE_BUTTON_EXTRA : spice.mouse.buttonState |= _SPICE_MOUSE_BUTTON_MASK_EXTRA ; break;
-  }
+// ============================================================================
 
-  SpiceMsgcMousePress * msg =
-    SPICE_PACKET(SPICE_MSGC_INPUTS_MOUSE_PRESS, SpiceMsgcMousePress, 0);
+bool spice_ctx_key_down_hid(SpiceCtx * ctx, uint32_t usage)
+{
+  return SPICE_CTX_CALL(ctx, spice_key_down_hid(usage));
+}
 
-  msg->button       = button;
-  msg->button_state = spice.mouse.buttonState;
+// ============================================================================
 
-  return SPICE_SEND_PACKET(&spice.scInputs, msg);
+bool spice_ctx_key_up_hid(SpiceCtx * ctx, uint32_t usage)
+{
+  return SPICE_CTX_CALL(ctx, spice_key_up_hid(usage));
 }
 
 // ============================================================================
 
-bool spice_mouse_release(uint32_t button)
+bool spice_ctx_key_scancodes(SpiceCtx * ctx, const uint32_t * codes,
+    size_t count, const bool * down)
 {
-  if (!spice.scInputs.connected)
-    return false;
+  return SPICE_CTX_CALL(ctx, spice_key_scancodes(codes, count, down));
+}
 
-  switch(button)
-  {
-    case SPICE_MOUSE_BUTTON_LEFT   : spice.mouse.buttonState &= ~SPICE_MOUSE_BUTTON_MASK_LEFT   ; break;
-    case SPICE_MOUSE_BUTTON_MIDDLE : spice.mouse.buttonState &= ~SPICE_MOUSE_BUTTON_MASK_MIDDLE ; break;
-    case SPICE_MOUSE_BUTTON_RIGHT  : spice.mouse.buttonState &= ~SPICE_MOUSE_BUTTON_MASK_RIGHT  ; break;
-    case _SPICE_MOUSE_BUTTON_SIDE  : spice.mouse.buttonState &= ~_SPICE_MOUSE_BUTTON_MASK_SIDE  ; break;
-    case _SPICE_MOUSE_BUTTON_EXTRA : spice.mouse.buttonState &= ~_SPICE_MOUSE_BUTTON_MASK_EXTRA ; break;
-  }
+// ============================================================================
 
-  SpiceMsgcMouseRelease * msg =
-    SPICE_PACKET(SPICE_MSGC_INPUTS_MOUSE_RELEASE, SpiceMsgcMouseRelease, 0);
+bool spice_ctx_type_text(SpiceCtx * ctx, const char * text,
+    const SpiceKeyLayout * layout, unsigned int cps)
+{
+  return SPICE_CTX_CALL(ctx, spice_type_text(text, layout, cps));
+}
 
-  msg->button       = button;
-  msg->button_state = spice.mouse.buttonState;
+// ============================================================================
 
-  return SPICE_SEND_PACKET(&spice.scInputs, msg);
+bool spice_ctx_type_cancel(SpiceCtx * ctx)
+{
+  return SPICE_CTX_CALL(ctx, spice_type_cancel());
 }
 
 // ============================================================================
 
-static uint32_t spice_type_to_agent_type(SpiceDataType type)
+bool spice_ctx_type_progress(SpiceCtx * ctx, size_t * typed, size_t * total)
 {
-  switch(type)
-  {
-    case SPICE_DATA_TEXT: return VD_AGENT_CLIPBOARD_UTF8_TEXT ; break;
-    case SPICE_DATA_PNG : return VD_AGENT_CLIPBOARD_IMAGE_PNG ; break;
-    case SPICE_DATA_BMP : return VD_AGENT_CLIPBOARD_IMAGE_BMP ; break;
-    case SPICE_DATA_TIFF: return VD_AGENT_CLIPBOARD_IMAGE_TIFF; break;
-    case SPICE_DATA_JPEG: return VD_AGENT_CLIPBOARD_IMAGE_JPG ; break;
-    default:
-      return VD_AGENT_CLIPBOARD_NONE;
-  }
+  return SPICE_CTX_CALL(ctx, spice_type_progress(typed, total));
 }
 
-static SpiceDataType agent_type_to_spice_type(uint32_t type)
+// ============================================================================
+
+bool spice_ctx_mouse_mode(SpiceCtx * ctx, bool server)
 {
-  switch(type)
-  {
-    case VD_AGENT_CLIPBOARD_UTF8_TEXT : return SPICE_DATA_TEXT; break;
-    case VD_AGENT_CLIPBOARD_IMAGE_PNG : return SPICE_DATA_PNG ; break;
-    case VD_AGENT_CLIPBOARD_IMAGE_BMP : return SPICE_DATA_BMP ; break;
-    case VD_AGENT_CLIPBOARD_IMAGE_TIFF: return SPICE_DATA_TIFF; break;
-    case VD_AGENT_CLIPBOARD_IMAGE_JPG : return SPICE_DATA_JPEG; break;
-    default:
-      return SPICE_DATA_NONE;
-  }
+  return SPICE_CTX_CALL(ctx, spice_mouse_mode(server));
 }
 
 // ============================================================================
 
-bool spice_clipboard_request(SpiceDataType type)
+bool spice_ctx_mouse_position(SpiceCtx * ctx, uint32_t x, uint32_t y)
 {
-  VDAgentClipboardRequest req;
+  return SPICE_CTX_CALL(ctx, spice_mouse_position(x, y));
+}
 
-  if (!spice.cbAgentGrabbed)
-    return false;
+// ============================================================================
 
-  if (type != spice.cbType)
-    return false;
+bool spice_ctx_mouse_display_position(SpiceCtx * ctx, uint8_t display,
+    uint32_t x, uint32_t y)
+{
+  return SPICE_CTX_CALL(ctx, spice_mouse_display_position(display, x, y));
+}
 
-  req.type = spice_type_to_agent_type(type);
-  if (!spice_agent_start_msg(VD_AGENT_CLIPBOARD_REQUEST, sizeof(req)) ||
-      !spice_agent_write_msg(&req, sizeof(req)))
-    return false;
+// ============================================================================
 
-  return true;
+bool spice_ctx_mouse_motion(SpiceCtx * ctx, int32_t x, int32_t y)
+{
+  return SPICE_CTX_CALL(ctx, spice_mouse_motion(x, y));
 }
 
 // ============================================================================
 
-bool spice_set_clipboard_cb(SpiceClipboardNotice cbNoticeFn, SpiceClipboardData cbDataFn, SpiceClipboardRelease cbReleaseFn, SpiceClipboardRequest cbRequestFn)
+bool spice_ctx_mouse_wheel(SpiceCtx * ctx, int32_t dx, int32_t dy)
 {
-  if ((cbNoticeFn && !cbDataFn) || (cbDataFn && !cbNoticeFn))
-    return false;
+  return SPICE_CTX_CALL(ctx, spice_mouse_wheel(dx, dy));
+}
 
-  spice.cbNoticeFn  = cbNoticeFn;
-  spice.cbDataFn    = cbDataFn;
-  spice.cbReleaseFn = cbReleaseFn;
-  spice.cbRequestFn = cbRequestFn;
+// ============================================================================
 
-  return true;
+void spice_ctx_set_motion_window(SpiceCtx * ctx, unsigned int window)
+{
+  SPICE_CTX_CALL_VOID(ctx, spice_set_motion_window(window));
 }
 
 // ============================================================================
 
-bool spice_clipboard_grab(SpiceDataType type)
+bool spice_ctx_mouse_press(SpiceCtx * ctx, uint32_t button)
 {
-  if (type == SPICE_DATA_NONE)
-    return false;
+  return SPICE_CTX_CALL(ctx, spice_mouse_press(button));
+}
 
-  if (spice.cbSelection)
-  {
-    uint8_t req[8] = { VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD };
-    ((uint32_t*)req)[1] = spice_type_to_agent_type(type);
+// ============================================================================
 
-    if (!spice_agent_start_msg(VD_AGENT_CLIPBOARD_GRAB, sizeof(req)) ||
-        !spice_agent_write_msg(req, sizeof(req)))
-      return false;
+bool spice_ctx_mouse_release(SpiceCtx * ctx, uint32_t button)
+{
+  return SPICE_CTX_CALL(ctx, spice_mouse_release(button));
+}
 
-    spice.cbClientGrabbed = true;
-    return true;
-  }
+// ============================================================================
 
-  uint32_t req = spice_type_to_agent_type(type);
-  if (!spice_agent_start_msg(VD_AGENT_CLIPBOARD_GRAB, sizeof(req)) ||
-      !spice_agent_write_msg(&req, sizeof(req)))
-    return false;
+bool spice_ctx_clipboard_request(SpiceCtx * ctx, SpiceDataType type)
+{
+  return SPICE_CTX_CALL(ctx, spice_clipboard_request(type));
+}
 
-  spice.cbClientGrabbed = true;
-  return true;
+// ============================================================================
+
+bool spice_ctx_clipboard_grab(SpiceCtx * ctx, SpiceDataType type)
+{
+  return SPICE_CTX_CALL(ctx, spice_clipboard_grab(type));
 }
 
 // ============================================================================
 
-bool spice_clipboard_release()
+bool spice_ctx_clipboard_release(SpiceCtx * ctx)
 {
-  // check if if there is anything to release first
-  if (!spice.cbClientGrabbed)
-    return true;
+  return SPICE_CTX_CALL(ctx, spice_clipboard_release());
+}
 
-  if (spice.cbSelection)
-  {
-    uint8_t req[4] = { VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD };
-    if (!spice_agent_start_msg(VD_AGENT_CLIPBOARD_RELEASE, sizeof(req)) ||
-        !spice_agent_write_msg(req, sizeof(req)))
-      return false;
+// ============================================================================
 
-    spice.cbClientGrabbed = false;
-    return true;
-  }
+bool spice_ctx_clipboard_data_start(SpiceCtx * ctx, SpiceDataType type, size_t size)
+{
+  return SPICE_CTX_CALL(ctx, spice_clipboard_data_start(type, size));
+}
 
-   if (!spice_agent_start_msg(VD_AGENT_CLIPBOARD_RELEASE, 0))
-     return false;
+// ============================================================================
 
-   spice.cbClientGrabbed = false;
-   return true;
+bool spice_ctx_clipboard_data(SpiceCtx * ctx, SpiceDataType type,
+    uint8_t * data, size_t size)
+{
+  return SPICE_CTX_CALL(ctx, spice_clipboard_data(type, data, size));
 }
 
 // ============================================================================
 
-bool spice_clipboard_data_start(SpiceDataType type, size_t size)
+bool spice_ctx_set_clipboard_cb(SpiceCtx * ctx, SpiceClipboardNotice cbNoticeFn,
+    SpiceClipboardData cbDataFn, SpiceClipboardRelease cbReleaseFn,
+    SpiceClipboardRequest cbRequestFn)
 {
-  uint8_t buffer[8];
-  size_t  bufSize;
+  return SPICE_CTX_CALL(ctx, spice_set_clipboard_cb(cbNoticeFn, cbDataFn,
+        cbReleaseFn, cbRequestFn));
+}
 
-  if (spice.cbSelection)
-  {
-    bufSize                = 8;
-    buffer[0]              = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
-    buffer[1]              = buffer[2] = buffer[3] = 0;
-    ((uint32_t*)buffer)[1] = spice_type_to_agent_type(type);
-  }
-  else
-  {
-    bufSize                = 4;
-    ((uint32_t*)buffer)[0] = spice_type_to_agent_type(type);
-  }
+// ============================================================================
 
-  return spice_agent_start_msg(VD_AGENT_CLIPBOARD, bufSize + size) &&
-    spice_agent_write_msg(buffer, bufSize);
+bool spice_ctx_set_typing_cb(SpiceCtx * ctx, SpiceTypingDone cbDoneFn)
+{
+  return SPICE_CTX_CALL(ctx, spice_set_typing_cb(cbDoneFn));
 }
 
 // ============================================================================
 
-bool spice_clipboard_data(SpiceDataType type, uint8_t * data, size_t size)
+bool spice_ctx_set_ready_cb(SpiceCtx * ctx, SpiceReady cbReadyFn)
 {
-  return spice_agent_write_msg(data, size);
+  return SPICE_CTX_CALL(ctx, spice_set_ready_cb(cbReadyFn));
 }
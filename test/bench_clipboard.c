@@ -0,0 +1,138 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* measures the rate at which clipboard data is pushed to the server stand-in,
+ * from the call to spice_clipboard_data_start until the server has read the
+ * last byte of it */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <spice/spice.h>
+#include "server.h"
+
+// the agent message header and the clipboard type that precede the data
+#define AGENT_OVERHEAD (20 + 4)
+
+static bool ready = false;
+
+static void on_ready()
+{
+  ready = true;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char * argv[])
+{
+  size_t size   = 40;
+  int    rounds = 5;
+
+  if (argc > 1)
+    size = atoi(argv[1]);
+  if (argc > 2)
+    rounds = atoi(argv[2]);
+
+  if (size == 0 || rounds <= 0)
+  {
+    printf("Usage: %s [MB] [rounds]\n", argv[0]);
+    return -1;
+  }
+  size *= 1024 * 1024;
+
+  int retval = 0;
+  uint8_t * data = malloc(size);
+  if (!data)
+    return -1;
+  memset(data, 'a', size);
+
+  TestServer * server = test_server_start();
+  if (!server)
+  {
+    printf("failed to start the server\n");
+    retval = -1;
+    goto err_data;
+  }
+
+  spice_set_ready_cb(on_ready);
+  if (!spice_connect("127.0.0.1", test_server_port(server), ""))
+  {
+    printf("spice connect failed\n");
+    retval = -1;
+    goto err_server;
+  }
+
+  while(!ready)
+    if (!spice_process(1000))
+    {
+      printf("failed to connect\n");
+      retval = -1;
+      goto err_server;
+    }
+
+  // let the agent start and capabilities go out before measuring
+  spice_process(100);
+
+  double total = 0.0;
+  for(int i = 0; i < rounds; ++i)
+  {
+    const size_t target =
+      test_server_agent_bytes(server) + AGENT_OVERHEAD + size;
+
+    const double start = now();
+    if (!spice_clipboard_data_start(SPICE_DATA_TEXT, size) ||
+        !spice_clipboard_data(SPICE_DATA_TEXT, data, size))
+    {
+      printf("failed to send the clipboard data\n");
+      retval = -1;
+      goto err_disconnect;
+    }
+
+    while(test_server_agent_bytes(server) < target)
+      if (!spice_process(1))
+      {
+        printf("the connection failed\n");
+        retval = -1;
+        goto err_disconnect;
+      }
+
+    const double elapsed = now() - start;
+    total += elapsed;
+    printf("round %d: %.1f MB/s\n", i + 1, size / elapsed / (1024 * 1024));
+  }
+
+  printf("%zu MB x %d: %.1f MB/s\n", size / (1024 * 1024), rounds,
+      size * rounds / total / (1024 * 1024));
+
+err_disconnect:
+  spice_disconnect();
+  while(spice_process(1)) {}
+err_server:
+  test_server_stop(server);
+err_data:
+  free(data);
+  return retval;
+}
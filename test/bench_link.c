@@ -0,0 +1,153 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* measures the CPU time spent linking channels. First the ticket encryption
+ * alone, with the server's key parsed once and then parsed for every ticket,
+ * then whole sessions linked to the server stand-in and torn down again. The
+ * latter includes the stand-in's own side of the handshake */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <spice/spice.h>
+#include "server.h"
+#include "rsa.h"
+
+static bool ready = false;
+
+static void on_ready()
+{
+  ready = true;
+}
+
+static double cpu_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool bench_ticket(int count, bool cached, double * perTicket)
+{
+  struct spice_rsa_key * key = NULL;
+  struct spice_password pass;
+
+  const double start = cpu_now();
+  for(int i = 0; i < count; ++i)
+  {
+    if (!spice_rsa_encrypt_password(&key, test_server_pub_key, "password",
+          &pass))
+    {
+      spice_rsa_free_key(key);
+      return false;
+    }
+    spice_rsa_free_password(&pass);
+
+    if (!cached)
+    {
+      spice_rsa_free_key(key);
+      key = NULL;
+    }
+  }
+  *perTicket = (cpu_now() - start) / count;
+
+  spice_rsa_free_key(key);
+  return true;
+}
+
+static bool bench_session(TestServer * server)
+{
+  ready = false;
+  if (!spice_connect("127.0.0.1", test_server_port(server), "password"))
+    return false;
+
+  while(!ready)
+    if (!spice_process(1000))
+      return false;
+
+  spice_disconnect();
+  while(spice_process(1)) {}
+  return true;
+}
+
+int main(int argc, char * argv[])
+{
+  int tickets  = 10000;
+  int sessions = 200;
+
+  if (argc > 1)
+    tickets = atoi(argv[1]);
+  if (argc > 2)
+    sessions = atoi(argv[2]);
+
+  if (tickets <= 0 || sessions <= 0)
+  {
+    printf("Usage: %s [tickets] [sessions]\n", argv[0]);
+    return -1;
+  }
+
+  double cached, parsed;
+  if (!bench_ticket(tickets, true , &cached) ||
+      !bench_ticket(tickets, false, &parsed))
+  {
+    printf("failed to encrypt the ticket\n");
+    return -1;
+  }
+
+  printf("ticket, cached key: %.2f us\n", cached * 1e6);
+  printf("ticket, parsed key: %.2f us\n", parsed * 1e6);
+
+  TestServer * server = test_server_start();
+  if (!server)
+  {
+    printf("failed to start the server\n");
+    return -1;
+  }
+
+  int retval = 0;
+  spice_set_ready_cb(on_ready);
+
+  // the first session parses the key and warms up, it isn't counted
+  if (!bench_session(server))
+  {
+    printf("failed to connect\n");
+    retval = -1;
+    goto err_server;
+  }
+
+  const unsigned int links = test_server_links(server);
+  const double       start = cpu_now();
+  for(int i = 0; i < sessions; ++i)
+    if (!bench_session(server))
+    {
+      printf("failed to connect\n");
+      retval = -1;
+      goto err_server;
+    }
+
+  const double elapsed = cpu_now() - start;
+  printf("%d sessions, %u links: %.2f us per link\n", sessions,
+      test_server_links(server) - links,
+      elapsed * 1e6 / (test_server_links(server) - links));
+
+err_server:
+  test_server_stop(server);
+  return retval;
+}
@@ -24,6 +24,13 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include <spice/spice.h>
 
+static bool ready = false;
+
+static void on_ready()
+{
+  ready = true;
+}
+
 int main(int argc, char * argv[])
 {
   char * host;
@@ -64,6 +71,7 @@ int main(int argc, char * argv[])
 
   printf("attempting to connect to %s:%d...", host, port);
   fflush(stdout);
+  spice_set_ready_cb(on_ready);
   if (!spice_connect(host, port, ""))
   {
     printf("spice connect failed\n");
@@ -74,8 +82,8 @@ int main(int argc, char * argv[])
 
   printf("waiting for comms setup...");
   fflush(stdout);
-  while(!spice_ready())
-    if (!spice_process(1))
+  while(!ready)
+    if (!spice_process(1000))
     {
       printf("fail\n");
       retval = -1;
@@ -0,0 +1,800 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "server.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#if defined(USE_TLS)
+#include <stdio.h>
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include <spice/protocol.h>
+#include "messages.h"
+
+// the most connections a server has open at once
+#define TEST_MAX_CONNS 16
+
+// the agent tokens given to the client in MAIN_INIT
+#define TEST_AGENT_TOKENS 10
+
+/* a 1024 bit RSA public key for the link reply, the server never decrypts the
+ * ticket so the private half isn't needed */
+const uint8_t test_server_pub_key[SPICE_TICKET_PUBKEY_BYTES] =
+{
+  0x30, 0x81, 0x9f, 0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7,
+  0x0d, 0x01, 0x01, 0x01, 0x05, 0x00, 0x03, 0x81, 0x8d, 0x00, 0x30, 0x81,
+  0x89, 0x02, 0x81, 0x81, 0x00, 0xcc, 0xea, 0xa1, 0x3d, 0xb6, 0x8a, 0x55,
+  0x04, 0x59, 0x75, 0x78, 0xa6, 0x4b, 0x1a, 0xbb, 0xc8, 0x40, 0x19, 0x5f,
+  0xf9, 0xd7, 0x3c, 0x2a, 0xf3, 0xde, 0xfc, 0x8e, 0xae, 0xc1, 0x4d, 0x45,
+  0xa0, 0xf0, 0xf3, 0xf9, 0x39, 0x3c, 0x10, 0x4a, 0x54, 0xd1, 0xf2, 0xd3,
+  0xc7, 0xfd, 0x97, 0x3a, 0xf8, 0x1e, 0xbb, 0x22, 0x9c, 0x64, 0x84, 0xf7,
+  0x82, 0x8a, 0x73, 0x6c, 0x5f, 0x64, 0xf6, 0xbb, 0x5a, 0x14, 0x1e, 0x74,
+  0x23, 0x94, 0x23, 0x09, 0x2c, 0x4b, 0x4f, 0x8a, 0xe1, 0xfe, 0xd7, 0xa4,
+  0x50, 0xda, 0xc7, 0x0c, 0x54, 0xf3, 0xc5, 0x3c, 0x63, 0x73, 0x41, 0xd2,
+  0x3f, 0xe1, 0x3d, 0x98, 0xd6, 0x00, 0x20, 0x91, 0xbb, 0xf4, 0x74, 0x54,
+  0xec, 0x95, 0x04, 0xa6, 0x37, 0x4b, 0x0d, 0xfa, 0x0f, 0x2f, 0xac, 0x9a,
+  0xf7, 0x29, 0x85, 0xfa, 0x4b, 0xf8, 0x74, 0xc4, 0x5f, 0x77, 0x4e, 0x83,
+  0x93, 0x02, 0x03, 0x01, 0x00, 0x01
+};
+
+struct TestConn
+{
+  TestServer    * server;
+  int             socket;
+#if defined(USE_TLS)
+  SSL           * ssl;
+#endif
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  uint8_t         type;
+  uint32_t        session;
+  bool            migrating;
+  bool            migData;
+  bool            migReset;
+  uint32_t        motion;
+  atomic_bool     done;
+};
+
+struct TestServer
+{
+  int             socket;
+  int             port;
+  pthread_t       thread;
+  uint32_t        sessionId;
+
+#if defined(USE_TLS)
+  SSL_CTX       * tlsCtx;
+  char            caFile[32];
+#endif
+
+  pthread_mutex_t lock;
+  struct TestConn conns[TEST_MAX_CONNS];
+  int             connCount;
+
+  // the most recently linked channels, the client's or a migrating one's
+  struct TestConn * main;
+  struct TestConn * inputs;
+
+  atomic_uint     links;
+  atomic_uint     migrated;
+  atomic_size_t   agentBytes;
+  atomic_uint     keys;
+};
+
+// ============================================================================
+
+static bool test_read(struct TestConn * conn, void * buffer, size_t size)
+{
+  uint8_t * buf = (uint8_t *)buffer;
+  while(size)
+  {
+#if defined(USE_TLS)
+    const ssize_t len = conn->ssl ?
+      SSL_read(conn->ssl, buf, size) :
+      read(conn->socket, buf, size);
+#else
+    const ssize_t len = read(conn->socket, buf, size);
+#endif
+    if (len <= 0)
+      return false;
+
+    buf  += len;
+    size -= len;
+  }
+  return true;
+}
+
+// ============================================================================
+
+static bool test_write(struct TestConn * conn, const void * buffer, size_t size)
+{
+  const uint8_t * buf = (const uint8_t *)buffer;
+  while(size)
+  {
+#if defined(USE_TLS)
+    const ssize_t len = conn->ssl ?
+      SSL_write(conn->ssl, buf, size) :
+      send(conn->socket, buf, size, MSG_NOSIGNAL);
+#else
+    const ssize_t len = send(conn->socket, buf, size, MSG_NOSIGNAL);
+#endif
+    if (len <= 0)
+      return false;
+
+    buf  += len;
+    size -= len;
+  }
+  return true;
+}
+
+// ============================================================================
+
+static bool test_send(struct TestConn * conn, uint16_t type, const void * data,
+    uint32_t size)
+{
+  SpiceMiniDataHeader header =
+  {
+    .type = type,
+    .size = size
+  };
+
+  pthread_mutex_lock(&conn->lock);
+  const bool ret =
+    test_write(conn, &header, sizeof(header)) &&
+    test_write(conn, data, size);
+  pthread_mutex_unlock(&conn->lock);
+
+  return ret;
+}
+
+// ============================================================================
+
+static bool test_link(struct TestConn * conn)
+{
+  SpiceLinkHeader header;
+  if (!test_read(conn, &header, sizeof(header)) ||
+      header.magic         != SPICE_MAGIC ||
+      header.major_version != SPICE_VERSION_MAJOR ||
+      header.size          <  sizeof(SpiceLinkMess))
+    return false;
+
+  uint8_t * body = malloc(header.size);
+  if (!body || !test_read(conn, body, header.size))
+  {
+    free(body);
+    return false;
+  }
+
+  const SpiceLinkMess * mess = (const SpiceLinkMess *)body;
+  conn->type    = mess->channel_type;
+  conn->session = mess->connection_id;
+  free(body);
+
+  /* a link carrying another server's session is migrating to this one, it
+   * waits for the session to be handed over rather than starting a new one */
+  TestServer * server = conn->server;
+  pthread_mutex_lock(&server->lock);
+  conn->migrating = conn->session != 0 && conn->session != server->sessionId;
+  if (conn->type == SPICE_CHANNEL_MAIN)
+    server->main = conn;
+  else
+    server->inputs = conn;
+  pthread_mutex_unlock(&server->lock);
+
+  const uint32_t commonCaps =
+    (1 << SPICE_COMMON_CAP_PROTOCOL_AUTH_SELECTION) |
+    (1 << SPICE_COMMON_CAP_AUTH_SPICE             ) |
+    (1 << SPICE_COMMON_CAP_MINI_HEADER            );
+
+  const uint32_t mainCaps =
+    (1 << SPICE_MAIN_CAP_AGENT_CONNECTED_TOKENS);
+
+  struct
+  {
+    SpiceLinkHeader header;
+    SpiceLinkReply  reply;
+    uint32_t        caps[2];
+  }
+  __attribute__((packed)) reply =
+  {
+    .header =
+    {
+      .magic         = SPICE_MAGIC,
+      .major_version = SPICE_VERSION_MAJOR,
+      .minor_version = SPICE_VERSION_MINOR,
+      .size          = sizeof(SpiceLinkReply) + sizeof(uint32_t) *
+        (conn->type == SPICE_CHANNEL_MAIN ? 2 : 1)
+    },
+    .reply =
+    {
+      .error            = SPICE_LINK_ERR_OK,
+      .num_common_caps  = 1,
+      .num_channel_caps = conn->type == SPICE_CHANNEL_MAIN ? 1 : 0,
+      .caps_offset      = sizeof(SpiceLinkReply)
+    },
+    .caps = { commonCaps, mainCaps }
+  };
+  memcpy(reply.reply.pub_key, test_server_pub_key,
+      sizeof(test_server_pub_key));
+
+  if (!test_write(conn, &reply, sizeof(reply.header) + reply.header.size))
+    return false;
+
+  // any ticket is accepted
+  SpiceLinkAuthMechanism   auth;
+  SpiceLinkEncryptedTicket ticket;
+  if (!test_read(conn, &auth  , sizeof(auth  )) ||
+      !test_read(conn, &ticket, sizeof(ticket)))
+    return false;
+
+  const uint32_t result = SPICE_LINK_ERR_OK;
+  if (!test_write(conn, &result, sizeof(result)))
+    return false;
+
+  atomic_fetch_add(&server->links, 1);
+  return true;
+}
+
+// ============================================================================
+
+static bool test_init(struct TestConn * conn)
+{
+  if (conn->type == SPICE_CHANNEL_INPUTS)
+  {
+    const uint16_t modifiers = 0;
+    return test_send(conn, SPICE_MSG_INPUTS_INIT, &modifiers, sizeof(modifiers));
+  }
+
+  const SpiceMsgMainInit init =
+  {
+    .session_id            = conn->session ? conn->session :
+      conn->server->sessionId,
+    .display_channels_hint = 1,
+    .supported_mouse_modes = SPICE_MOUSE_MODE_SERVER | SPICE_MOUSE_MODE_CLIENT,
+    .current_mouse_mode    = SPICE_MOUSE_MODE_CLIENT,
+    .agent_connected       = 1,
+    .agent_tokens          = TEST_AGENT_TOKENS
+  };
+
+  struct
+  {
+    uint32_t       count;
+    SpiceChannelID channels[1];
+  }
+  __attribute__((packed)) list =
+  {
+    .count    = 1,
+    .channels = { { .type = SPICE_CHANNEL_INPUTS } }
+  };
+
+  return
+    test_send(conn, SPICE_MSG_MAIN_INIT         , &init, sizeof(init)) &&
+    test_send(conn, SPICE_MSG_MAIN_CHANNELS_LIST, &list, sizeof(list));
+}
+
+// ============================================================================
+
+static struct TestConn * test_get_conn(TestServer * server, uint8_t type)
+{
+  pthread_mutex_lock(&server->lock);
+  struct TestConn * conn =
+    type == SPICE_CHANNEL_MAIN ? server->main : server->inputs;
+  pthread_mutex_unlock(&server->lock);
+  return conn;
+}
+
+// ============================================================================
+
+static bool test_on_migrate_message(struct TestConn * conn, uint16_t type)
+{
+  TestServer * server = conn->server;
+  switch(type)
+  {
+    // source, the client has linked to the destination
+    case SPICE_MSGC_MAIN_MIGRATE_CONNECTED:
+      return test_send(conn, SPICE_MSG_MAIN_MIGRATE_END, NULL, 0);
+
+    case SPICE_MSGC_MAIN_MIGRATE_CONNECTED_SEAMLESS:
+    {
+      const SpiceMsgMigrate msg =
+      {
+        .flags = SPICE_MIGRATE_NEED_FLUSH | SPICE_MIGRATE_NEED_DATA_TRANSFER
+      };
+
+      struct TestConn * inputs = test_get_conn(server, SPICE_CHANNEL_INPUTS);
+      return
+        inputs &&
+        test_send(inputs, SPICE_MSG_MIGRATE, &msg, sizeof(msg)) &&
+        test_send(conn  , SPICE_MSG_MIGRATE, &msg, sizeof(msg));
+    }
+
+    // destination, the session is taken over
+    case SPICE_MSGC_MAIN_MIGRATE_DST_DO_SEAMLESS:
+      return test_send(conn, SPICE_MSG_MAIN_MIGRATE_DST_SEAMLESS_ACK, NULL, 0);
+
+    case SPICE_MSGC_MAIN_MIGRATE_END:
+    {
+      if (!conn->migrating)
+        return true;
+
+      conn->migrating = false;
+
+      if (conn->migData)
+        return true;
+
+      /* semi-seamless, the session starts over. Other messages may come
+       * ahead of the init, the clock is sent first to be sure the client
+       * copes with that */
+      struct TestConn * inputs = test_get_conn(server, SPICE_CHANNEL_INPUTS);
+      const uint32_t time = 0;
+
+      conn->migReset = true;
+      return
+        inputs &&
+        test_send(conn, SPICE_MSG_MAIN_MULTI_MEDIA_TIME, &time, sizeof(time)) &&
+        test_init(conn) &&
+        test_init(inputs);
+    }
+
+    // the client has taken the restarted session up, both channels moved
+    case SPICE_MSGC_MAIN_ATTACH_CHANNELS:
+      if (conn->migReset)
+      {
+        conn->migReset = false;
+        atomic_fetch_add(&server->migrated, 2);
+      }
+      return true;
+  }
+
+  return true;
+}
+
+// ============================================================================
+
+static bool test_on_message(struct TestConn * conn, uint16_t type,
+    const uint8_t * data, uint32_t size)
+{
+  TestServer * server = conn->server;
+
+  switch(type)
+  {
+    // source, the channel's state is sent on to the destination by the client
+    case SPICE_MSGC_MIGRATE_FLUSH_MARK:
+    {
+      const uint32_t state = 0x5350;
+      return test_send(conn, SPICE_MSG_MIGRATE_DATA, &state, sizeof(state));
+    }
+
+    // destination, the state has arrived and the channel is taken over
+    case SPICE_MSGC_MIGRATE_DATA:
+      conn->migData = true;
+      atomic_fetch_add(&server->migrated, 1);
+      return true;
+  }
+
+  if (conn->type == SPICE_CHANNEL_MAIN)
+  {
+    if (type == SPICE_MSGC_MAIN_AGENT_DATA)
+      atomic_fetch_add(&server->agentBytes, size);
+    return test_on_migrate_message(conn, type);
+  }
+
+  switch(type)
+  {
+    case SPICE_MSGC_INPUTS_KEY_DOWN:
+      atomic_fetch_add(&server->keys, 1);
+      break;
+
+    case SPICE_MSGC_INPUTS_MOUSE_MOTION:
+    case SPICE_MSGC_INPUTS_MOUSE_POSITION:
+      if (++conn->motion % SPICE_INPUT_MOTION_ACK_BUNCH == 0)
+        return test_send(conn, SPICE_MSG_INPUTS_MOUSE_MOTION_ACK, NULL, 0);
+      break;
+  }
+
+  return true;
+}
+
+// ============================================================================
+
+static void * test_conn_thread(void * opaque)
+{
+  struct TestConn * conn = (struct TestConn *)opaque;
+
+#if defined(USE_TLS)
+  if (conn->server->tlsCtx)
+  {
+    if (!(conn->ssl = SSL_new(conn->server->tlsCtx)) ||
+        !SSL_set_fd(conn->ssl, conn->socket) ||
+        SSL_accept(conn->ssl) != 1)
+      goto done;
+  }
+#endif
+
+  if (!test_link(conn) || (!conn->migrating && !test_init(conn)))
+    goto done;
+
+  uint8_t * data = NULL;
+  for(;;)
+  {
+    SpiceMiniDataHeader header;
+    if (!test_read(conn, &header, sizeof(header)))
+      break;
+
+    if (header.type == SPICE_MSGC_DISCONNECTING)
+      break;
+
+    uint8_t * newData = realloc(data, header.size ? header.size : 1);
+    if (!newData)
+      break;
+
+    data = newData;
+    if (!test_read(conn, data, header.size) ||
+        !test_on_message(conn, header.type, data, header.size))
+      break;
+  }
+  free(data);
+
+done:
+  shutdown(conn->socket, SHUT_RDWR);
+  atomic_store(&conn->done, true);
+  return NULL;
+}
+
+// ============================================================================
+
+static void * test_accept_thread(void * opaque)
+{
+  TestServer * server = (TestServer *)opaque;
+
+  for(;;)
+  {
+    const int fd = accept(server->socket, NULL, NULL);
+    if (fd < 0)
+      break;
+
+    pthread_mutex_lock(&server->lock);
+
+    // reuse the slot of a connection that has finished
+    struct TestConn * conn = NULL;
+    for(int i = 0; i < server->connCount; ++i)
+      if (atomic_load(&server->conns[i].done))
+      {
+        conn = &server->conns[i];
+        if (conn->socket >= 0)
+        {
+          pthread_join(conn->thread, NULL);
+          close(conn->socket);
+        }
+#if defined(USE_TLS)
+        SSL_free(conn->ssl);
+#endif
+        pthread_mutex_destroy(&conn->lock);
+        break;
+      }
+
+    if (!conn)
+    {
+      if (server->connCount == TEST_MAX_CONNS)
+      {
+        pthread_mutex_unlock(&server->lock);
+        close(fd);
+        continue;
+      }
+      conn = &server->conns[server->connCount++];
+    }
+
+    memset(conn, 0, sizeof(*conn));
+    conn->server = server;
+    conn->socket = fd;
+    pthread_mutex_init(&conn->lock, NULL);
+
+    if (pthread_create(&conn->thread, NULL, test_conn_thread, conn) != 0)
+    {
+      // a finished connection with no thread, the slot is reused
+      conn->socket = -1;
+      close(fd);
+      atomic_store(&conn->done, true);
+    }
+    pthread_mutex_unlock(&server->lock);
+  }
+
+  return NULL;
+}
+
+// ============================================================================
+
+#if defined(USE_TLS)
+static bool test_tls_add_ext(X509 * cert, int nid, const char * value)
+{
+  X509V3_CTX ctx;
+  X509V3_set_ctx_nodb(&ctx);
+  X509V3_set_ctx(&ctx, cert, cert, NULL, NULL, 0);
+
+  X509_EXTENSION * ext = X509V3_EXT_conf_nid(NULL, &ctx, nid, (char *)value);
+  if (!ext)
+    return false;
+
+  const bool ret = X509_add_ext(cert, ext, -1);
+  X509_EXTENSION_free(ext);
+  return ret;
+}
+
+// ============================================================================
+
+/* generates a key and a self-signed certificate for 127.0.0.1, the
+ * certificate is written out for the client to trust */
+static bool test_tls_init(TestServer * server)
+{
+  bool       ret  = false;
+  EVP_PKEY * key  = NULL;
+  X509     * cert = NULL;
+
+  EVP_PKEY_CTX * keyCtx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+  if (!keyCtx ||
+      EVP_PKEY_keygen_init(keyCtx) <= 0 ||
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyCtx,
+        NID_X9_62_prime256v1) <= 0 ||
+      EVP_PKEY_keygen(keyCtx, &key) <= 0)
+    goto out;
+
+  if (!(cert = X509_new()))
+    goto out;
+
+  X509_NAME * name = X509_get_subject_name(cert);
+  if (!X509_set_version(cert, 2) ||
+      !ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) ||
+      !X509_gmtime_adj(X509_getm_notBefore(cert), 0) ||
+      !X509_gmtime_adj(X509_getm_notAfter (cert), 60 * 60) ||
+      !X509_set_pubkey(cert, key) ||
+      !X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+        (const unsigned char *)"127.0.0.1", -1, -1, 0) ||
+      !X509_set_issuer_name(cert, name) ||
+      !test_tls_add_ext(cert, NID_basic_constraints, "critical,CA:TRUE") ||
+      !test_tls_add_ext(cert, NID_subject_alt_name , "IP:127.0.0.1") ||
+      !X509_sign(cert, key, EVP_sha256()))
+    goto out;
+
+  if (!(server->tlsCtx = SSL_CTX_new(TLS_server_method())) ||
+      SSL_CTX_use_certificate(server->tlsCtx, cert) != 1 ||
+      SSL_CTX_use_PrivateKey (server->tlsCtx, key ) != 1)
+    goto out;
+
+  // the client resumes the main channel's session for the others
+  static const unsigned char sessionCtx[] = "spice-test";
+  SSL_CTX_set_session_id_context(server->tlsCtx, sessionCtx,
+      sizeof(sessionCtx) - 1);
+
+  strcpy(server->caFile, "/tmp/spice-test-XXXXXX");
+  const int fd = mkstemp(server->caFile);
+  if (fd < 0)
+    goto out;
+
+  FILE * file = fdopen(fd, "w");
+  if (!file)
+  {
+    close(fd);
+    goto out_unlink;
+  }
+
+  ret = PEM_write_X509(file, cert) == 1;
+  if (fclose(file) != 0)
+    ret = false;
+
+out_unlink:
+  if (!ret)
+    unlink(server->caFile);
+out:
+  if (!ret)
+  {
+    SSL_CTX_free(server->tlsCtx);
+    server->tlsCtx = NULL;
+  }
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  EVP_PKEY_CTX_free(keyCtx);
+  return ret;
+}
+#endif
+
+// ============================================================================
+
+static TestServer * test_server_create(bool tls)
+{
+  TestServer * server = calloc(1, sizeof(*server));
+  if (!server)
+    return NULL;
+
+  pthread_mutex_init(&server->lock, NULL);
+
+#if defined(USE_TLS)
+  if (tls && !test_tls_init(server))
+    goto err;
+#else
+  if (tls)
+    goto err;
+#endif
+
+  server->socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server->socket < 0)
+    goto err;
+
+  struct sockaddr_in addr =
+  {
+    .sin_family      = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+  };
+  socklen_t addrLen = sizeof(addr);
+
+  if (bind(server->socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(server->socket, TEST_MAX_CONNS) < 0 ||
+      getsockname(server->socket, (struct sockaddr *)&addr, &addrLen) < 0)
+    goto err_socket;
+
+  // each server has its own session so a migrating one can be told apart
+  server->port      = ntohs(addr.sin_port);
+  server->sessionId = 0x53500000 | server->port;
+  if (pthread_create(&server->thread, NULL, test_accept_thread, server) != 0)
+    goto err_socket;
+
+  return server;
+
+err_socket:
+  close(server->socket);
+err:
+#if defined(USE_TLS)
+  if (server->tlsCtx)
+  {
+    SSL_CTX_free(server->tlsCtx);
+    unlink(server->caFile);
+  }
+#endif
+  pthread_mutex_destroy(&server->lock);
+  free(server);
+  return NULL;
+}
+
+// ============================================================================
+
+TestServer * test_server_start()
+{
+  return test_server_create(false);
+}
+
+TestServer * test_server_start_tls()
+{
+  return test_server_create(true);
+}
+
+// ============================================================================
+
+void test_server_stop(TestServer * server)
+{
+  // shutting the sockets down wakes the threads blocked on them
+  shutdown(server->socket, SHUT_RDWR);
+  pthread_join(server->thread, NULL);
+  close(server->socket);
+
+  for(int i = 0; i < server->connCount; ++i)
+  {
+    struct TestConn * conn = &server->conns[i];
+    if (conn->socket >= 0)
+    {
+      shutdown(conn->socket, SHUT_RDWR);
+      pthread_join(conn->thread, NULL);
+      close(conn->socket);
+    }
+#if defined(USE_TLS)
+    SSL_free(conn->ssl);
+#endif
+    pthread_mutex_destroy(&conn->lock);
+  }
+
+#if defined(USE_TLS)
+  if (server->tlsCtx)
+  {
+    SSL_CTX_free(server->tlsCtx);
+    unlink(server->caFile);
+  }
+#endif
+
+  pthread_mutex_destroy(&server->lock);
+  free(server);
+}
+
+// ============================================================================
+
+int test_server_port(TestServer * server)
+{
+  return server->port;
+}
+
+const char * test_server_ca_file(TestServer * server)
+{
+#if defined(USE_TLS)
+  return server->tlsCtx ? server->caFile : NULL;
+#else
+  return NULL;
+#endif
+}
+
+unsigned int test_server_links(TestServer * server)
+{
+  return atomic_load(&server->links);
+}
+
+size_t test_server_agent_bytes(TestServer * server)
+{
+  return atomic_load(&server->agentBytes);
+}
+
+unsigned int test_server_keys(TestServer * server)
+{
+  return atomic_load(&server->keys);
+}
+
+unsigned int test_server_migrated(TestServer * server)
+{
+  return atomic_load(&server->migrated);
+}
+
+// ============================================================================
+
+bool test_server_migrate(TestServer * server, int port, bool seamless)
+{
+  static const char host[] = "127.0.0.1";
+
+  struct
+  {
+    SpiceMsgMainMigrateBeginSeamless begin;
+    char                             host[sizeof(host)];
+  }
+  __attribute__((packed)) msg;
+
+  // the plain message is the seamless one without the version
+  const size_t fixed = seamless ?
+    sizeof(SpiceMsgMainMigrateBeginSeamless) :
+    sizeof(SpiceMsgMainMigrationBegin);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.begin.dst_info.port        = port;
+  msg.begin.dst_info.host_size   = sizeof(host);
+  msg.begin.dst_info.host_offset = fixed;
+  msg.begin.src_mig_version      = 1;
+
+  uint8_t * body = (uint8_t *)&msg;
+  memcpy(body + fixed, host, sizeof(host));
+
+  struct TestConn * conn = test_get_conn(server, SPICE_CHANNEL_MAIN);
+  return conn && test_send(conn, seamless ?
+      SPICE_MSG_MAIN_MIGRATE_BEGIN_SEAMLESS : SPICE_MSG_MAIN_MIGRATE_BEGIN,
+      body, fixed + sizeof(host));
+}
@@ -0,0 +1,64 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PURE_SPICE_TEST_SERVER_H__
+#define PURE_SPICE_TEST_SERVER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* a minimal SPICE server stand-in that runs on its own threads in the test's
+ * process. It links the main and inputs channels on 127.0.0.1, accepts any
+ * password and counts what the client sends it */
+typedef struct TestServer TestServer;
+
+// the DER encoded public key sent in the link reply, 162 bytes long
+extern const uint8_t test_server_pub_key[];
+
+TestServer * test_server_start();
+void         test_server_stop(TestServer * server);
+int          test_server_port(TestServer * server);
+
+/* as above but every channel is served over TLS with a newly generated
+ * self-signed certificate for 127.0.0.1, the certificate is written to the
+ * file given by test_server_ca_file. Fails when built without USE_TLS. The
+ * connections are only safe to use from their own threads so such a server
+ * can't take part in a migration */
+TestServer * test_server_start_tls();
+const char * test_server_ca_file(TestServer * server);
+
+// the number of channel links accepted
+unsigned int test_server_links(TestServer * server);
+
+// the number of agent data bytes received on the main channel
+size_t       test_server_agent_bytes(TestServer * server);
+
+// the number of key down events received on the inputs channel
+unsigned int test_server_keys(TestServer * server);
+
+// the number of channels the client has taken up after migrating here
+unsigned int test_server_migrated(TestServer * server);
+
+/* send the client to the server listening on port on 127.0.0.1, seamlessly
+ * with the channels' state passed on or semi-seamlessly with the session
+ * started over once the client has switched */
+bool         test_server_migrate(TestServer * server, int port, bool seamless);
+
+#endif /* PURE_SPICE_TEST_SERVER_H__ */
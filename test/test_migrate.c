@@ -0,0 +1,203 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* migrates a session between two server stand-ins, both seamlessly and
+ * semi-seamlessly, and checks that input reaches the destination afterwards.
+ * Each is repeated with the I/O thread running and another thread sending
+ * mouse input throughout, so the channel locks are contended as the
+ * channels switch over */
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <spice/spice.h>
+#include "server.h"
+
+// how long each step may take in ms
+#define TEST_TIMEOUT 5000
+
+static bool ready = false;
+static atomic_bool inputStop;
+
+static void on_ready()
+{
+  ready = true;
+}
+
+static unsigned int now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool wait_migrated(TestServer * dst, unsigned int count)
+{
+  const unsigned int start = now_ms();
+  while(test_server_migrated(dst) < count)
+  {
+    if (!spice_process(10))
+    {
+      printf("the connection failed while migrating\n");
+      return false;
+    }
+
+    if (now_ms() - start > TEST_TIMEOUT)
+    {
+      printf("timed out migrating\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool wait_key(TestServer * dst)
+{
+  const unsigned int keys  = test_server_keys(dst);
+  const unsigned int start = now_ms();
+
+  // KEY_A
+  if (!spice_key_down(0x1e) || !spice_key_up(0x1e))
+  {
+    printf("failed to send the key\n");
+    return false;
+  }
+
+  while(test_server_keys(dst) == keys)
+  {
+    if (!spice_process(10))
+    {
+      printf("the connection failed after migrating\n");
+      return false;
+    }
+
+    if (now_ms() - start > TEST_TIMEOUT)
+    {
+      printf("the key never reached the destination\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+static void * input_thread(void * opaque)
+{
+  for(uint32_t i = 0; !atomic_load(&inputStop); ++i)
+  {
+    spice_mouse_position(i & 0xff, i & 0xff);
+    spice_mouse_motion(1, 1);
+  }
+  return NULL;
+}
+
+static bool test_migrate(bool seamless, bool contended)
+{
+  char name[64];
+  snprintf(name, sizeof(name), "%s%s",
+      seamless  ? "seamless" : "semi-seamless",
+      contended ? ", contended" : "");
+
+  TestServer * src = test_server_start();
+  TestServer * dst = test_server_start();
+  if (!src || !dst)
+  {
+    printf("%s: failed to start the servers\n", name);
+    if (src)
+      test_server_stop(src);
+    if (dst)
+      test_server_stop(dst);
+    return false;
+  }
+
+  bool ok = false;
+  ready = false;
+  if (!spice_connect("127.0.0.1", test_server_port(src), ""))
+  {
+    printf("%s: spice connect failed\n", name);
+    goto out;
+  }
+
+  while(!ready)
+    if (!spice_process(1000))
+    {
+      printf("%s: failed to connect\n", name);
+      goto out_disconnect;
+    }
+
+  pthread_t thread;
+  bool      threaded = false;
+  if (contended)
+  {
+    atomic_store(&inputStop, false);
+    if (!spice_start_io_thread(-1, 0) ||
+        pthread_create(&thread, NULL, input_thread, NULL) != 0)
+    {
+      printf("%s: failed to start the threads\n", name);
+      goto out_threads;
+    }
+    threaded = true;
+  }
+
+  if (!test_server_migrate(src, test_server_port(dst), seamless))
+  {
+    printf("%s: failed to start the migration\n", name);
+    goto out_threads;
+  }
+
+  // both the main and inputs channels move over
+  if (!wait_migrated(dst, 2) || !wait_key(dst))
+  {
+    printf("%s: failed\n", name);
+    goto out_threads;
+  }
+
+  printf("%s: ok\n", name);
+  ok = true;
+
+out_threads:
+  if (threaded)
+  {
+    atomic_store(&inputStop, true);
+    pthread_join(thread, NULL);
+  }
+  spice_stop_io_thread();
+
+out_disconnect:
+  spice_disconnect();
+  while(spice_process(1)) {}
+out:
+  test_server_stop(dst);
+  test_server_stop(src);
+  return ok;
+}
+
+int main(int argc, char * argv[])
+{
+  spice_set_ready_cb(on_ready);
+
+  bool ok = true;
+  for(int contended = 0; contended < 2; ++contended)
+  {
+    ok = test_migrate(true , contended) && ok;
+    ok = test_migrate(false, contended) && ok;
+  }
+  return ok ? 0 : -1;
+}
@@ -0,0 +1,111 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* connects over TLS to a server stand-in with a self-signed certificate, once
+ * trusting it and once against the system's CAs which must be refused */
+
+#include <stdio.h>
+#include <time.h>
+
+#include <spice/spice.h>
+#include "server.h"
+
+// how long each step may take in ms
+#define TEST_TIMEOUT 5000
+
+static bool ready = false;
+
+static void on_ready()
+{
+  ready = true;
+}
+
+static unsigned int now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// connects and sends a key, true if the server received it
+static bool test_session(TestServer * server)
+{
+  ready = false;
+  if (!spice_connect("127.0.0.1", test_server_port(server), ""))
+    return false;
+
+  const unsigned int start = now_ms();
+  bool ok = false;
+
+  while(!ready)
+    if (!spice_process(10) || now_ms() - start > TEST_TIMEOUT)
+      goto out;
+
+  // KEY_A
+  if (!spice_key_down(0x1e) || !spice_key_up(0x1e))
+    goto out;
+
+  while(test_server_keys(server) == 0)
+    if (!spice_process(10) || now_ms() - start > TEST_TIMEOUT)
+      goto out;
+
+  ok = true;
+
+out:
+  spice_disconnect();
+  while(spice_process(1)) {}
+  return ok;
+}
+
+int main(int argc, char * argv[])
+{
+  int retval = 0;
+  spice_set_ready_cb(on_ready);
+
+  TestServer * server = test_server_start_tls();
+  if (!server)
+  {
+    printf("failed to start the server\n");
+    return -1;
+  }
+
+  if (!spice_set_tls(true, test_server_ca_file(server), true) ||
+      !test_session(server))
+  {
+    printf("trusted: failed\n");
+    retval = -1;
+  }
+  else
+    printf("trusted: ok\n");
+
+  const unsigned int links = test_server_links(server);
+  if (!spice_set_tls(true, NULL, true) ||
+      test_session(server) ||
+      test_server_links(server) != links)
+  {
+    printf("untrusted: failed\n");
+    retval = -1;
+  }
+  else
+    printf("untrusted: ok\n");
+
+  spice_set_tls(false, NULL, false);
+  test_server_stop(server);
+  return retval;
+}